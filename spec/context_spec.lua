@@ -0,0 +1,46 @@
+#!/usr/bin/env lua
+
+require 'busted.runner'()
+
+-- own_context() must be called before first connection, so state is created
+-- here from scratch, even if other spec files loaded easydbus before
+package.loaded['easydbus'] = nil
+package.loaded['easydbus.core'] = nil
+local dbus = require 'easydbus'
+
+local service_name = 'spec.easydbus.context'
+local object_path = '/spec/easydbus/context'
+local interface_name = 'spec.easydbus.context'
+
+describe('Own main context', function()
+   it('Call method of service on own context', function()
+      assert.is_true(dbus.own_context())
+      -- second call does nothing
+      assert.is_true(dbus.own_context())
+
+      local bus = assert(dbus.session())
+      local owner_id = assert(bus:own_name(service_name))
+
+      local object = dbus.object(object_path, interface_name)
+      object:add_method('Echo', 's', 's', function(s) return s end)
+      local object_id = assert(bus:register_object(object))
+
+      local ret
+      dbus.add_callback(function()
+         ret = bus:call(service_name, object_path, interface_name, 'Echo', 's', 'context')
+         dbus.mainloop_quit()
+      end)
+      dbus.mainloop()
+
+      assert.is_true(bus:unregister_object(object_id))
+      bus:unown_name(owner_id)
+
+      assert.are.equal('context', ret)
+   end)
+
+   it('Reuse private connection', function()
+      assert.is_true(dbus.own_context())
+      -- bus objects refer to the same connection
+      assert.are.equal(assert(dbus.session())[1], assert(dbus.session())[1])
+   end)
+end)
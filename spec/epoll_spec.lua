@@ -0,0 +1,45 @@
+#!/usr/bin/env lua
+
+require 'busted.runner'()
+
+-- Epoll callback turns state into external event loop mode for good, so
+-- state is created here from scratch, even if other spec files loaded
+-- easydbus before
+package.loaded['easydbus'] = nil
+package.loaded['easydbus.core'] = nil
+local dbus = require 'easydbus'
+
+local pack = table.pack or dbus.pack
+
+local object_path = '/spec/easydbus/epoll'
+local interface_name = 'spec.easydbus.epoll'
+
+describe('External event loop', function()
+   it('Receives signal through epoll fd', function()
+      local bus = assert(dbus.session())
+
+      local received
+      bus:subscribe(nil, object_path, interface_name, 'EpollSignal', function(...)
+         received = pack(...)
+      end)
+
+      local epoll_fd, timeout
+      local arg = {}
+      assert.is_true(dbus.set_epoll_cb(function(cb_arg, fd, t)
+         assert.are.equal(arg, cb_arg)
+         epoll_fd, timeout = fd, t
+      end, arg))
+      assert.are.equal('number', type(epoll_fd))
+      assert.are.equal('number', type(timeout))
+
+      assert.is_true(bus:emit(nil, object_path, interface_name, 'EpollSignal', 's', 'epoll'))
+
+      -- Host loop would wait for epoll fd, busy polling is enough here
+      local deadline = os.time() + 5
+      while not received and os.time() < deadline do
+         dbus.handle_epoll()
+      end
+
+      assert.are.same(pack('epoll'), received)
+   end)
+end)
@@ -0,0 +1,19 @@
+--
+--  Copyright 2016, Grinn
+--
+--  SPDX-License-Identifier: MIT
+--
+
+-- Handler module loaded by every worker of pool in service_spec.lua
+
+local dbus = require 'easydbus'
+
+local object = dbus.object('/spec/easydbus/pool', 'spec.easydbus.pool')
+object:add_method('Square', 'i', 'i', function(n)
+   return n * n
+end)
+object:add_method('Fail', '', '', function()
+   error(dbus.error('spec.easydbus.Error', 'failed in worker'))
+end)
+
+return object
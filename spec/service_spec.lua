@@ -59,6 +59,135 @@ describe('Service creation', function()
    end)
 end)
 
+describe('Method dispatch', function()
+   it('Handler arguments and pooled coroutines', function()
+      local bus = assert(dbus[bus_name]())
+      local owner_id = assert(bus:own_name(service_name))
+
+      local threads = {}
+      local object = dbus.object(object_path, interface_name)
+      object:add_method('Add', 'i', 'i', function(a, b)
+         threads[#threads+1] = coroutine.running()
+         return a + b
+      end, 10)
+      local object_id = assert(bus:register_object(object))
+
+      local ret = {}
+      dbus.add_callback(function()
+         for i = 1,3 do
+            ret[i] = bus:call(service_name, object_path, interface_name, 'Add', 'i', i)
+         end
+         dbus.mainloop_quit()
+      end)
+      dbus.mainloop()
+
+      assert.is_true(bus:unregister_object(object_id))
+      bus:unown_name(owner_id)
+
+      assert.are.same({11, 12, 13}, ret)
+      assert.are.equal(threads[1], threads[2])
+      assert.are.equal(threads[2], threads[3])
+   end)
+
+   it('Asynchronous handlers', function()
+      local bus = assert(dbus[bus_name]())
+      local owner_id = assert(bus:own_name(service_name))
+
+      local object = dbus.object(object_path, interface_name)
+      object:add_method('Echo', 's', 's', function(s) return s end)
+      object:add_method('Forward', 's', 's', function(s)
+         -- handler waits for another call, without blocking the service
+         return bus:call(service_name, object_path, interface_name, 'Echo', 's', s .. '!')
+      end)
+      object:add_method('Fail', '', '', function()
+         bus:call(service_name, object_path, interface_name, 'Echo', 's', '')
+         error('failed after yield')
+      end)
+      local object_id = assert(bus:register_object(object))
+
+      local ret, ok, err
+      dbus.add_callback(function()
+         ret = bus:call(service_name, object_path, interface_name, 'Forward', 's', 'Hello')
+         ok, err = bus:call({timeout = 5000}, service_name, object_path, interface_name, 'Fail')
+         dbus.mainloop_quit()
+      end)
+      dbus.mainloop()
+
+      assert.is_true(bus:unregister_object(object_id))
+      bus:unown_name(owner_id)
+
+      assert.are.equal('Hello!', ret)
+      assert.is_nil(ok)
+      assert.is_truthy(tostring(err):find('failed after yield'))
+   end)
+
+   it('Errors of yielded handlers', function()
+      local bus = assert(dbus[bus_name]())
+      local owner_id = assert(bus:own_name(service_name))
+
+      local object = dbus.object(object_path, interface_name)
+      object:add_method('Echo', 's', 's', function(s) return s end)
+      object:add_method('BadReturn', '', 'i', function()
+         bus:call(service_name, object_path, interface_name, 'Echo', 's', '')
+         return 'not a number'
+      end)
+      object:add_method('Abandon', '', '', function()
+         -- nothing will resume this handler, so it is collected
+         dbus.add_callback(function() collectgarbage() collectgarbage() end)
+         coroutine.yield()
+      end)
+      local object_id = assert(bus:register_object(object))
+
+      local errors = {}
+      dbus.add_callback(function()
+         for _,method in ipairs{'BadReturn', 'Abandon'} do
+            local _, err = bus:call({timeout = 5000}, service_name, object_path, interface_name, method)
+            errors[method] = err
+         end
+         dbus.mainloop_quit()
+      end)
+      dbus.mainloop()
+
+      assert.is_true(bus:unregister_object(object_id))
+      bus:unown_name(owner_id)
+
+      assert.are.equal('org.freedesktop.DBus.Error.Failed', errors.BadReturn.name)
+      assert.are.equal('org.freedesktop.DBus.Error.Failed', errors.Abandon.name)
+      assert.is_truthy(errors.Abandon.message:find('never resumed'))
+   end)
+
+   it('Error replies', function()
+      local bus = assert(dbus[bus_name]())
+      local owner_id = assert(bus:own_name(service_name))
+
+      local object = dbus.object(object_path, interface_name)
+      object:add_method('Named', '', '', function()
+         error(dbus.error('spec.easydbus.Error.Busy', 'Try again'))
+      end)
+      object:add_method('Raise', '', '', function() error('plain error') end)
+      local object_id = assert(bus:register_object(object))
+
+      local errors = {}
+      dbus.add_callback(function()
+         for _,method in ipairs{'Named', 'Raise'} do
+            local _, err = bus:call({timeout = 5000}, service_name, object_path, interface_name, method)
+            errors[method] = err
+         end
+         dbus.mainloop_quit()
+      end)
+      dbus.mainloop()
+
+      assert.is_true(bus:unregister_object(object_id))
+      bus:unown_name(owner_id)
+
+      assert.are.equal('spec.easydbus.Error.Busy', errors.Named.name)
+      assert.are.equal('Try again', errors.Named.message)
+      assert.are.equal('spec.easydbus.Error.Busy: Try again', tostring(errors.Named))
+      assert.are.equal('org.freedesktop.DBus.Error.Failed', errors.Raise.name)
+      assert.is_truthy(errors.Raise.message:find('plain error'))
+   end)
+end)
+
 describe('Method handlers return values', function()
    local bus
    local owner_id
@@ -279,6 +408,717 @@ describe('Method handlers return values', function()
    end)
 end)
 
+describe('Large payloads', function()
+   local function echo(sig, value)
+      local bus = assert(dbus[bus_name]())
+      local owner_id = assert(bus:own_name(service_name))
+
+      local object = dbus.object(object_path, interface_name)
+      object:add_method('Echo', sig, sig, function(...) return ... end)
+      local object_id = assert(bus:register_object(object))
+
+      local ret
+      dbus.add_callback(function()
+         ret = pack(bus:call(service_name, object_path, interface_name, 'Echo', sig, value))
+         dbus.mainloop_quit()
+      end)
+      dbus.mainloop()
+
+      assert.is_true(bus:unregister_object(object_id))
+      bus:unown_name(owner_id)
+
+      assert.are.same(pack(value), ret)
+   end
+
+   it('Byte array', function()
+      local value = {}
+      for i = 1, 100000 do
+         value[i] = i % 256
+      end
+      echo('ay', value)
+   end)
+
+   it('Double array', function()
+      local value = {}
+      for i = 1, 10000 do
+         value[i] = i + 0.5
+      end
+      echo('ad', value)
+   end)
+
+   it('String array with wide framing offsets', function()
+      local value = {}
+      for i = 1, 10000 do
+         value[i] = 'string' .. i
+      end
+      echo('as', value)
+   end)
+
+   it('Dictionary of variants', function()
+      local value = {}
+      for i = 1, 1000 do
+         value['key' .. i] = i
+      end
+      echo('a{sv}', value)
+   end)
+end)
+
+describe('Batch calls', function()
+   local function with_service(func)
+      local bus = assert(dbus[bus_name]())
+      local owner_id = assert(bus:own_name(service_name))
+
+      local object = dbus.object(object_path, interface_name)
+      object:add_method('Double', 'i', 'i', function(i) return 2 * i end)
+      local object_id = assert(bus:register_object(object))
+
+      func(bus)
+
+      assert.is_true(bus:unregister_object(object_id))
+      bus:unown_name(owner_id)
+   end
+
+   local function calls(n)
+      local list = {}
+      for i = 1, n do
+         list[i] = {service_name, object_path, interface_name, 'Double', 'i', i}
+      end
+      list[n + 1] = {service_name, object_path, interface_name, 'NoSuchMethod', false}
+      return list
+   end
+
+   local function check(ret, n)
+      assert.are.equal(n + 1, #ret)
+      for i = 1, n do
+         assert.are.same(pack(2 * i), ret[i])
+      end
+      assert.is_nil(ret[n + 1][1])
+      assert.are.equal('org.freedesktop.DBus.Error.UnknownMethod', ret[n + 1][2].name)
+   end
+
+   it('In mainloop', function()
+      with_service(function(bus)
+         local ret, empty
+         dbus.add_callback(function()
+            ret = bus:call_many(calls(400))
+            empty = bus:call_many{}
+            dbus.mainloop_quit()
+         end)
+         dbus.mainloop()
+
+         check(ret, 400)
+         assert.are.same({}, empty)
+      end)
+   end)
+
+   it('Outside of mainloop', function()
+      -- Bus daemon replies, as own service is not dispatched while blocking
+      local bus = assert(dbus[bus_name]())
+      local daemon = {'org.freedesktop.DBus', '/org/freedesktop/DBus', 'org.freedesktop.DBus'}
+      local ret = bus:call_many{
+         {daemon[1], daemon[2], daemon[3], 'NameHasOwner', 's', 'org.freedesktop.DBus'},
+         {daemon[1], daemon[2], daemon[3], 'GetNameOwner', 's', 'spec.easydbus.NoSuchName'},
+      }
+
+      assert.are.equal(2, #ret)
+      assert.are.same(pack(true), ret[1])
+      assert.is_nil(ret[2][1])
+      assert.are.equal('org.freedesktop.DBus.Error.NameHasNoOwner', ret[2][2].name)
+      assert.are.same({}, bus:call_many{})
+   end)
+
+   it('Rejects invalid call', function()
+      local bus = assert(dbus[bus_name]())
+      assert.has_error(function()
+         bus:call_many{
+            {service_name, object_path, interface_name, 'Double', 'i', 1},
+            {service_name, object_path, interface_name, 'Double', 'i', 'not a number'},
+         }
+      end)
+      assert.has_error(function()
+         bus:call_many{{service_name, 'invalid path', interface_name, 'Double'}}
+      end)
+   end)
+end)
+
+describe('Call options', function()
+   local function with_service(func)
+      local bus = assert(dbus[bus_name]())
+      local owner_id = assert(bus:own_name(service_name))
+
+      local object = dbus.object(object_path, interface_name)
+      object:add_method('Hello', 's', 's', function(s) return 'Hello ' .. s end)
+      local object_id = assert(bus:register_object(object))
+
+      dbus.add_callback(func, bus)
+      dbus.mainloop()
+
+      assert.is_true(bus:unregister_object(object_id))
+      bus:unown_name(owner_id)
+   end
+
+   it('Timeout and reply type', function()
+      local ret, ok, err
+      with_service(function(bus)
+         ret = bus:call({timeout = 1000, reply_type = 's'},
+                        service_name, object_path, interface_name, 'Hello', 's', 'World')
+         ok, err = bus:call({reply_type = 'i'},
+                            service_name, object_path, interface_name, 'Hello', 's', 'World')
+         dbus.mainloop_quit()
+      end)
+      assert.are.equal('Hello World', ret)
+      assert.is_nil(ok)
+      assert.are.equal('string', type(err.message))
+   end)
+
+   it('No auto start', function()
+      local ok, err
+      with_service(function(bus)
+         ok, err = bus:call({no_auto_start = true},
+                            'org.easydbus.NotExisting', object_path, interface_name, 'Hello', 's', 'World')
+         dbus.mainloop_quit()
+      end)
+      assert.is_nil(ok)
+      assert.are.equal('org.freedesktop.DBus.Error.ServiceUnknown', err.name)
+   end)
+
+   it('No reply', function()
+      local count = 0
+      local bus = assert(dbus[bus_name]())
+      local owner_id = assert(bus:own_name(service_name))
+
+      local object = dbus.object(object_path, interface_name)
+      object:add_method('Notify', 'i', '', function(i) count = count + i end)
+      object:add_method('Count', '', 'i', function() return count end)
+      local object_id = assert(bus:register_object(object))
+
+      local ret
+      dbus.add_callback(function()
+         for _ = 1, 100 do
+            assert(bus:send(service_name, object_path, interface_name, 'Notify', 'i', 1))
+         end
+         assert(bus:call({no_reply = true}, service_name, object_path, interface_name, 'Notify', 'i', 1000))
+         ret = bus:call(service_name, object_path, interface_name, 'Count')
+         dbus.mainloop_quit()
+      end)
+      dbus.mainloop()
+
+      assert.is_true(bus:unregister_object(object_id))
+      bus:unown_name(owner_id)
+
+      assert.are.equal(1100, ret)
+   end)
+
+   it('Cancellation', function()
+      local cancellable = dbus.cancellable()
+      local ok, err
+      with_service(function(bus)
+         dbus.add_callback(function() cancellable:cancel() end)
+         ok, err = bus:call({cancellable = cancellable},
+                            service_name, object_path, interface_name, 'Hello', 's', 'World')
+         dbus.mainloop_quit()
+      end)
+      assert.is_true(cancellable:is_cancelled())
+      assert.is_nil(ok)
+      assert.are.equal('string', type(err.name))
+   end)
+end)
+
+describe('Introspection', function()
+   it('Full model', function()
+      local bus = assert(dbus[bus_name]())
+      local owner_id = assert(bus:own_name(service_name))
+
+      local object = dbus.object(object_path, interface_name)
+      object:add_method('Hello', 'si', 'as', function() return {} end)
+      local object_id = assert(bus:register_object(object))
+
+      local node, cached
+      dbus.add_callback(function()
+         node = bus:introspect(service_name, object_path)
+         cached = bus:introspect(service_name, object_path)
+         dbus.mainloop_quit()
+      end)
+      dbus.mainloop()
+
+      assert.is_true(bus:unregister_object(object_id))
+      bus:unown_name(owner_id)
+
+      local interface = node.interfaces[interface_name]
+      assert.are.same({in_sig = 'si', out_sig = 'as'}, interface.methods.Hello)
+      assert.are.same({}, interface.signals)
+      assert.are.same({}, interface.properties)
+      assert.is_table(node.interfaces['org.freedesktop.DBus.Introspectable'])
+      assert.are.same(node, cached)
+   end)
+
+   it('Invalidation', function()
+      local bus = assert(dbus[bus_name]())
+      local owner_id = assert(bus:own_name(service_name))
+      local extra_name = interface_name .. '.Extra'
+
+      local object = dbus.object(object_path, interface_name)
+      object:add_method('Hello', 's', 's', function(s) return s end)
+      local object_id = assert(bus:register_object(object))
+      local extra = dbus.object(object_path, extra_name)
+      extra:add_method('Bye', '', '', function() end)
+
+      local extra_id, cached, fresh
+      dbus.add_callback(function()
+         assert(bus:introspect(service_name, object_path))
+         extra_id = assert(bus:register_object(extra))
+         cached = bus:introspect(service_name, object_path)
+         bus:invalidate_introspection(service_name, object_path)
+         fresh = bus:introspect(service_name, object_path)
+         dbus.mainloop_quit()
+      end)
+      dbus.mainloop()
+
+      assert.is_true(bus:unregister_object(extra_id))
+      assert.is_true(bus:unregister_object(object_id))
+      bus:unown_name(owner_id)
+
+      assert.is_nil(cached.interfaces[extra_name])
+      assert.is_table(fresh.interfaces[extra_name])
+   end)
+end)
+
+describe('Properties', function()
+   it('Cache and coalesced changes', function()
+      local bus = assert(dbus[bus_name]())
+      local owner_id = assert(bus:own_name(service_name))
+
+      local setter = spy.new(function() end)
+      local object = dbus.object(object_path, interface_name)
+      object:add_property('Name', 's', 'foo')
+      object:add_property('Volume', 'i', 5, 'readwrite', setter)
+      object:add_property('Secret', 's', 'hidden', 'write')
+      local object_id = assert(bus:register_object(object))
+
+      local props, initial
+      local changes = {}
+      dbus.add_callback(function()
+         props = assert(bus:new_property_cache(service_name, object_path, interface_name))
+         initial = {Name = props.values.Name, Volume = props.values.Volume}
+         props.on_changed = function(changed, invalidated)
+            changes[#changes+1] = {changed, invalidated}
+            if #changes == 2 then
+               dbus.mainloop_quit()
+            end
+         end
+         object:set_property('Name', 'bar')
+         object:set_property('Name', 'baz')
+         object:set_property('Secret', 'shown')
+         assert(props:set('Volume', 'i', 7))
+      end)
+      dbus.mainloop()
+
+      props:close()
+      assert.is_true(bus:unregister_object(object_id))
+      bus:unown_name(owner_id)
+
+      assert.are.same({Name = 'foo', Volume = 5}, initial)
+      assert.is_nil(props.values.Secret)
+      assert.are.same({{Name = 'baz'}, {'Secret'}}, changes[1])
+      assert.are.same({{Volume = 7}, {}}, changes[2])
+      assert.are.equal('baz', props.values.Name)
+      assert.are.equal(7, props.values.Volume)
+      assert.are.equal(7, object:get_property('Volume'))
+      assert.spy(setter).was.called_with(7)
+   end)
+
+   it('Named setter errors', function()
+      local bus = assert(dbus[bus_name]())
+      local owner_id = assert(bus:own_name(service_name))
+
+      local object = dbus.object(object_path, interface_name)
+      object:add_property('Volume', 'i', 5, 'readwrite', function()
+         error(dbus.error('spec.easydbus.Error.Range', 'Volume out of range'))
+      end)
+      local object_id = assert(bus:register_object(object))
+
+      local err
+      dbus.add_callback(function()
+         local props = assert(bus:new_property_cache(service_name, object_path, interface_name))
+         err = select(2, props:set('Volume', 'i', 11))
+         props:close()
+         dbus.mainloop_quit()
+      end)
+      dbus.mainloop()
+
+      assert.is_true(bus:unregister_object(object_id))
+      bus:unown_name(owner_id)
+
+      assert.are.equal('spec.easydbus.Error.Range', err.name)
+      assert.are.equal('Volume out of range', err.message)
+      assert.are.equal(5, object:get_property('Volume'))
+   end)
+
+   it('Reject invalid access', function()
+      local bus = assert(dbus[bus_name]())
+      local object = dbus.object(object_path, interface_name)
+      object:add_property('Volume', 'i', 5)
+      object.properties.Volume.access = 'readonly'
+
+      assert.has_error(function() bus:register_object(object) end)
+   end)
+end)
+
+describe('Object manager', function()
+   it('Managed objects and interface signals', function()
+      local bus = assert(dbus[bus_name]())
+      local owner_id = assert(bus:own_name(service_name))
+      local manager_id = assert(bus:register_object_manager(object_path))
+
+      local object = dbus.object(object_path .. '/first', interface_name)
+      object:add_property('Name', 's', 'first')
+      local object_id = assert(bus:register_object(object))
+
+      local second = dbus.object(object_path .. '/second', interface_name)
+      second:add_property('Name', 's', 'second')
+
+      local manager, initial
+      local added, removed = {}, {}
+      dbus.add_callback(function()
+         manager = assert(bus:new_object_manager(service_name, object_path))
+         initial = manager.objects
+         manager.on_added = function(path)
+            added[#added+1] = path
+         end
+         manager.on_removed = function(path)
+            removed[#removed+1] = path
+            dbus.mainloop_quit()
+         end
+         second.id = assert(bus:register_object(second))
+         assert.is_true(bus:unregister_object(object_id))
+      end)
+      dbus.mainloop()
+
+      manager:close()
+      assert.is_true(bus:unregister_object(second.id))
+      assert.is_true(bus:unregister_object(manager_id))
+      bus:unown_name(owner_id)
+
+      assert.are.same({[object_path .. '/first'] = {[interface_name] = {Name = 'first'}}}, initial)
+      assert.are.same({object_path .. '/second'}, added)
+      assert.are.same({object_path .. '/first'}, removed)
+      assert.are.same({[object_path .. '/second'] = {[interface_name] = {Name = 'second'}}},
+                      manager.objects)
+   end)
+end)
+
+describe('Subtree', function()
+   it('Lookup on demand', function()
+      local bus = assert(dbus[bus_name]())
+      local owner_id = assert(bus:own_name(service_name))
+
+      local lookups = 0
+      local function lookup(node)
+         lookups = lookups + 1
+         if node and node:match('^item%d+$') then
+            local object = dbus.object(object_path .. '/' .. node, interface_name)
+            object:add_method('Name', '', 's', function() return node end)
+            object:add_property('Index', 'u', tonumber(node:match('%d+')))
+            -- property without signature is a variant
+            object.properties.Label = {value = node, access = 'read'}
+            return object
+         end
+      end
+      local subtree_id = assert(bus:register_subtree(object_path, lookup,
+                                                     function() return {'item1', 'item2'} end))
+
+      local name, index, label, node, ok
+      dbus.add_callback(function()
+         name = bus:call(service_name, object_path .. '/item42', interface_name, 'Name')
+         index = bus:call(service_name, object_path .. '/item42', 'org.freedesktop.DBus.Properties',
+                          'Get', 'ss', interface_name, 'Index')
+         label = bus:call(service_name, object_path .. '/item42', 'org.freedesktop.DBus.Properties',
+                          'Get', 'ss', interface_name, 'Label')
+         node = bus:introspect(service_name, object_path)
+         ok = bus:call(service_name, object_path .. '/other', interface_name, 'Name')
+         dbus.mainloop_quit()
+      end)
+      dbus.mainloop()
+
+      assert.is_true(bus:unregister_subtree(subtree_id))
+      bus:unown_name(owner_id)
+
+      assert.are.equal('item42', name)
+      assert.are.equal(42, index)
+      assert.are.equal('item42', label)
+      assert.are.same({'item1', 'item2'}, node.nodes)
+      assert.is_nil(ok)
+      assert.is_true(lookups > 0)
+   end)
+end)
+
+describe('Worker pool', function()
+   it('Handle calls in worker states', function()
+      local bus = assert(dbus[bus_name]())
+      local owner_id = assert(bus:own_name(service_name))
+      local path, iface = '/spec/easydbus/pool', 'spec.easydbus.pool'
+
+      local reg_id = assert(bus:register_pool('spec.pool_worker', 2))
+
+      local calls = {}
+      for i = 1, 8 do
+         calls[i] = {service_name, path, iface, 'Square', 'i', i}
+      end
+
+      local results, err, _
+      dbus.add_callback(function()
+         results = bus:call_many(calls)
+         _, err = bus:call(service_name, path, iface, 'Fail')
+         dbus.mainloop_quit()
+      end)
+      dbus.mainloop()
+
+      assert.is_true(bus:unregister_object(reg_id))
+      bus:unown_name(owner_id)
+
+      for i = 1, 8 do
+         assert.are.equal(i * i, results[i][1])
+      end
+      assert.are.equal('spec.easydbus.Error', err.name)
+   end)
+
+   it('Reject too many workers', function()
+      local bus = assert(dbus[bus_name]())
+
+      assert.has_error(function() bus:register_pool('spec.pool_worker', 100000) end)
+   end)
+end)
+
+describe('Peer to peer', function()
+   it('Call method of peer', function()
+      local server = assert(dbus.server('unix:tmpdir=/tmp', function(peer)
+         local object = dbus.object(object_path, interface_name)
+         object:add_method('Hello', 's', 's', function(s) return 'Hello ' .. s end)
+         assert(peer:register_object(object))
+      end))
+      local bus = assert(dbus.connect(server:address()))
+
+      local ret
+      dbus.add_callback(function()
+         ret = bus:call(false, object_path, interface_name, 'Hello', 's', 'peer')
+         dbus.mainloop_quit()
+      end)
+      dbus.mainloop()
+
+      server:stop()
+
+      assert.are.equal('Hello peer', ret)
+   end)
+
+   it('Close peer connection', function()
+      local closed = false
+      local server = assert(dbus.server('unix:tmpdir=/tmp', function(peer)
+         local object = dbus.object(object_path, interface_name)
+         object:add_method('Hello', 's', 's', function(s) return 'Hello ' .. s end)
+         assert(peer:register_object(object))
+      end))
+      local bus = assert(dbus.connect(server:address()))
+
+      local ret, ok, err
+      dbus.add_callback(function()
+         ret = bus:call(false, object_path, interface_name, 'Hello', 's', 'peer')
+         closed = bus:close()
+         ok, err = bus:call(false, object_path, interface_name, 'Hello', 's', 'peer')
+         dbus.mainloop_quit()
+      end)
+      dbus.mainloop()
+
+      server:stop()
+
+      assert.are.equal('Hello peer', ret)
+      assert.is_true(closed)
+      assert.is_nil(ok)
+      assert.is_not_nil(err)
+      assert.has_error(function() assert(dbus[bus_name]()):close() end)
+   end)
+
+   it('Reject peer of other user', function()
+      local handler = spy.new(function() end)
+      -- nobody runs as this user, so every peer is rejected
+      local server = assert(dbus.server('unix:tmpdir=/tmp', {uid = 4000000000}, handler))
+
+      local ok, err = dbus.connect(server:address())
+      server:stop()
+
+      assert.is_nil(ok)
+      assert.is_not_nil(err.name)
+      assert.spy(handler).was_not.called()
+   end)
+
+   it('Invalid address', function()
+      local ok, err = dbus.connect('invalid')
+      assert.is_nil(ok)
+      assert.is_not_nil(err.name)
+   end)
+end)
+
+describe('Decode options', function()
+   after_each(function()
+      dbus.set_decode_options{bytes = 'table', lazy = false}
+   end)
+
+   it('Byte array as string', function()
+      dbus.set_decode_options{bytes = 'string'}
+
+      local bus = assert(dbus[bus_name]())
+      local owner_id = assert(bus:own_name(service_name))
+
+      local received
+      local object = dbus.object(object_path, interface_name)
+      object:add_method('Bytes', 'ay', 'ay', function(s)
+         received = s
+         return {s:byte(1, -1)}
+      end)
+      local object_id = assert(bus:register_object(object))
+
+      local ret
+      dbus.add_callback(function()
+         ret = bus:call(service_name, object_path, interface_name, 'Bytes', 'ay', {0, 65, 255})
+         dbus.mainloop_quit()
+      end)
+      dbus.mainloop()
+
+      assert.is_true(bus:unregister_object(object_id))
+      bus:unown_name(owner_id)
+
+      assert.are.equal('\0A\255', received)
+      assert.are.equal('\0A\255', ret)
+   end)
+
+   it('Byte array as buffer', function()
+      dbus.set_decode_options{bytes = 'buffer'}
+
+      local bus = assert(dbus[bus_name]())
+      local owner_id = assert(bus:own_name(service_name))
+
+      local received
+      local object = dbus.object(object_path, interface_name)
+      object:add_method('Bytes', 'ay', 'ay', function(buf)
+         received = buf
+         return buf
+      end)
+      local object_id = assert(bus:register_object(object))
+
+      local blob = string.rep('\1\2\3\255', 100000)
+      local ret, ret_created
+      dbus.add_callback(function()
+         ret = bus:call(service_name, object_path, interface_name, 'Bytes', 'ay', blob)
+         ret_created = bus:call(service_name, object_path, interface_name, 'Bytes', 'ay', dbus.bytes('abc'))
+         dbus.mainloop_quit()
+      end)
+      dbus.mainloop()
+
+      assert.is_true(bus:unregister_object(object_id))
+      bus:unown_name(owner_id)
+
+      assert.are.equal('userdata', type(received))
+      assert.are.equal(#blob, #ret)
+      assert.are.equal(255, ret[4])
+      assert.is_nil(ret[#blob + 1])
+      assert.are.equal(blob, tostring(ret))
+      assert.are.equal('\2\3', ret:sub(2, 3))
+      assert.are.equal('abc', ret_created:tostring())
+   end)
+
+   it('Lazy containers', function()
+      dbus.set_decode_options{lazy = true}
+
+      local bus = assert(dbus[bus_name]())
+      local owner_id = assert(bus:own_name(service_name))
+
+      local object = dbus.object(object_path, interface_name)
+      object:add_method('Lookup', 'a{sv}s', 'v', function(dict, key)
+         return dict[key]
+      end)
+      object:add_method('Echo', 'a{sv}', 'a{sv}', function(dict)
+         return dict
+      end)
+      local object_id = assert(bus:register_object(object))
+
+      local value, expected = {}, {}
+      for i = 1, 1000 do
+         value['key' .. i] = dbus.type({i, 'value' .. i}, '(is)')
+         expected['key' .. i] = {i, 'value' .. i}
+      end
+
+      local found, echo
+      dbus.add_callback(function()
+         found = bus:call(service_name, object_path, interface_name, 'Lookup', 'a{sv}s', value, 'key500')
+         echo = bus:call(service_name, object_path, interface_name, 'Echo', 'a{sv}', value)
+         dbus.mainloop_quit()
+      end)
+      dbus.mainloop()
+
+      assert.is_true(bus:unregister_object(object_id))
+      bus:unown_name(owner_id)
+
+      assert.are.equal('userdata', type(found))
+      assert.are.equal(2, #found)
+      assert.are.equal(500, found[1])
+      assert.are.equal('value500', found[2])
+      assert.are.same({500, 'value500'}, found:totable())
+
+      assert.are.equal('userdata', type(echo))
+      assert.are.equal('value1000', echo.key1000[2])
+      assert.is_nil(echo.missing)
+      assert.are.same(expected, dbus.totable(echo))
+   end)
+
+   it('Rejects unknown bytes mode', function()
+      assert.has_error(function() dbus.set_decode_options{bytes = 'foo'} end)
+   end)
+end)
+
+describe('Precompiled signatures', function()
+   it('Signature object', function()
+      local sig = dbus.signature('sa{sv}')
+      assert.are.equal('sa{sv}', tostring(sig))
+   end)
+
+   it('Invalid signature', function()
+      assert.has_error(function()
+         dbus.signature('a{')
+      end, 'Invalid signature: a{')
+   end)
+
+   it('Reject embedded nul bytes', function()
+      local bus = assert(dbus[bus_name]())
+      for _,sig in ipairs{'s', 'o', 'g'} do
+         assert.has_error(function()
+            bus:emit(nil, object_path, interface_name, 'Nul', sig, '/a\0junk')
+         end)
+      end
+   end)
+
+   it('Method with precompiled signatures', function()
+      local bus = assert(dbus[bus_name]())
+      local owner_id = assert(bus:own_name(service_name))
+
+      local object = dbus.object(object_path, interface_name)
+      object:add_method('Concat', dbus.signature('ss'), dbus.signature('s'),
+                        function(a, b) return a .. b end)
+      local object_id = assert(bus:register_object(object))
+
+      local ret
+      dbus.add_callback(function()
+         ret = pack(bus:call(service_name, object_path, interface_name, 'Concat',
+                             dbus.signature('ss'), 'pre', 'compiled'))
+         dbus.mainloop_quit()
+      end)
+      dbus.mainloop()
+
+      assert.is_true(bus:unregister_object(object_id))
+      bus:unown_name(owner_id)
+
+      assert.are.same(pack('precompiled'), ret)
+   end)
+end)
+
 describe('Invalid service creation', function()
    before_each(function()
       bus = assert(dbus[bus_name]())
@@ -307,4 +1147,10 @@ describe('Invalid service creation', function()
          assert(bus:own_name(service_name))
       end)
    end)
+
+   it('Own context after connection is created', function()
+      local ok, err = dbus.own_context()
+      assert.is_nil(ok)
+      assert.are.equal('connection already created', err)
+   end)
 end)
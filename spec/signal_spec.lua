@@ -5,6 +5,7 @@ require 'busted.runner'()
 local dbus = require 'easydbus'
 
 local pack = table.pack or dbus.pack
+local unpack = unpack or table.unpack
 
 local bus_name = 'session'
 local service_name = 'spec.easydbus'
@@ -42,6 +43,175 @@ describe('Service signal emit', function()
    it('Single emit, single subscribe', test_emit(service_name, service_name, 'DummySignal'))
 end)
 
+describe('Signal matching', function()
+   local function test_match(opts, path, ...)
+      local emitted = pack(...)
+      return function()
+         local bus = assert(dbus[bus_name]())
+         local owner_id = assert(bus:own_name(service_name))
+
+         local received = {}
+         local sub_id = bus:subscribe(opts, nil, nil, interface_name, 'MatchSignal',
+                                      function(...) received[#received + 1] = pack(...) end)
+         local done_id = bus:subscribe(nil, object_path, interface_name, 'Done',
+                                       function() dbus.mainloop_quit() end)
+
+         dbus.add_callback(function()
+            assert.is_true(bus:emit(nil, path, interface_name, 'MatchSignal', 'ss', unpack(emitted, 1, 2)))
+            assert.is_true(bus:emit(nil, path, interface_name, 'MatchSignal', 'ss', 'other', '/other'))
+            assert.is_true(bus:emit(nil, object_path, interface_name, 'Done'))
+         end)
+         dbus.mainloop()
+
+         bus:unsubscribe(sub_id)
+         bus:unsubscribe(done_id)
+         bus:unown_name(owner_id)
+
+         assert.are.same({pack(unpack(emitted, 1, 2))}, received)
+      end
+   end
+
+   it('arg0', test_match({arg0 = 'spec'}, object_path, 'spec', '/a'))
+
+   it('arg0namespace', test_match({arg0namespace = 'spec'}, object_path, 'spec.easydbus', '/a'))
+
+   it('arg1path', test_match({arg1path = '/spec/'}, object_path, 'x', '/spec/easydbus'))
+
+   it('path_namespace', test_match({path_namespace = '/spec', arg0 = 'x'}, object_path .. '/sub', 'x', '/a'))
+
+   it('Unknown option', function()
+      local bus = assert(dbus[bus_name]())
+      assert.has_error(function()
+         bus:subscribe({argument = 'x'}, nil, object_path, interface_name, 'MatchSignal', print)
+      end)
+   end)
+end)
+
+describe('Shared subscription', function()
+   it('Fan out to every handler', function()
+      local bus = assert(dbus[bus_name]())
+      local owner_id = assert(bus:own_name(service_name))
+
+      local first, second = {}, {}
+      local first_id
+      first_id = bus:subscribe(nil, object_path, interface_name, 'FanSignal', function(n)
+         first[#first + 1] = n
+         -- removed during dispatch, other handler still gets this signal
+         bus:unsubscribe(first_id)
+         assert(bus:emit(nil, object_path, interface_name, 'FanSignal', 'i', 2))
+         assert(bus:emit(nil, object_path, interface_name, 'Done'))
+      end)
+      local second_id = bus:subscribe(nil, object_path, interface_name, 'FanSignal',
+                                      function(arg, n) second[#second + 1] = n end, 'arg')
+      local done_id = bus:subscribe(nil, object_path, interface_name, 'Done',
+                                    function() dbus.mainloop_quit() end)
+      assert.are_not.equal(first_id, second_id)
+
+      dbus.add_callback(function()
+         assert.is_true(bus:emit(nil, object_path, interface_name, 'FanSignal', 'i', 1))
+      end)
+      dbus.mainloop()
+
+      bus:unsubscribe(second_id)
+      bus:unsubscribe(done_id)
+      bus:unown_name(owner_id)
+
+      assert.are.same({1}, first)
+      assert.are.same({1, 2}, second)
+   end)
+end)
+
+describe('Coalesced signals', function()
+   it('Deliver newest signal per key', function()
+      local bus = assert(dbus[bus_name]())
+      local owner_id = assert(bus:own_name(service_name))
+
+      local received, calls, done = {}, 0, false
+      local function check_done()
+         if done and received.left == 100 and received.right == -100 then
+            dbus.mainloop_quit()
+         end
+      end
+      local sub_id = bus:subscribe({coalesce = 'arg0', interval = 100}, nil, object_path,
+                                   interface_name, 'Level', function(channel, level)
+         calls = calls + 1
+         received[channel] = level
+         check_done()
+      end)
+      local done_id = bus:subscribe(nil, object_path, interface_name, 'Done', function()
+         done = true
+         check_done()
+      end)
+
+      dbus.add_callback(function()
+         for i = 1, 100 do
+            assert(bus:emit(nil, object_path, interface_name, 'Level', 'si', 'left', i))
+            assert(bus:emit(nil, object_path, interface_name, 'Level', 'si', 'right', -i))
+         end
+         assert(bus:emit(nil, object_path, interface_name, 'Done'))
+      end)
+      dbus.mainloop()
+
+      bus:unsubscribe(sub_id)
+      bus:unsubscribe(done_id)
+      bus:unown_name(owner_id)
+
+      assert.are.equal(100, received.left)
+      assert.are.equal(-100, received.right)
+      -- every signal would be delivered without coalescing
+      assert.is_true(calls < 20, 'handler called ' .. calls .. ' times')
+   end)
+
+   it('Interval requires coalesce', function()
+      local bus = assert(dbus[bus_name]())
+      assert.has_error(function()
+         bus:subscribe({interval = 100}, nil, object_path, interface_name, 'Level', function() end)
+      end)
+   end)
+end)
+
+describe('Batch emit', function()
+   local function test_emit_many(opts, expected)
+      return function()
+         local bus = assert(dbus[bus_name]())
+         local owner_id = assert(bus:own_name(service_name))
+
+         local received = {}
+         local sub_id = bus:subscribe(nil, nil, interface_name, 'Item',
+                                      function(n) received[#received + 1] = n end)
+         local done_id = bus:subscribe(nil, object_path, interface_name, 'Done',
+                                       function() dbus.mainloop_quit() end)
+
+         dbus.add_callback(function()
+            assert.is_true(bus:emit_many({
+               {false, object_path .. '/a', interface_name, 'Item', 'u', 1},
+               {false, object_path .. '/b', interface_name, 'Item', 'u', 2},
+               {false, object_path .. '/a', interface_name, 'Item', 'u', 3},
+               {false, object_path, interface_name, 'Done'},
+            }, opts))
+         end)
+         dbus.mainloop()
+
+         bus:unsubscribe(sub_id)
+         bus:unsubscribe(done_id)
+         bus:unown_name(owner_id)
+
+         assert.are.same(expected, received)
+      end
+   end
+
+   it('Emit all signals', test_emit_many(nil, {1, 2, 3}))
+
+   it('Emit deduplicated signals', test_emit_many({dedup = true}, {3, 2}))
+
+   it('Invalid signal', function()
+      local bus = assert(dbus[bus_name]())
+      assert.has_error(function()
+         bus:emit_many{{false, 'invalid', interface_name, 'Item'}}
+      end, 'Invalid object path in signal 1')
+   end)
+end)
+
 describe('Wrong subscribe usage', function()
    it('No handler', function()
       local bus = assert(dbus[bus_name]())
@@ -6,14 +6,46 @@
 
 #include "bus.h"
 
+#include "cancellable.h"
 #include "compat.h"
 #include "easydbus.h"
+#include "error.h"
+#include "introspect.h"
 #include "poll.h"
+#include "pool.h"
+#include "signature.h"
+#include "threads.h"
 #include "utils.h"
 
+#include <string.h>
+
 static int bus_mt;
 #define BUS_MT ((void *) &bus_mt)
 
+static int ptr_array_mt;
+#define PTR_ARRAY_MT ((void *) &ptr_array_mt)
+
+static int conn_ref_mt;
+#define CONN_REF_MT ((void *) &conn_ref_mt)
+
+/* Set on connections made by dbus.connect() and dbus.server() */
+#define PEER_CONN "easydbus-peer-conn"
+
+/*
+ * Method handler threads which yielded, mapped to their pending invocations.
+ * Keys are weak, so invocation of handler which can not be resumed anymore is
+ * replied with error by garbage collector.
+ */
+static int pending_handlers;
+#define PENDING_HANDLERS ((void *) &pending_handlers)
+
+static int pending_invocation_mt;
+#define PENDING_INVOCATION_MT ((void *) &pending_invocation_mt)
+
+struct pending_invocation {
+    GDBusMethodInvocation *invocation; /* NULL once replied */
+};
+
 static GDBusConnection *get_conn(lua_State *L, int index)
 {
     GDBusConnection *conn;
@@ -29,7 +61,8 @@ static GDBusConnection *get_conn(lua_State *L, int index)
 static void call_callback(GObject *source, GAsyncResult *res, gpointer user_data)
 {
     lua_State *T = user_data;
-    GDBusConnection *conn = lua_touserdata(T, 1);
+    struct easydbus_state *state = lua_touserdata(T, 1);
+    GDBusConnection *conn = G_DBUS_CONNECTION(source);
     GError *error = NULL;
     GUnixFDList *fd_list = NULL;
     GVariant *result = g_dbus_connection_call_with_unix_fd_list_finish(conn, &fd_list, res, &error);
@@ -52,14 +85,14 @@ static void call_callback(GObject *source, GAsyncResult *res, gpointer user_data
         g_assert(result != NULL);
 
         /* Resume Lua callback */
-        ed_resume(T, 1 + push_tuple(T, result, fd_list));
+        ed_resume(T, 1 + push_tuple(T, result, fd_list, state->decode_flags));
 
         if (fd_list)
             g_object_unref(fd_list);
         g_variant_unref(result);
     } else {
         lua_pushnil(T);
-        lua_pushstring(T, error->message);
+        push_error(T, error);
         ed_resume(T, 3);
 
         g_clear_error(&error);
@@ -71,44 +104,202 @@ static void call_callback(GObject *source, GAsyncResult *res, gpointer user_data
     lua_rawset(T, LUA_REGISTRYINDEX);
 }
 
-static inline gboolean in_mainloop(struct easydbus_state *state)
+gboolean in_mainloop(struct easydbus_state *state)
 {
     return (state->loop || state->ref_cb != -1);
 }
 
 /*
- * Args:
- * 1) conn
- * 2) bus_name
- * 3) object_path
- * 4) interface_name
- * 5) method_name
- * 6) parameters ...
- * last-2) timeout
- * last-1) callback
- * last) callback_arg
+ * Sources are attached to main context of state, which is not necessarily the
+ * global default one.
  */
-static int bus_call(lua_State *L)
+guint state_idle_add(struct easydbus_state *state, GSourceFunc func, gpointer data)
+{
+    GSource *source = g_idle_source_new();
+    guint id;
+
+    g_source_set_callback(source, func, data, NULL);
+    id = g_source_attach(source, state->context);
+    g_source_unref(source);
+
+    return id;
+}
+
+guint state_timeout_add(struct easydbus_state *state, guint interval,
+                        GSourceFunc func, gpointer data)
+{
+    GSource *source = g_timeout_source_new(interval);
+    guint id;
+
+    g_source_set_callback(source, func, data, NULL);
+    id = g_source_attach(source, state->context);
+    g_source_unref(source);
+
+    return id;
+}
+
+void state_source_remove(struct easydbus_state *state, guint id)
+{
+    GSource *source = g_main_context_find_source_by_id(state->context, id);
+
+    if (source)
+        g_source_destroy(source);
+}
+
+/*
+ * Options table:
+ * timeout - in milliseconds, -1 for default
+ * no_auto_start - do not launch owner of bus name
+ * allow_interactive_authorization - allow polkit dialogs
+ * reply_type - expected signature of reply
+ * cancellable - dbus.cancellable() object
+ * no_reply - send call without waiting for reply
+ */
+void check_call_options(lua_State *L, int index, struct call_options *opts)
+{
+    const struct signature *reply_sig;
+
+    opts->no_reply = FALSE;
+    opts->flags = G_DBUS_CALL_FLAGS_NONE;
+    opts->timeout = -1;
+    opts->reply_type = NULL;
+    opts->cancellable = NULL;
+
+    if (!lua_istable(L, index))
+        return;
+
+    lua_getfield(L, index, "timeout");
+    if (!lua_isnil(L, -1)) {
+        luaL_argcheck(L, lua_isnumber(L, -1), index, "timeout is not a number");
+        opts->timeout = lua_tointeger(L, -1);
+    }
+
+    lua_getfield(L, index, "no_auto_start");
+    if (lua_toboolean(L, -1))
+        opts->flags |= G_DBUS_CALL_FLAGS_NO_AUTO_START;
+
+    lua_getfield(L, index, "allow_interactive_authorization");
+    if (lua_toboolean(L, -1))
+        opts->flags |= G_DBUS_CALL_FLAGS_ALLOW_INTERACTIVE_AUTHORIZATION;
+
+    /* Signatures are interned, so reply type stays valid */
+    lua_getfield(L, index, "reply_type");
+    reply_sig = signature_check(L, lua_gettop(L));
+    if (reply_sig)
+        opts->reply_type = G_VARIANT_TYPE(reply_sig->tuple.sig);
+
+    lua_getfield(L, index, "cancellable");
+    opts->cancellable = cancellable_check(L, lua_gettop(L));
+
+    lua_getfield(L, index, "no_reply");
+    opts->no_reply = lua_toboolean(L, -1);
+
+    lua_pop(L, 6);
+}
+
+static int ptr_array__gc(lua_State *L)
+{
+    GPtrArray **array = lua_touserdata(L, 1);
+
+    g_ptr_array_unref(*array);
+
+    return 0;
+}
+
+/*
+ * Pushes userdata owning new array, so elements are freed by garbage
+ * collector when Lua error is raised before they are used.
+ */
+static GPtrArray *push_ptr_array(lua_State *L, guint size, GDestroyNotify free_func)
+{
+    GPtrArray **array = lua_newuserdata(L, sizeof(*array));
+
+    *array = g_ptr_array_new_full(size, free_func);
+
+    lua_pushlightuserdata(L, PTR_ARRAY_MT);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_setmetatable(L, -2);
+
+    return *array;
+}
+
+static void variant_free(gpointer data)
+{
+    if (data)
+        g_variant_unref(data);
+}
+
+/*
+ * Send method call with NO_REPLY_EXPECTED flag. No reply is awaited, so
+ * neither thread nor reply value is created.
+ */
+int do_send(lua_State *L, const struct call *call, const struct call_options *opts, int index)
+{
+    int n_params = lua_gettop(L) - index + 1;
+    GDBusMessageFlags flags = G_DBUS_MESSAGE_FLAGS_NO_REPLY_EXPECTED;
+    GDBusMessage *message;
+    GVariant *body = NULL;
+    GPtrArray *fd_lists;
+    GUnixFDList *fd_list;
+    GError *error = NULL;
+
+    g_debug("%s: conn=%p bus_name=%s object_path=%s interface_name=%s method_name=%s sig=%s",
+            __FUNCTION__, (void *) call->conn, call->bus_name, call->object_path,
+            call->interface_name, call->method_name, call->sig ? call->sig->sig : NULL);
+
+    /* Parameters are read first, so only anchored fd list is left on error */
+    fd_lists = push_ptr_array(L, 1, g_object_unref);
+    g_ptr_array_add(fd_lists, g_unix_fd_list_new());
+    fd_list = fd_lists->pdata[0];
+    if (n_params > 0)
+        body = range_to_tuple(L, index, index + n_params, call->sig, fd_list);
+
+    message = g_dbus_message_new_method_call(call->bus_name, call->object_path,
+                                             call->interface_name, call->method_name);
+    if (body)
+        g_dbus_message_set_body(message, body);
+    if (g_unix_fd_list_get_length(fd_list) > 0)
+        g_dbus_message_set_unix_fd_list(message, fd_list);
+
+    if (opts->flags & G_DBUS_CALL_FLAGS_NO_AUTO_START)
+        flags |= G_DBUS_MESSAGE_FLAGS_NO_AUTO_START;
+    if (opts->flags & G_DBUS_CALL_FLAGS_ALLOW_INTERACTIVE_AUTHORIZATION)
+        flags |= G_DBUS_MESSAGE_FLAGS_ALLOW_INTERACTIVE_AUTHORIZATION;
+    g_dbus_message_set_flags(message, flags);
+
+    g_dbus_connection_send_message(call->conn, message, G_DBUS_SEND_MESSAGE_FLAGS_NONE, NULL, &error);
+
+    g_object_unref(message);
+    g_ptr_array_set_size(fd_lists, 0);
+
+    if (error) {
+        lua_pushnil(L);
+        push_error(L, error);
+        g_error_free(error);
+        return 2;
+    }
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+ * Parameters start at index. In mainloop they are followed by callback and
+ * callback_arg, which is resumed with reply.
+ */
+int do_call(lua_State *L, struct easydbus_state *state, const struct call *call,
+            const struct call_options *opts, int index)
 {
-    struct easydbus_state *state = lua_touserdata(L, lua_upvalueindex(1));
-    GDBusConnection *conn = get_conn(L, 1);
-    const char *bus_name = luaL_checkstring(L, 2);
-    const char *object_path = luaL_checkstring(L, 3);
-    const char *interface_name = luaL_checkstring(L, 4);
-    const char *method_name = luaL_checkstring(L, 5);
-    const char *sig = lua_tostring(L, 6);
     GVariant *params = NULL;
+    GPtrArray *fd_lists;
+    GUnixFDList *fd_list;
     lua_State *T;
-    int i, n_args = lua_gettop(L);
-    int n_params = n_args - 6;
-    GUnixFDList *fd_list = g_unix_fd_list_new();
+    int n_args = lua_gettop(L);
+    int n_params = n_args - index + 1;
 
     g_debug("%s: conn=%p bus_name=%s object_path=%s interface_name=%s method_name=%s sig=%s",
-            __FUNCTION__, (void *) conn, bus_name, object_path, interface_name, method_name, sig);
-
-    luaL_argcheck(L, g_dbus_is_name(bus_name), 2, "Invalid bus name");
-    luaL_argcheck(L, g_variant_is_object_path(object_path), 3, "Invalid object path");
-    luaL_argcheck(L, g_dbus_is_interface_name(interface_name), 4, "Invalid interface name");
+            __FUNCTION__, (void *) call->conn, call->bus_name, call->object_path,
+            call->interface_name, call->method_name, call->sig ? call->sig->sig : NULL);
 
     if (!in_mainloop(state)) {
         GVariant *result;
@@ -116,34 +307,37 @@ static int bus_call(lua_State *L)
         int ret;
         GUnixFDList *out_fd_list = NULL;
 
+        fd_lists = push_ptr_array(L, 1, g_object_unref);
+        g_ptr_array_add(fd_lists, g_unix_fd_list_new());
+        fd_list = fd_lists->pdata[0];
         if (n_params > 0)
-            params = range_to_tuple(L, 7, 7 + n_params, sig, fd_list);
+            params = range_to_tuple(L, index, index + n_params, call->sig, fd_list);
 
-        result = g_dbus_connection_call_with_unix_fd_list_sync(conn,
-                                                               bus_name,
-                                                               object_path,
-                                                               interface_name,
-                                                               method_name,
+        result = g_dbus_connection_call_with_unix_fd_list_sync(call->conn,
+                                                               call->bus_name,
+                                                               call->object_path,
+                                                               call->interface_name,
+                                                               call->method_name,
                                                                params,
-                                                               NULL,
-                                                               G_DBUS_CALL_FLAGS_NONE,
-                                                               -1,
+                                                               opts->reply_type,
+                                                               opts->flags,
+                                                               opts->timeout,
                                                                fd_list,
                                                                &out_fd_list,
-                                                               NULL,
+                                                               opts->cancellable,
                                                                &error);
 
-        g_object_unref(fd_list);
+        g_ptr_array_set_size(fd_lists, 0);
 
         if (error) {
             lua_pushnil(L);
-            lua_pushstring(L, error->message);
+            push_error(L, error);
             g_clear_error(&error);
             return 2;
         }
 
         g_assert(result != NULL);
-        ret = push_tuple(L, result, out_fd_list);
+        ret = push_tuple(L, result, out_fd_list, state->decode_flags);
         if (out_fd_list)
             g_object_unref(out_fd_list);
         g_variant_unref(result);
@@ -153,559 +347,2758 @@ static int bus_call(lua_State *L)
     /* Remove callback + user_data */
     n_params -= 2;
 
-    T = lua_newthread(L);
+    /* Read parameters, before thread is anchored, fd list is freed on error */
+    fd_lists = push_ptr_array(L, 1, g_object_unref);
+    g_ptr_array_add(fd_lists, g_unix_fd_list_new());
+    fd_list = fd_lists->pdata[0];
+    if (n_params > 0)
+        params = range_to_tuple(L, index, index + n_params, call->sig, fd_list);
 
-    lua_pushlightuserdata(L, conn);
-    for (i = 2; i <= n_args; i++) {
-        lua_pushvalue(L, i);
+    T = lua_newthread(L);
 
-        if (lua_type(L, i) == LUA_TSTRING)
-            g_debug("arg %d: %s", i, lua_tostring(L, i));
-        else
-            g_debug("arg %d: type=%s", i, lua_typename(L, lua_type(L, i)));
-    }
-    lua_xmove(L, T, n_args);
+    lua_pushlightuserdata(L, state);
+    lua_pushvalue(L, n_args - 1);
+    lua_pushvalue(L, n_args);
+    lua_xmove(L, T, 3);
 
-    /* Push thread to registry so we will prevent garbage collection */
+    /*
+     * Push thread to registry so we will prevent garbage collection. Reply,
+     * error, timeout and cancellation all end in call_callback(), which
+     * releases it.
+     */
     lua_pushlightuserdata(L, T);
     lua_pushvalue(L, -2);
     lua_rawset(L, LUA_REGISTRYINDEX);
     lua_pop(L, 1);
 
-    /* Read parameters */
-    if (n_params > 0)
-        params = range_to_tuple(L, 7, 7 + n_params, sig, fd_list);
-
-    g_dbus_connection_call(conn,
-                           bus_name,
-                           object_path,
-                           interface_name,
-                           method_name,
-                           params, /* parameters */
-                           NULL, /* reply_type */
-                           G_DBUS_CALL_FLAGS_NONE,
-                           -1, /* default timeout */
-                           NULL /* cancellable */,
-                           call_callback,
-                           T);
-
-    g_object_unref(fd_list);
+    g_dbus_connection_call_with_unix_fd_list(call->conn,
+                                             call->bus_name,
+                                             call->object_path,
+                                             call->interface_name,
+                                             call->method_name,
+                                             params,
+                                             opts->reply_type,
+                                             opts->flags,
+                                             opts->timeout,
+                                             fd_list,
+                                             opts->cancellable,
+                                             call_callback,
+                                             T);
+
+    g_ptr_array_set_size(fd_lists, 0);
 
     return 0;
 }
 
-static int bus_introspect(lua_State *L)
+/*
+ * Read and validate call target at index.
+ */
+static void check_call(lua_State *L, int index, struct call *call)
 {
-    GDBusConnection *conn = get_conn(L, 1);
-    const char *bus_name = luaL_checkstring(L, 2);
-    const char *object_path = luaL_checkstring(L, 3);
-    const gchar *xml_data;
-    GDBusNodeInfo *node;
-    GVariant *result;
-    GError *error = NULL;
-    int i;
-    int m;
-
-    result = g_dbus_connection_call_sync(conn,
-                                         bus_name,
-                                         object_path,
-                                         "org.freedesktop.DBus.Introspectable",
-                                         "Introspect",
-                                         NULL,
-                                         G_VARIANT_TYPE("(s)"),
-                                         G_DBUS_CALL_FLAGS_NONE,
-                                         -1,
-                                         NULL,
-                                         &error);
-
-    if (!result) {
-        lua_pushnil(L);
-        lua_pushstring(L, error->message);
-        g_error_free(error);
-        return 2;
-    }
+    call->conn = get_conn(L, 1);
+    /* Peer connections have no bus, so there is nobody to route by name */
+    if (!lua_toboolean(L, index) && !g_dbus_connection_get_unique_name(call->conn))
+        call->bus_name = NULL;
+    else
+        call->bus_name = luaL_checkstring(L, index);
+    call->object_path = luaL_checkstring(L, index + 1);
+    call->interface_name = luaL_checkstring(L, index + 2);
+    call->method_name = luaL_checkstring(L, index + 3);
+    call->sig = signature_check(L, index + 4);
+
+    luaL_argcheck(L, !call->bus_name || g_dbus_is_name(call->bus_name), index, "Invalid bus name");
+    luaL_argcheck(L, g_variant_is_object_path(call->object_path), index + 1, "Invalid object path");
+    luaL_argcheck(L, g_dbus_is_interface_name(call->interface_name), index + 2, "Invalid interface name");
+    luaL_argcheck(L, g_dbus_is_member_name(call->method_name), index + 3, "Invalid method name");
+}
 
-    g_variant_get(result, "(&s)", &xml_data);
+/*
+ * Args:
+ * 1) conn
+ * options (optional table, following args are shifted by one)
+ * 2) bus_name
+ * 3) object_path
+ * 4) interface_name
+ * 5) method_name
+ * 6) signature
+ * 7) parameters ...
+ * last-1) callback
+ * last) callback_arg
+ */
+static int bus_call(lua_State *L)
+{
+    struct easydbus_state *state = lua_touserdata(L, lua_upvalueindex(1));
+    int a = lua_istable(L, 2) ? 3 : 2; /* first argument after options */
+    struct call_options opts;
+    struct call call;
 
-    error = NULL;
-    node = g_dbus_node_info_new_for_xml(xml_data, &error);
-    g_variant_unref(result);
+    check_call_options(L, 2, &opts);
+    check_call(L, a, &call);
 
-    if (!node) {
-        lua_pushnil(L);
-        lua_pushstring(L, error->message);
-        g_error_free(error);
-        return 2;
-    }
+    if (opts.no_reply)
+        return do_send(L, &call, &opts, a + 5);
 
-    lua_newtable(L);
-    if (node->interfaces) {
-        for (i = 0; node->interfaces[i] != NULL; i++) {
-            const GDBusInterfaceInfo *iface = node->interfaces[i];
-            lua_pushstring(L, iface->name);
-            lua_newtable(L);
-            if (iface->methods) {
-                for (m = 0; iface->methods[m] != NULL; m++) {
-                    GDBusMethodInfo *method = iface->methods[m];
-                    lua_pushstring(L, method->name);
-                    lua_rawseti(L, -2, m+1);
-                }
-            }
-            lua_rawset(L, -3);
-        }
-    }
-    return 1;
+    return do_call(L, state, &call, &opts, a + 5);
 }
 
-static GDBusArgInfo **add_args_info(lua_State *L, int tab_index, int arg_index)
+/*
+ * Args:
+ * 1) conn
+ * options (optional table, following args are shifted by one)
+ * 2) bus_name
+ * 3) object_path
+ * 4) interface_name
+ * 5) method_name
+ * 6) signature
+ * 7) parameters ...
+ *
+ * Same as call with no_reply option.
+ */
+static int bus_send(lua_State *L)
 {
-    char *sig;
-    const char *startptr, *endptr;
-    GDBusArgInfo *arg_info;
-    GPtrArray *args = g_ptr_array_new();
-    gboolean ret = TRUE;
+    int a = lua_istable(L, 2) ? 3 : 2;
+    struct call_options opts;
+    struct call call;
 
-    lua_rawgeti(L, tab_index, arg_index);
-    startptr = lua_tostring(L, -1);
-    while (*startptr != '\0' && (ret = g_variant_type_string_scan(startptr, NULL, &endptr))) {
-        sig = g_strndup(startptr, endptr - startptr);
+    check_call_options(L, 2, &opts);
+    check_call(L, a, &call);
 
-        arg_info = g_new0(GDBusArgInfo, 1);
-        g_ptr_array_add(args, arg_info);
+    return do_send(L, &call, &opts, a + 5);
+}
 
-        arg_info->ref_count = 1;
-        arg_info->signature = sig;
+struct batch;
 
-        startptr = endptr;
-    }
+struct batch_reply {
+    struct batch *batch;
+    GVariant *result;
+    GUnixFDList *fd_list;
+    GError *error;
+};
+
+/*
+ * Calls sent back to back, with replies collected in order.
+ */
+struct batch {
+    struct easydbus_state *state;
+    lua_State *T;       /* resumed with results, NULL when blocking */
+    GMainLoop *loop;    /* run while blocking */
+    guint n_calls;
+    guint pending;
+    struct batch_reply replies[];
+};
 
-    if (!ret)
-        g_error("Wrong signature");
+/*
+ * Push table with every reply packed as {ret..., n = n} or {nil, error, n = 2}.
+ */
+static void push_batch_results(lua_State *L, struct batch *batch)
+{
+    struct batch_reply *reply;
+    int i, top, n;
+    guint c;
 
-    lua_pop(L, 1);
+    lua_createtable(L, batch->n_calls, 0);
+    for (c = 0; c < batch->n_calls; c++) {
+        reply = &batch->replies[c];
+        top = lua_gettop(L);
 
-    g_ptr_array_add(args, NULL);
-    return (GDBusArgInfo **) g_ptr_array_free(args, FALSE);
+        if (reply->error) {
+            lua_pushnil(L);
+            push_error(L, reply->error);
+            g_clear_error(&reply->error);
+        } else {
+            push_tuple(L, reply->result, reply->fd_list, batch->state->decode_flags);
+            g_variant_unref(reply->result);
+        }
+        if (reply->fd_list)
+            g_object_unref(reply->fd_list);
+
+        n = lua_gettop(L) - top;
+        lua_createtable(L, n, 1);
+        lua_insert(L, top + 1);
+        for (i = n; i >= 1; i--)
+            lua_rawseti(L, top + 1, i);
+        lua_pushinteger(L, n);
+        lua_setfield(L, top + 1, "n");
+
+        lua_rawseti(L, top, c + 1);
+    }
 }
 
-static void add_method_info(lua_State *L, GPtrArray *methods)
+/*
+ * Resume waiting coroutine with results
+ */
+static gboolean batch_finish(gpointer user_data)
 {
-    int index = lua_gettop(L);
-    const char *method_name = lua_tostring(L, -2);
-    GDBusMethodInfo *method_info = g_new0(GDBusMethodInfo, 1);
-    GDBusArgInfo **in_args;
-    GDBusArgInfo **out_args;
+    struct batch *batch = user_data;
+    lua_State *T = batch->T;
 
-    in_args = add_args_info(L, index, 1);
-    out_args = add_args_info(L, index, 2);
+    push_batch_results(T, batch);
+    g_free(batch);
 
-    g_ptr_array_add(methods, method_info);
-    method_info->ref_count = 1;
-    method_info->name = g_strdup(method_name);
-    method_info->in_args = in_args;
-    method_info->out_args = out_args;
+    ed_resume(T, 2);
+
+    /* Remove thread from registry, so garbage collection can take place */
+    lua_pushlightuserdata(T, T);
+    lua_pushnil(T);
+    lua_rawset(T, LUA_REGISTRYINDEX);
+
+    return FALSE;
 }
 
-static GDBusInterfaceInfo *format_interface_info(lua_State *L, int index,
-                                                 const char *interface_name)
+static void batch_callback(GObject *source, GAsyncResult *res, gpointer user_data)
 {
-    GDBusInterfaceInfo *interface_info;
-    GPtrArray *methods = g_ptr_array_new();
+    struct batch_reply *reply = user_data;
+    struct batch *batch = reply->batch;
 
-    lua_pushnil(L);
-    while (lua_next(L, index) != 0) {
-        g_debug("Parsing method: %s", lua_tostring(L, -2));
-        add_method_info(L, methods);
-        lua_pop(L, 1);
-    }
+    reply->result = g_dbus_connection_call_with_unix_fd_list_finish(G_DBUS_CONNECTION(source),
+                                                                    &reply->fd_list,
+                                                                    res,
+                                                                    &reply->error);
 
-    g_ptr_array_add(methods, NULL);
+    g_debug("%s: pending=%u", __FUNCTION__, batch->pending);
 
-    interface_info = g_new0(GDBusInterfaceInfo, 1);
-    interface_info->ref_count = 1;
-    interface_info->name = g_strdup(interface_name);
-    interface_info->methods = (GDBusMethodInfo **) g_ptr_array_free(methods, FALSE);
+    if (--batch->pending)
+        return;
 
-    return interface_info;
+    if (batch->loop)
+        g_main_loop_quit(batch->loop);
+    else
+        batch_finish(batch);
 }
 
 /*
  * Args:
- * 1) invocation method
+ * 1) conn
+ * 2) array of calls: {bus_name, object_path, interface_name, method_name, sig, parameters ...}
+ * 3) callback
+ * 4) callback_arg
+ *
+ * All calls are sent before any reply is awaited. Outside of mainloop replies
+ * are awaited in private main context, so no other sources are dispatched.
  */
-static int interface_method_return(lua_State *L)
+static int bus_call_many(lua_State *L)
 {
-    GDBusMethodInvocation *invocation;
-    const gchar *sender;
-    const gchar *object_path;
-    const gchar *interface_name;
-    const gchar *method_name;
-    int i, n_args = lua_gettop(L);
-    GVariant *result;
-    const char *out_sig;
-    GUnixFDList *fd_list = g_unix_fd_list_new();
-
-    luaL_argcheck(L, lua_istable(L, 1), 1, "table expected");
-    lua_rawgeti(L, 1, 1);
-    lua_rawgeti(L, 1, 2);
-    invocation = lua_touserdata(L, -2);
-    out_sig = lua_tostring(L, -1);
-    lua_pop(L, 2);
+    struct easydbus_state *state = lua_touserdata(L, lua_upvalueindex(1));
+    GDBusConnection *conn = get_conn(L, 1);
+    guint i, n_calls;
+    int j, n, base;
+    struct batch *batch;
+    GPtrArray *params;
+    GPtrArray *fd_lists;
+    GMainContext *context = NULL;
+    lua_State *T;
 
-    sender = g_dbus_method_invocation_get_sender(invocation);
-    object_path = g_dbus_method_invocation_get_object_path(invocation);
-    interface_name = g_dbus_method_invocation_get_interface_name(invocation);
-    method_name = g_dbus_method_invocation_get_method_name(invocation);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    n_calls = lua_rawlen(L, 2);
 
-    g_debug("%s: sender=%s object_path=%s interface_name=%s method_name=%s out_sig=%s",
-            __FUNCTION__, sender, object_path, interface_name, method_name, out_sig);
+    g_debug("%s: conn=%p n_calls=%u", __FUNCTION__, (void *) conn, n_calls);
 
-    for (i = 2; i <= n_args; i++) {
-        if (lua_type(L, i) == LUA_TSTRING)
-            g_debug("arg %d type=%s value=%s", i, lua_typename(L, lua_type(L, i)), lua_tostring(L, i));
-        else
-            g_debug("arg %d type=%s", i, lua_typename(L, lua_type(L, i)));
+    /* Validate and marshal everything before first call is sent */
+    lua_settop(L, 4);
+    params = push_ptr_array(L, n_calls, variant_free);
+    fd_lists = push_ptr_array(L, n_calls, g_object_unref);
+    base = lua_gettop(L);
+    for (i = 0; i < n_calls; i++) {
+        lua_rawgeti(L, 2, i + 1);
+        if (!lua_istable(L, -1))
+            luaL_error(L, "Call %d is not a table", i + 1);
+        n = lua_rawlen(L, -1);
+        luaL_checkstack(L, n, "too many parameters");
+        for (j = 1; j <= n; j++)
+            lua_rawgeti(L, base + 1, j);
+
+        if (n < 4 || !g_dbus_is_name(luaL_optstring(L, base + 2, "")))
+            luaL_error(L, "Invalid bus name in call %d", i + 1);
+        if (!g_variant_is_object_path(luaL_optstring(L, base + 3, "")))
+            luaL_error(L, "Invalid object path in call %d", i + 1);
+        if (!g_dbus_is_interface_name(luaL_optstring(L, base + 4, "")))
+            luaL_error(L, "Invalid interface name in call %d", i + 1);
+        if (!g_dbus_is_member_name(luaL_optstring(L, base + 5, "")))
+            luaL_error(L, "Invalid method name in call %d", i + 1);
+
+        g_ptr_array_add(fd_lists, g_unix_fd_list_new());
+        g_ptr_array_add(params, NULL);
+        if (n > 5)
+            params->pdata[i] = g_variant_ref_sink(range_to_tuple(L, base + 7, base + 2 + n,
+                                                                 signature_check(L, base + 6),
+                                                                 fd_lists->pdata[i]));
+
+        lua_settop(L, base);
     }
 
-    result = range_to_tuple(L, 2, n_args + 1, out_sig, fd_list);
+    batch = g_malloc0(sizeof(*batch) + n_calls * sizeof(batch->replies[0]));
+    batch->state = state;
+    batch->n_calls = n_calls;
+    batch->pending = n_calls;
 
-    g_dbus_method_invocation_return_value_with_unix_fd_list(invocation, result, fd_list);
+    if (!in_mainloop(state)) {
+        context = g_main_context_new();
+        g_main_context_push_thread_default(context);
+    } else {
+        T = lua_newthread(L);
+        lua_pushvalue(L, 3); /* callback */
+        lua_pushvalue(L, 4); /* callback_arg */
+        lua_xmove(L, T, 2);
+
+        /* Push thread to registry so we will prevent garbage collection */
+        lua_pushlightuserdata(L, T);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, LUA_REGISTRYINDEX);
+        lua_pop(L, 1);
 
-    g_object_unref(fd_list);
+        batch->T = T;
+    }
 
-    return 0;
-}
+    for (i = 0; i < n_calls; i++) {
+        lua_rawgeti(L, 2, i + 1);
+        lua_rawgeti(L, -1, 1);
+        lua_rawgeti(L, -2, 2);
+        lua_rawgeti(L, -3, 3);
+        lua_rawgeti(L, -4, 4);
+
+        batch->replies[i].batch = batch;
+        g_dbus_connection_call_with_unix_fd_list(conn,
+                                                 lua_tostring(L, -4),
+                                                 lua_tostring(L, -3),
+                                                 lua_tostring(L, -2),
+                                                 lua_tostring(L, -1),
+                                                 params->pdata[i],
+                                                 NULL, /* reply_type */
+                                                 G_DBUS_CALL_FLAGS_NONE,
+                                                 -1, /* default timeout */
+                                                 fd_lists->pdata[i],
+                                                 NULL, /* cancellable */
+                                                 batch_callback,
+                                                 &batch->replies[i]);
+        lua_pop(L, 5);
+    }
 
-struct object_ud {
-    struct easydbus_state *state;
-    int ref;
-};
+    /* Messages hold their own references now */
+    g_ptr_array_set_size(params, 0);
+    g_ptr_array_set_size(fd_lists, 0);
 
-static void object_ud_free(gpointer user_data)
-{
-    struct object_ud *obj_ud = user_data;
-    struct easydbus_state *state = obj_ud->state;
+    if (!context) {
+        /* Empty batch is resumed from mainloop, after caller yields */
+        if (n_calls == 0)
+            state_idle_add(state, batch_finish, batch);
+        return 0;
+    }
+
+    if (batch->pending) {
+        batch->loop = g_main_loop_new(context, FALSE);
+        g_main_loop_run(batch->loop);
+        g_main_loop_unref(batch->loop);
+    }
+
+    g_main_context_pop_thread_default(context);
+    g_main_context_unref(context);
+
+    push_batch_results(L, batch);
+    g_free(batch);
+
+    return 1;
+}
+
+static void release_thread(lua_State *T)
+{
+    /* Remove thread from registry, so garbage collection can take place */
+    lua_pushlightuserdata(T, T);
+    lua_pushnil(T);
+    lua_rawset(T, LUA_REGISTRYINDEX);
+}
+
+static void introspect_resume(GDBusNodeInfo *node, GError *error, gpointer user_data)
+{
+    lua_State *T = user_data;
+
+    if (node) {
+        push_node_info(T, node);
+        ed_resume(T, 2);
+    } else {
+        lua_pushnil(T);
+        push_error(T, error);
+        ed_resume(T, 3);
+    }
+
+    release_thread(T);
+}
+
+static gboolean introspect_resume_cached(gpointer user_data)
+{
+    lua_State *T = user_data;
+
+    ed_resume(T, 2);
+    release_thread(T);
+
+    return FALSE;
+}
+
+/*
+ * Args:
+ * 1) conn
+ * 2) bus_name
+ * 3) object_path
+ * 4) callback
+ * 5) callback_arg
+ *
+ * Introspection data is cached per connection, until owner of bus_name
+ * changes or it is invalidated.
+ */
+static int bus_introspect(lua_State *L)
+{
+    struct easydbus_state *state = lua_touserdata(L, lua_upvalueindex(1));
+    GDBusConnection *conn = get_conn(L, 1);
+    const char *bus_name = luaL_checkstring(L, 2);
+    const char *object_path = luaL_checkstring(L, 3);
+    GDBusNodeInfo *node;
+    GError *error = NULL;
+    lua_State *T;
+
+    luaL_argcheck(L, g_dbus_is_name(bus_name), 2, "Invalid bus name");
+    luaL_argcheck(L, g_variant_is_object_path(object_path), 3, "Invalid object path");
+
+    if (!in_mainloop(state)) {
+        node = introspect_sync(conn, state, bus_name, object_path, &error);
+        if (!node) {
+            lua_pushnil(L);
+            push_error(L, error);
+            g_error_free(error);
+            return 2;
+        }
+
+        push_node_info(L, node);
+        g_dbus_node_info_unref(node);
+        return 1;
+    }
+
+    T = lua_newthread(L);
+    lua_pushvalue(L, 4);
+    lua_pushvalue(L, 5);
+    lua_xmove(L, T, 2);
+
+    /* Push thread to registry so we will prevent garbage collection */
+    lua_pushlightuserdata(L, T);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+    lua_pop(L, 1);
+
+    /* Cached data is returned from mainloop, after caller yields */
+    node = introspect_lookup(conn, state, bus_name, object_path);
+    if (node) {
+        push_node_info(T, node);
+        g_dbus_node_info_unref(node);
+        state_idle_add(state, introspect_resume_cached, T);
+    } else {
+        introspect_async(conn, state, bus_name, object_path, introspect_resume, T);
+    }
+
+    return 0;
+}
+
+/*
+ * Args:
+ * 1) conn
+ * 2) bus_name
+ * 3) object_path (optional, all paths of bus_name when nil)
+ *
+ * Drops cached introspection data, e.g. after service added objects.
+ */
+static int bus_invalidate_introspection(lua_State *L)
+{
+    struct easydbus_state *state = lua_touserdata(L, lua_upvalueindex(1));
+    GDBusConnection *conn = get_conn(L, 1);
+    const char *bus_name = luaL_checkstring(L, 2);
+    const char *object_path = luaL_optstring(L, 3, NULL);
+
+    luaL_argcheck(L, !object_path || g_variant_is_object_path(object_path), 3,
+                  "Invalid object path");
+
+    introspect_invalidate(conn, state, bus_name, object_path);
+
+    return 0;
+}
+
+static GDBusArgInfo **add_args_info(lua_State *L, int tab_index, int arg_index)
+{
+    const struct signature *sig;
+    GDBusArgInfo *arg_info;
+    GPtrArray *args = g_ptr_array_new();
+    guint i;
+
+    lua_rawgeti(L, tab_index, arg_index);
+    sig = signature_check(L, -1);
+    for (i = 0; sig && i < sig->tuple.n_children; i++) {
+        arg_info = g_new0(GDBusArgInfo, 1);
+        g_ptr_array_add(args, arg_info);
+
+        arg_info->ref_count = 1;
+        arg_info->signature = g_strdup(sig->tuple.children[i].sig);
+    }
+
+    lua_pop(L, 1);
+
+    g_ptr_array_add(args, NULL);
+    return (GDBusArgInfo **) g_ptr_array_free(args, FALSE);
+}
+
+static void add_method_info(lua_State *L, GPtrArray *methods)
+{
+    int index = lua_gettop(L);
+    const char *method_name = lua_tostring(L, -2);
+    GDBusMethodInfo *method_info = g_new0(GDBusMethodInfo, 1);
+    GDBusArgInfo **in_args;
+    GDBusArgInfo **out_args;
+
+    in_args = add_args_info(L, index, 1);
+    out_args = add_args_info(L, index, 2);
+
+    g_ptr_array_add(methods, method_info);
+    method_info->ref_count = 1;
+    method_info->name = g_strdup(method_name);
+    method_info->in_args = in_args;
+    method_info->out_args = out_args;
+}
+
+static void add_property_info(lua_State *L, GPtrArray *properties)
+{
+    const char *property_name = lua_tostring(L, -2);
+    GDBusPropertyInfo *property_info = g_new0(GDBusPropertyInfo, 1);
+    const struct signature *sig;
+    const char *access;
+
+    lua_getfield(L, -1, "sig");
+    sig = signature_check(L, -1);
+    lua_getfield(L, -2, "access");
+    access = lua_tostring(L, -1);
+
+    if (access && strcmp(access, "read") && strcmp(access, "write") && strcmp(access, "readwrite")) {
+        g_free(property_info);
+        luaL_error(L, "Invalid access of property %s: %s", property_name, access);
+    }
+
+    g_ptr_array_add(properties, property_info);
+    property_info->ref_count = 1;
+    property_info->name = g_strdup(property_name);
+    property_info->signature = g_strdup(sig ? sig->sig : "v");
+
+    if (!access || !strcmp(access, "read") || !strcmp(access, "readwrite"))
+        property_info->flags |= G_DBUS_PROPERTY_INFO_FLAGS_READABLE;
+    if (access && (!strcmp(access, "write") || !strcmp(access, "readwrite")))
+        property_info->flags |= G_DBUS_PROPERTY_INFO_FLAGS_WRITABLE;
+
+    lua_pop(L, 2);
+}
+
+static GDBusInterfaceInfo *format_interface_info(lua_State *L, int index, int props_index,
+                                                 const char *interface_name)
+{
+    GDBusInterfaceInfo *interface_info;
+    GPtrArray *methods = g_ptr_array_new();
+    GPtrArray *properties = g_ptr_array_new();
+
+    lua_pushnil(L);
+    while (lua_next(L, index) != 0) {
+        g_debug("Parsing method: %s", lua_tostring(L, -2));
+        add_method_info(L, methods);
+        lua_pop(L, 1);
+    }
+
+    if (props_index) {
+        lua_pushnil(L);
+        while (lua_next(L, props_index) != 0) {
+            g_debug("Parsing property: %s", lua_tostring(L, -2));
+            add_property_info(L, properties);
+            lua_pop(L, 1);
+        }
+    }
+
+    g_ptr_array_add(methods, NULL);
+    g_ptr_array_add(properties, NULL);
+
+    interface_info = g_new0(GDBusInterfaceInfo, 1);
+    interface_info->ref_count = 1;
+    interface_info->name = g_strdup(interface_name);
+    interface_info->methods = (GDBusMethodInfo **) g_ptr_array_free(methods, FALSE);
+    interface_info->properties = (GDBusPropertyInfo **) g_ptr_array_free(properties, FALSE);
+
+    return interface_info;
+}
+
+static int pending_invocation__gc(lua_State *L)
+{
+    struct pending_invocation *pending = lua_touserdata(L, 1);
+
+    if (!pending->invocation)
+        return 0;
+
+    g_debug("%s: method_name=%s", __FUNCTION__,
+            g_dbus_method_invocation_get_method_name(pending->invocation));
+
+    g_dbus_method_invocation_return_dbus_error(pending->invocation,
+                                               "org.freedesktop.DBus.Error.Failed",
+                                               "Method handler was never resumed");
+    pending->invocation = NULL;
+
+    return 0;
+}
+
+/*
+ * Keeps invocation of handler thread T, which yielded.
+ */
+static void pending_add(lua_State *L, lua_State *T, GDBusMethodInvocation *invocation)
+{
+    struct pending_invocation *pending;
+
+    lua_pushlightuserdata(L, PENDING_HANDLERS);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_pushthread(T);
+    lua_xmove(T, L, 1);
+
+    pending = lua_newuserdata(L, sizeof(*pending));
+    pending->invocation = invocation;
+    lua_pushlightuserdata(L, PENDING_INVOCATION_MT);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_setmetatable(L, -2);
+
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+}
+
+/*
+ * Returns invocation of thread at index, which yielded before, or NULL. It is
+ * not pending anymore, so caller has to reply.
+ */
+static GDBusMethodInvocation *pending_take(lua_State *L, int index)
+{
+    struct pending_invocation *pending;
+    GDBusMethodInvocation *invocation = NULL;
+
+    if (index < 0)
+        index = lua_gettop(L) + index + 1;
+
+    lua_pushlightuserdata(L, PENDING_HANDLERS);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_pushvalue(L, index);
+    lua_rawget(L, -2);
+    pending = lua_touserdata(L, -1);
+    if (pending) {
+        invocation = pending->invocation;
+        pending->invocation = NULL;
+
+        lua_pushvalue(L, index);
+        lua_pushnil(L);
+        lua_rawset(L, -4);
+    }
+    lua_pop(L, 2);
+
+    return invocation;
+}
+
+/*
+ * Args:
+ * 1) lightuserdata with method invocation
+ * 2) lightuserdata with out signature
+ * ...) return values
+ *
+ * Called from method runner, with return values of method handler. Values are
+ * marshalled before handler stops being pending, so marshalling error is still
+ * replied by handler_error().
+ */
+static int bus_method_return(lua_State *L)
+{
+    GDBusMethodInvocation *invocation = lua_touserdata(L, 1);
+    const struct signature *out_sig = lua_touserdata(L, 2);
+    int top = lua_gettop(L);
+    GPtrArray *fd_lists = NULL;
+    GUnixFDList *fd_list = NULL;
+    GVariant *result;
+
+    luaL_argcheck(L, invocation, 1, "invocation expected");
+
+    g_debug("%s: method_name=%s out_sig=%s", __FUNCTION__,
+            g_dbus_method_invocation_get_method_name(invocation),
+            out_sig ? out_sig->sig : NULL);
+
+    /* File descriptor list is needed only if there may be any */
+    if (!out_sig || strchr(out_sig->sig, 'h')) {
+        fd_lists = push_ptr_array(L, 1, g_object_unref);
+        g_ptr_array_add(fd_lists, g_unix_fd_list_new());
+        fd_list = fd_lists->pdata[0];
+    }
+
+    result = range_to_tuple(L, 3, top + 1, out_sig, fd_list);
+
+    /* Handler which yielded is not pending anymore */
+    lua_pushthread(L);
+    pending_take(L, -1);
+    lua_pop(L, 1);
+
+    g_dbus_method_invocation_return_value_with_unix_fd_list(invocation, result, fd_list);
+
+    if (fd_lists)
+        g_ptr_array_set_size(fd_lists, 0);
+
+    return 0;
+}
+
+/*
+ * Args:
+ * 1) thread
+ * 2) error message
+ *
+ * Replies with error if thread is method handler which yielded before.
+ */
+static int bus_handler_error(lua_State *L)
+{
+    GDBusMethodInvocation *invocation;
+
+    luaL_checktype(L, 1, LUA_TTHREAD);
+    lua_settop(L, 2);
+
+    invocation = pending_take(L, 1);
+    if (!invocation) {
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+
+    return_error(L, 2, invocation);
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+ * Registered object. Methods and properties tables are referenced from Lua
+ * registry, names of changed properties are collected until next main loop
+ * iteration.
+ */
+struct registration {
+    struct easydbus_state *state;
+    int ref;
+    int props_ref;
+    GDBusConnection *conn;
+    GDBusInterfaceInfo *interface_info;
+    gchar *object_path;
+    GHashTable *changed;
+    guint changed_id;
+};
+
+/*
+ * Registrations of state on connection, by registration id.
+ */
+static GHashTable *get_registrations(GDBusConnection *conn, struct easydbus_state *state)
+{
+    GHashTable *registrations;
+
+    registrations = conn_data_get(conn, state, "easydbus-registrations");
+    if (!registrations) {
+        registrations = g_hash_table_new(NULL, NULL);
+        conn_data_set(conn, state, "easydbus-registrations", registrations,
+                      (GDestroyNotify) g_hash_table_unref);
+    }
+
+    return registrations;
+}
+
+static void registration_free(gpointer user_data)
+{
+    struct registration *reg = user_data;
+    struct easydbus_state *state = reg->state;
 
     g_debug("%s: %p", __FUNCTION__, user_data);
 
-    luaL_unref(state->L, LUA_REGISTRYINDEX, obj_ud->ref);
+    if (reg->changed_id)
+        state_source_remove(state, reg->changed_id);
+
+    luaL_unref(state->L, LUA_REGISTRYINDEX, reg->ref);
+    luaL_unref(state->L, LUA_REGISTRYINDEX, reg->props_ref);
+
+    g_dbus_interface_info_unref(reg->interface_info);
+    g_hash_table_unref(reg->changed);
+    g_free(reg->object_path);
+    g_free(reg);
+}
+
+/*
+ * Args:
+ * 1) properties table
+ * 2) property name
+ *
+ * Returns property value as lightuserdata with GVariant.
+ */
+static int property_value(lua_State *L)
+{
+    const char *property_name = lua_tostring(L, 2);
+    const struct signature *sig;
+    GVariant *tuple;
+
+    lua_getfield(L, 1, property_name);
+    if (!lua_istable(L, 4))
+        return luaL_error(L, "No %s in properties lookup", property_name);
+
+    /* Without signature property is announced as variant */
+    lua_getfield(L, 4, "sig");
+    sig = signature_check(L, 5);
+    if (!sig)
+        sig = signature_lookup("v");
+    lua_getfield(L, 4, "value");
+
+    tuple = g_variant_ref_sink(range_to_tuple(L, 6, 7, sig, NULL));
+    lua_pushlightuserdata(L, g_variant_get_child_value(tuple, 0));
+    g_variant_unref(tuple);
+
+    return 1;
+}
+
+/*
+ * Args:
+ * 1) properties table
+ * 2) property name
+ * 3) lightuserdata with GVariant
+ *
+ * Calls setter (if any) and stores new value.
+ */
+static int property_store(lua_State *L)
+{
+    struct easydbus_state *state = lua_touserdata(L, lua_upvalueindex(1));
+    const char *property_name = lua_tostring(L, 2);
+    GVariant *value = lua_touserdata(L, 3);
+
+    lua_getfield(L, 1, property_name);
+    if (!lua_istable(L, 4))
+        return luaL_error(L, "No %s in properties lookup", property_name);
+
+    push_variant(L, value, NULL, state->decode_flags);
+
+    lua_getfield(L, 4, "setter");
+    if (!lua_isnil(L, 6)) {
+        lua_pushvalue(L, 5);
+        lua_call(L, 1, 0);
+    } else {
+        lua_pop(L, 1);
+    }
+
+    lua_setfield(L, 4, "value");
+
+    return 0;
+}
+
+/*
+ * Calls function with n_args arguments in protected mode, so Lua errors are
+ * reported as GError. Returned lightuserdata is stored in result.
+ */
+static gboolean pcall_gerror(lua_State *T, int n_args, gpointer *result, GError **error)
+{
+    if (lua_pcall(T, n_args, 1, 0)) {
+        set_gerror(T, -1, error);
+        return FALSE;
+    }
+
+    if (result)
+        *result = lua_touserdata(T, -1);
+
+    return TRUE;
+}
+
+/*
+ * Runs func(properties, property_name, ptr) for registered object.
+ */
+static gboolean property_pcall(struct registration *reg, lua_CFunction func,
+                               const gchar *property_name, gpointer ptr,
+                               gpointer *result, GError **error)
+{
+    lua_State *T = thread_acquire(reg->state);
+    gboolean ret;
+
+    lua_pushlightuserdata(T, reg->state);
+    lua_pushcclosure(T, func, 1);
+    lua_rawgeti(T, LUA_REGISTRYINDEX, reg->props_ref);
+    lua_pushstring(T, property_name);
+    lua_pushlightuserdata(T, ptr);
+
+    ret = pcall_gerror(T, 3, result, error);
+
+    thread_release(reg->state, T);
+
+    return ret;
+}
+
+static gboolean emit_properties_changed(gpointer user_data)
+{
+    struct registration *reg = user_data;
+    GDBusPropertyInfo *property_info;
+    GVariantBuilder changed;
+    GVariantBuilder invalidated;
+    GHashTableIter iter;
+    gpointer property_name;
+    GVariant *value;
+    GError *error = NULL;
+
+    g_debug("%s: object_path=%s interface_name=%s", __FUNCTION__,
+            reg->object_path, reg->interface_info->name);
+
+    reg->changed_id = 0;
+
+    g_variant_builder_init(&changed, G_VARIANT_TYPE("a{sv}"));
+    g_variant_builder_init(&invalidated, G_VARIANT_TYPE_STRING_ARRAY);
+
+    g_hash_table_iter_init(&iter, reg->changed);
+    while (g_hash_table_iter_next(&iter, &property_name, NULL)) {
+        property_info = g_dbus_interface_info_lookup_property(reg->interface_info, property_name);
+
+        /* Values of write-only properties are not exposed */
+        if (property_info->flags & G_DBUS_PROPERTY_INFO_FLAGS_READABLE) {
+            if (property_pcall(reg, property_value, property_name, NULL,
+                               (gpointer *) &value, &error)) {
+                g_variant_builder_add(&changed, "{sv}", property_name, value);
+                g_variant_unref(value);
+                continue;
+            }
+
+            g_warning("property %s error: %s", (const gchar *) property_name, error->message);
+            g_clear_error(&error);
+        }
+
+        g_variant_builder_add(&invalidated, "s", property_name);
+    }
+
+    g_hash_table_remove_all(reg->changed);
+
+    g_dbus_connection_emit_signal(reg->conn,
+                                  NULL,
+                                  reg->object_path,
+                                  "org.freedesktop.DBus.Properties",
+                                  "PropertiesChanged",
+                                  g_variant_new("(sa{sv}as)", reg->interface_info->name,
+                                                &changed, &invalidated),
+                                  &error);
+    if (error) {
+        g_warning("PropertiesChanged error: %s", error->message);
+        g_error_free(error);
+    }
+
+    return FALSE;
+}
+
+/*
+ * Changes are emitted as single PropertiesChanged signal, once current main
+ * loop iteration is done.
+ */
+static void property_changed(struct registration *reg, const gchar *property_name)
+{
+    g_hash_table_add(reg->changed, (gpointer) g_intern_string(property_name));
+
+    if (!reg->changed_id)
+        reg->changed_id = state_idle_add(reg->state, emit_properties_changed, reg);
+}
+
+static GVariant *interface_get_property(GDBusConnection *connection,
+                                       const gchar *sender,
+                                       const gchar *object_path,
+                                       const gchar *interface_name,
+                                       const gchar *property_name,
+                                       GError **error,
+                                       gpointer user_data)
+{
+    struct registration *reg = user_data;
+    GVariant *value = NULL;
+
+    g_debug("%s: sender=%s object_path=%s interface_name=%s property_name=%s",
+            __FUNCTION__, sender, object_path, interface_name, property_name);
+
+    property_pcall(reg, property_value, property_name, NULL, (gpointer *) &value, error);
+
+    return value;
+}
+
+static gboolean interface_set_property(GDBusConnection *connection,
+                                       const gchar *sender,
+                                       const gchar *object_path,
+                                       const gchar *interface_name,
+                                       const gchar *property_name,
+                                       GVariant *value,
+                                       GError **error,
+                                       gpointer user_data)
+{
+    struct registration *reg = user_data;
+
+    g_debug("%s: sender=%s object_path=%s interface_name=%s property_name=%s",
+            __FUNCTION__, sender, object_path, interface_name, property_name);
+
+    if (!property_pcall(reg, property_store, property_name, value, NULL, error))
+        return FALSE;
+
+    property_changed(reg, property_name);
+
+    return TRUE;
+}
+
+/*
+ * Resumes T with method runner. Methods table of object is expected at index 1
+ * of T. Method entry is {in_sig, out_sig, runner, handler, args...} and runner
+ * is called as runner(invocation, out_sig, handler, args..., params...), so
+ * nothing is allocated apart from params.
+ */
+void invoke_method(struct easydbus_state *state, lua_State *T,
+                   const gchar *method_name, GVariant *parameters,
+                   GDBusMethodInvocation *invocation)
+{
+    const struct signature *out_sig;
+    int ret;
+    int n_args;
+    int n_params;
+    int i;
+    GDBusMessage *message;
+    GUnixFDList *fd_list;
+
+    lua_pushstring(T, method_name);
+    lua_rawget(T, 1);
+    if (!lua_istable(T, 2)) {
+        g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR,
+                                              G_DBUS_ERROR_UNKNOWN_METHOD,
+                                              "No %s in methods lookup", method_name);
+        return;
+    }
+
+    lua_rawgeti(T, 2, 2);
+    out_sig = signature_check(T, -1);
+    lua_pop(T, 1);
+
+    /* push runner with args */
+    n_args = lua_rawlen(T, 2);
+    lua_rawgeti(T, 2, 3);
+    lua_pushlightuserdata(T, invocation);
+    lua_pushlightuserdata(T, (void *) out_sig);
+    for (i = 4; i <= n_args; i++)
+        lua_rawgeti(T, 2, i);
+
+    /* push params */
+    message = g_dbus_method_invocation_get_message(invocation);
+    fd_list = g_dbus_message_get_unix_fd_list(message);
+    n_params = push_tuple(T, parameters, fd_list, state->decode_flags);
+
+    ret = ed_resume(T, n_args - 1 + n_params);
+
+    if (ret == LUA_YIELD) {
+        /* Handler waits for some event, until it returns or raises error */
+        pending_add(state->L, T, invocation);
+    } else if (ret) {
+        return_error(T, -1, invocation);
+    }
+}
+
+static void interface_method_call(GDBusConnection *connection,
+                                  const gchar *sender,
+                                  const gchar *object_path,
+                                  const gchar *interface_name,
+                                  const gchar *method_name,
+                                  GVariant *parameters,
+                                  GDBusMethodInvocation *invocation,
+                                  gpointer user_data)
+{
+    struct registration *reg = user_data;
+    struct easydbus_state *state = reg->state;
+    lua_State *T;
+
+    g_debug("%s: sender=%s object_path=%s interface_name=%s method_name=%s",
+            __FUNCTION__, sender, object_path, interface_name, method_name);
+
+    T = thread_acquire(state);
+
+    lua_rawgeti(T, LUA_REGISTRYINDEX, reg->ref);
+    invoke_method(state, T, method_name, parameters, invocation);
+
+    thread_release(state, T);
+}
+
+static const GDBusInterfaceVTable interface_vtable = {
+    interface_method_call,
+    interface_get_property,
+    interface_set_property,
+    {0}
+};
+
+static const gchar object_manager_xml[] =
+    "<node>"
+    "  <interface name='org.freedesktop.DBus.ObjectManager'>"
+    "    <method name='GetManagedObjects'>"
+    "      <arg type='a{oa{sa{sv}}}' name='object_paths_interfaces_and_properties' direction='out'/>"
+    "    </method>"
+    "    <signal name='InterfacesAdded'>"
+    "      <arg type='o' name='object_path'/>"
+    "      <arg type='a{sa{sv}}' name='interfaces_and_properties'/>"
+    "    </signal>"
+    "    <signal name='InterfacesRemoved'>"
+    "      <arg type='o' name='object_path'/>"
+    "      <arg type='as' name='interfaces'/>"
+    "    </signal>"
+    "  </interface>"
+    "</node>";
+
+/*
+ * Object manager paths of state on connection, by registration id. Manager
+ * reports objects registered by the same state only.
+ */
+static GHashTable *get_object_managers(GDBusConnection *conn, struct easydbus_state *state)
+{
+    GHashTable *managers;
+
+    managers = conn_data_get(conn, state, "easydbus-object-managers");
+    if (!managers) {
+        managers = g_hash_table_new_full(NULL, NULL, NULL, g_free);
+        conn_data_set(conn, state, "easydbus-object-managers", managers,
+                      (GDestroyNotify) g_hash_table_unref);
+    }
+
+    return managers;
+}
+
+static gboolean path_is_below(const gchar *object_path, const gchar *manager_path)
+{
+    gsize len = strlen(manager_path);
+
+    if (len == 1)
+        return object_path[1] != '\0';
+
+    return !strncmp(object_path, manager_path, len) && object_path[len] == '/';
+}
+
+/*
+ * Returns path of the closest object manager above object_path, or NULL.
+ */
+static const gchar *find_object_manager(GDBusConnection *conn, struct easydbus_state *state,
+                                        const gchar *object_path)
+{
+    GHashTable *managers = conn_data_get(conn, state, "easydbus-object-managers");
+    const gchar *found = NULL;
+    GHashTableIter iter;
+    gpointer manager_path;
+
+    if (!managers)
+        return NULL;
+
+    g_hash_table_iter_init(&iter, managers);
+    while (g_hash_table_iter_next(&iter, NULL, &manager_path)) {
+        if (path_is_below(object_path, manager_path) &&
+            (!found || strlen(manager_path) > strlen(found)))
+            found = manager_path;
+    }
+
+    return found;
+}
+
+/*
+ * Returns a{sv} with values of all readable properties.
+ */
+static GVariant *registration_properties(struct registration *reg)
+{
+    GDBusPropertyInfo **property_info;
+    GVariantBuilder builder;
+    GVariant *value;
+    GError *error = NULL;
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a{sv}"));
+
+    for (property_info = reg->interface_info->properties; *property_info; property_info++) {
+        if (!((*property_info)->flags & G_DBUS_PROPERTY_INFO_FLAGS_READABLE))
+            continue;
+
+        if (property_pcall(reg, property_value, (*property_info)->name, NULL,
+                           (gpointer *) &value, &error)) {
+            g_variant_builder_add(&builder, "{sv}", (*property_info)->name, value);
+            g_variant_unref(value);
+        } else {
+            g_warning("property %s error: %s", (*property_info)->name, error->message);
+            g_clear_error(&error);
+        }
+    }
+
+    return g_variant_builder_end(&builder);
+}
+
+static void emit_interfaces_added(struct registration *reg)
+{
+    const gchar *manager_path = find_object_manager(reg->conn, reg->state, reg->object_path);
+    GVariantBuilder builder;
+    GError *error = NULL;
+
+    if (!manager_path)
+        return;
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a{sa{sv}}"));
+    g_variant_builder_add(&builder, "{s@a{sv}}", reg->interface_info->name,
+                          registration_properties(reg));
+
+    g_dbus_connection_emit_signal(reg->conn,
+                                  NULL,
+                                  manager_path,
+                                  "org.freedesktop.DBus.ObjectManager",
+                                  "InterfacesAdded",
+                                  g_variant_new("(oa{sa{sv}})", reg->object_path, &builder),
+                                  &error);
+    if (error) {
+        g_warning("InterfacesAdded error: %s", error->message);
+        g_error_free(error);
+    }
+}
+
+static void emit_interfaces_removed(struct registration *reg)
+{
+    const gchar *manager_path = find_object_manager(reg->conn, reg->state, reg->object_path);
+    const gchar *interfaces[] = {reg->interface_info->name, NULL};
+    GError *error = NULL;
+
+    if (!manager_path)
+        return;
+
+    g_dbus_connection_emit_signal(reg->conn,
+                                  NULL,
+                                  manager_path,
+                                  "org.freedesktop.DBus.ObjectManager",
+                                  "InterfacesRemoved",
+                                  g_variant_new("(o^as)", reg->object_path, interfaces),
+                                  &error);
+    if (error) {
+        g_warning("InterfacesRemoved error: %s", error->message);
+        g_error_free(error);
+    }
+}
+
+static void object_manager_method_call(GDBusConnection *connection,
+                                       const gchar *sender,
+                                       const gchar *object_path,
+                                       const gchar *interface_name,
+                                       const gchar *method_name,
+                                       GVariant *parameters,
+                                       GDBusMethodInvocation *invocation,
+                                       gpointer user_data)
+{
+    struct easydbus_state *state = user_data;
+    GHashTable *registrations = get_registrations(connection, state);
+    GHashTable *objects = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+                                                (GDestroyNotify) g_variant_builder_unref);
+    GVariantBuilder *interfaces;
+    GVariantBuilder builder;
+    GHashTableIter iter;
+    gpointer key, value;
+    struct registration *reg;
+    const gchar *manager_path;
+
+    g_debug("%s: sender=%s object_path=%s", __FUNCTION__, sender, object_path);
+
+    /* Group interfaces by path, objects of nested managers are skipped */
+    g_hash_table_iter_init(&iter, registrations);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        reg = value;
+        manager_path = find_object_manager(connection, state, reg->object_path);
+        if (!manager_path || strcmp(manager_path, object_path))
+            continue;
+
+        interfaces = g_hash_table_lookup(objects, reg->object_path);
+        if (!interfaces) {
+            interfaces = g_variant_builder_new(G_VARIANT_TYPE("a{sa{sv}}"));
+            g_hash_table_insert(objects, reg->object_path, interfaces);
+        }
+
+        g_variant_builder_add(interfaces, "{s@a{sv}}", reg->interface_info->name,
+                              registration_properties(reg));
+    }
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a{oa{sa{sv}}}"));
+
+    g_hash_table_iter_init(&iter, objects);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+        g_variant_builder_add(&builder, "{oa{sa{sv}}}", key, value);
+
+    g_hash_table_unref(objects);
+
+    g_dbus_method_invocation_return_value(invocation,
+                                          g_variant_new("(a{oa{sa{sv}}})", &builder));
+}
+
+static const GDBusInterfaceVTable object_manager_vtable = {
+    object_manager_method_call,
+    NULL,
+    NULL,
+    {0}
+};
+
+/*
+ * Args:
+ * 1) conn
+ * 2) object_path
+ *
+ * Objects registered below object_path are reported by GetManagedObjects and
+ * InterfacesAdded/InterfacesRemoved signals.
+ */
+static int bus_register_object_manager(lua_State *L)
+{
+    /* States of other threads may register object managers at the same time */
+    static GDBusNodeInfo *node_info;
+    struct easydbus_state *state = lua_touserdata(L, lua_upvalueindex(1));
+    GDBusConnection *conn = get_conn(L, 1);
+    const char *object_path = luaL_checkstring(L, 2);
+    GError *error = NULL;
+    GDBusNodeInfo *info;
+    guint reg_id;
+
+    g_debug("%s: object_path=%s", __FUNCTION__, object_path);
+
+    luaL_argcheck(L, g_variant_is_object_path(object_path), 2, "Invalid object path");
+
+    if (g_once_init_enter(&node_info)) {
+        info = g_dbus_node_info_new_for_xml(object_manager_xml, &error);
+        g_assert_no_error(error);
+        g_once_init_leave(&node_info, info);
+    }
+
+    reg_id = g_dbus_connection_register_object(conn,
+                                               object_path,
+                                               node_info->interfaces[0],
+                                               &object_manager_vtable,
+                                               state, /* user_data */
+                                               NULL,
+                                               &error);
+    if (!reg_id) {
+        lua_pushnil(L);
+        lua_pushstring(L, error->message);
+        g_error_free(error);
+        return 2;
+    }
+
+    g_hash_table_insert(get_object_managers(conn, state), GUINT_TO_POINTER(reg_id),
+                        g_strdup(object_path));
+
+    lua_pushinteger(L, reg_id);
+    return 1;
+}
+
+/*
+ * Args:
+ * 1) conn
+ * 2) object_path
+ * 3) interface_name
+ * 4) methods table
+ * 5) properties table (optional)
+ */
+static int bus_register_object(lua_State *L)
+{
+    struct easydbus_state *state = lua_touserdata(L, lua_upvalueindex(1));
+    GDBusConnection *conn = get_conn(L, 1);
+    const char *object_path = luaL_checkstring(L, 2);
+    const char *interface_name = luaL_checkstring(L, 3);
+    GDBusInterfaceInfo *interface_info;
+    GError *error = NULL;
+    guint reg_id;
+    struct registration *reg;
+
+    g_debug("%s", __FUNCTION__);
+    g_debug("object_path=%s interface_name=%s", object_path, interface_name);
+
+    luaL_argcheck(L, lua_istable(L, 4), 4, "Is not a table");
+    if (lua_isnoneornil(L, 5)) {
+        lua_settop(L, 4);
+        lua_newtable(L);
+    }
+    luaL_argcheck(L, lua_istable(L, 5), 5, "Is not a table");
+
+    interface_info = format_interface_info(L, 4, 5, interface_name);
+
+    /* Prepare method and property lookup tables */
+    lua_settop(L, 5);
+
+    reg = g_new0(struct registration, 1);
+    reg->props_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    reg->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    reg->state = state;
+    reg->conn = conn;
+    reg->interface_info = interface_info;
+    reg->object_path = g_strdup(object_path);
+    reg->changed = g_hash_table_new(NULL, NULL);
+
+    reg_id = g_dbus_connection_register_object(conn,
+                                               object_path,
+                                               interface_info,
+                                               &interface_vtable,
+                                               reg, /* user_data */
+                                               registration_free,
+                                               &error);
+
+    if (!reg_id) {
+        registration_free(reg);
+        lua_pushnil(L);
+        lua_pushstring(L, error->message);
+        g_error_free(error);
+        return 2;
+    }
+
+    g_hash_table_insert(get_registrations(conn, state), GUINT_TO_POINTER(reg_id), reg);
+
+    emit_interfaces_added(reg);
+
+    lua_pushinteger(L, reg_id);
+    return 1;
+}
+
+/*
+ * Args:
+ * 1) conn
+ * 2) object path
+ * 3) interface name
+ * 4) methods table
+ * 5) handler module name
+ * 6) number of workers (optional)
+ *
+ * Methods are handled by worker Lua states, each of them loads module which
+ * returns object. Methods table is used only for introspection.
+ */
+static int bus_register_pool(lua_State *L)
+{
+    GDBusConnection *conn = get_conn(L, 1);
+    const char *object_path = luaL_checkstring(L, 2);
+    const char *interface_name = luaL_checkstring(L, 3);
+    GDBusInterfaceInfo *interface_info;
+    struct pool_options opts;
+    GError *error = NULL;
+    guint reg_id;
+    int n_workers;
+
+    luaL_argcheck(L, lua_istable(L, 4), 4, "Is not a table");
+    opts.module = luaL_checkstring(L, 5);
+    n_workers = luaL_optinteger(L, 6, g_get_num_processors());
+    luaL_argcheck(L, n_workers > 0 &&
+                  n_workers <= (int) g_get_num_processors() * POOL_WORKERS_PER_CPU,
+                  6, "Invalid number of workers");
+    opts.n_workers = n_workers;
+
+    lua_settop(L, 6);
+
+    /* Workers search modules in the same paths */
+    lua_getglobal(L, "package");
+    lua_getfield(L, 7, "path");
+    lua_getfield(L, 7, "cpath");
+    opts.lua_path = lua_tostring(L, 8);
+    opts.lua_cpath = lua_tostring(L, 9);
+
+    interface_info = format_interface_info(L, 4, 0, interface_name);
+
+    reg_id = pool_register(conn, object_path, interface_info, &opts, &error);
+    g_dbus_interface_info_unref(interface_info);
+
+    if (!reg_id) {
+        lua_pushnil(L);
+        lua_pushstring(L, error->message);
+        g_error_free(error);
+        return 2;
+    }
+
+    lua_pushinteger(L, reg_id);
+    return 1;
+}
+
+static int bus_unregister_object(lua_State *L)
+{
+    struct easydbus_state *state = lua_touserdata(L, lua_upvalueindex(1));
+    GDBusConnection *conn = get_conn(L, 1);
+    guint reg_id = luaL_checkinteger(L, 2);
+    GHashTable *registrations = get_registrations(conn, state);
+    struct registration *reg;
+    gboolean ret;
+
+    /* Registration is freed later, so stop pending signal now */
+    reg = g_hash_table_lookup(registrations, GUINT_TO_POINTER(reg_id));
+    if (reg && reg->changed_id) {
+        state_source_remove(reg->state, reg->changed_id);
+        reg->changed_id = 0;
+    }
+
+    ret = g_dbus_connection_unregister_object(conn, reg_id);
+    if (ret && reg) {
+        g_hash_table_remove(registrations, GUINT_TO_POINTER(reg_id));
+        emit_interfaces_removed(reg);
+    }
+    if (ret)
+        g_hash_table_remove(get_object_managers(conn, state), GUINT_TO_POINTER(reg_id));
+
+    lua_pushboolean(L, ret ? 1 : 0);
+    return 1;
+}
+
+/*
+ * Args:
+ * 1) conn
+ * 2) registration id
+ * 3) property name
+ */
+static int bus_property_changed(lua_State *L)
+{
+    struct easydbus_state *state = lua_touserdata(L, lua_upvalueindex(1));
+    GDBusConnection *conn = get_conn(L, 1);
+    guint reg_id = luaL_checkinteger(L, 2);
+    const char *property_name = luaL_checkstring(L, 3);
+    struct registration *reg;
+
+    reg = g_hash_table_lookup(get_registrations(conn, state), GUINT_TO_POINTER(reg_id));
+    luaL_argcheck(L, reg, 2, "No such registration");
+    luaL_argcheck(L, g_dbus_interface_info_lookup_property(reg->interface_info, property_name),
+                  3, "No such property");
+
+    property_changed(reg, property_name);
+
+    return 0;
+}
+
+/*
+ * Subtree of objects, served by single Lua lookup function.
+ */
+struct subtree {
+    struct easydbus_state *state;
+    int lookup_ref;
+    int enumerate_ref;
+    gchar *object_path;
+    GHashTable *infos; /* node -> (interface name -> GDBusInterfaceInfo) */
+};
+
+static void subtree_free(gpointer user_data)
+{
+    struct subtree *subtree = user_data;
+    struct easydbus_state *state = subtree->state;
+
+    g_debug("%s: %p", __FUNCTION__, user_data);
+
+    luaL_unref(state->L, LUA_REGISTRYINDEX, subtree->lookup_ref);
+    luaL_unref(state->L, LUA_REGISTRYINDEX, subtree->enumerate_ref);
+
+    g_hash_table_unref(subtree->infos);
+    g_free(subtree->object_path);
+    g_free(subtree);
+}
+
+/*
+ * Returns node name relative to subtree, NULL for subtree root.
+ */
+static const gchar *subtree_node(struct subtree *subtree, const gchar *object_path)
+{
+    gsize len = strlen(subtree->object_path);
+
+    if (!strcmp(object_path, subtree->object_path))
+        return NULL;
+
+    return object_path + (len == 1 ? 1 : len + 1);
+}
+
+/*
+ * Pushes result of lookup(node), which is table of objects by interface name.
+ * Returns FALSE on error, with error message pushed instead.
+ */
+static gboolean subtree_lookup(struct subtree *subtree, lua_State *T, const gchar *node)
+{
+    lua_rawgeti(T, LUA_REGISTRYINDEX, subtree->lookup_ref);
+    lua_pushstring(T, node);
+
+    return !lua_pcall(T, 1, 1, 0);
+}
+
+static gchar **subtree_enumerate(GDBusConnection *connection,
+                                 const gchar *sender,
+                                 const gchar *object_path,
+                                 gpointer user_data)
+{
+    struct subtree *subtree = user_data;
+    struct easydbus_state *state = subtree->state;
+    GPtrArray *nodes = g_ptr_array_new();
+    lua_State *T;
+    int i, n;
+
+    g_debug("%s: object_path=%s", __FUNCTION__, object_path);
+
+    if (subtree->enumerate_ref != LUA_NOREF) {
+        T = lua_newthread(state->L);
+
+        lua_rawgeti(T, LUA_REGISTRYINDEX, subtree->enumerate_ref);
+        if (lua_pcall(T, 0, 1, 0)) {
+            g_warning("subtree enumerate error: %s", lua_tostring(T, -1));
+        } else if (lua_istable(T, 1)) {
+            n = lua_rawlen(T, 1);
+            for (i = 1; i <= n; i++) {
+                lua_rawgeti(T, 1, i);
+                if (lua_type(T, -1) == LUA_TSTRING)
+                    g_ptr_array_add(nodes, g_strdup(lua_tostring(T, -1)));
+                lua_pop(T, 1);
+            }
+        }
+
+        lua_pop(state->L, 1);
+    }
+
+    g_ptr_array_add(nodes, NULL);
+    return (gchar **) g_ptr_array_free(nodes, FALSE);
+}
+
+static GHashTable *interface_infos_new(void)
+{
+    return g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                 (GDestroyNotify) g_dbus_interface_info_unref);
+}
+
+/*
+ * Args:
+ * 1) lightuserdata with subtree
+ * 2) node
+ * 3) lightuserdata with interface infos table
+ *
+ * Adds interface info of each object returned by lookup(node). Info cached
+ * for the same node and interface is reused.
+ */
+static int subtree_interfaces(lua_State *L)
+{
+    struct subtree *subtree = lua_touserdata(L, 1);
+    GHashTable *cached = g_hash_table_lookup(subtree->infos, luaL_optstring(L, 2, ""));
+    GHashTable *infos = lua_touserdata(L, 3);
+    GDBusInterfaceInfo *info;
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, subtree->lookup_ref);
+    lua_pushvalue(L, 2);
+    lua_call(L, 1, 1);
+    lua_replace(L, 1);
+    lua_settop(L, 1);
+
+    if (!lua_istable(L, 1))
+        return 0;
+
+    lua_pushnil(L);
+    while (lua_next(L, 1) != 0) {
+        luaL_argcheck(L, lua_type(L, 2) == LUA_TSTRING, 2, "Interface name is not a string");
+        if (!lua_istable(L, 3)) {
+            lua_pop(L, 1);
+            continue;
+        }
+        info = cached ? g_hash_table_lookup(cached, lua_tostring(L, 2)) : NULL;
+        if (info) {
+            g_hash_table_insert(infos, g_strdup(info->name), g_dbus_interface_info_ref(info));
+            lua_pop(L, 1);
+            continue;
+        }
+        lua_getfield(L, 3, "methods");
+        lua_getfield(L, 3, "properties");
+        if (lua_istable(L, 4)) {
+            info = format_interface_info(L, 4, lua_istable(L, 5) ? 5 : 0, lua_tostring(L, 2));
+            g_hash_table_insert(infos, g_strdup(info->name), info);
+        }
+        lua_pop(L, 3);
+    }
+
+    return 0;
+}
+
+static GDBusInterfaceInfo **subtree_introspect(GDBusConnection *connection,
+                                               const gchar *sender,
+                                               const gchar *object_path,
+                                               const gchar *node,
+                                               gpointer user_data)
+{
+    struct subtree *subtree = user_data;
+    struct easydbus_state *state = subtree->state;
+    GPtrArray *interfaces;
+    GHashTable *infos = interface_infos_new();
+    GHashTableIter iter;
+    gpointer info;
+    lua_State *T = thread_acquire(state);
+
+    g_debug("%s: object_path=%s node=%s", __FUNCTION__, object_path, node);
+
+    lua_pushcfunction(T, subtree_interfaces);
+    lua_pushlightuserdata(T, subtree);
+    lua_pushstring(T, node);
+    lua_pushlightuserdata(T, infos);
+    if (lua_pcall(T, 3, 0, 0)) {
+        g_warning("subtree introspect error: %s", lua_tostring(T, -1));
+        g_hash_table_remove_all(infos);
+    }
+
+    thread_release(state, T);
+
+    /* Cache holds only objects which still exist, replaced on each lookup */
+    if (g_hash_table_size(infos))
+        g_hash_table_replace(subtree->infos, g_strdup(node ? node : ""), g_hash_table_ref(infos));
+    else
+        g_hash_table_remove(subtree->infos, node ? node : "");
+
+    /* No object at this node */
+    if (!g_hash_table_size(infos)) {
+        g_hash_table_unref(infos);
+        return NULL;
+    }
+
+    interfaces = g_ptr_array_new();
+    g_hash_table_iter_init(&iter, infos);
+    while (g_hash_table_iter_next(&iter, NULL, &info))
+        g_ptr_array_add(interfaces, g_dbus_interface_info_ref(info));
+    g_hash_table_unref(infos);
+
+    /* Interfaces are owned by caller now */
+    g_ptr_array_add(interfaces, NULL);
+    return (GDBusInterfaceInfo **) g_ptr_array_free(interfaces, FALSE);
+}
+
+static void subtree_method_call(GDBusConnection *connection,
+                                const gchar *sender,
+                                const gchar *object_path,
+                                const gchar *interface_name,
+                                const gchar *method_name,
+                                GVariant *parameters,
+                                GDBusMethodInvocation *invocation,
+                                gpointer user_data)
+{
+    struct subtree *subtree = user_data;
+    struct easydbus_state *state = subtree->state;
+    lua_State *T = thread_acquire(state);
+
+    g_debug("%s: sender=%s object_path=%s interface_name=%s method_name=%s",
+            __FUNCTION__, sender, object_path, interface_name, method_name);
+
+    if (!subtree_lookup(subtree, T, subtree_node(subtree, object_path))) {
+        g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                                              "%s", lua_tostring(T, -1));
+    } else {
+        /* Leave only methods table on stack */
+        if (lua_istable(T, 1))
+            lua_getfield(T, 1, interface_name);
+        if (lua_istable(T, -1))
+            lua_getfield(T, -1, "methods");
+        lua_replace(T, 1);
+        lua_settop(T, 1);
+
+        if (lua_istable(T, 1))
+            invoke_method(state, T, method_name, parameters, invocation);
+        else
+            g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR,
+                                                  G_DBUS_ERROR_UNKNOWN_OBJECT,
+                                                  "No such object: %s", object_path);
+    }
+
+    thread_release(state, T);
+}
+
+/*
+ * Args:
+ * 1) property function
+ * 2) subtree
+ * 3) node
+ * 4) interface name
+ * 5) property name
+ * 6) lightuserdata
+ *
+ * Looks up properties table of subtree object and calls property function.
+ */
+static int subtree_property(lua_State *L)
+{
+    struct subtree *subtree = lua_touserdata(L, 2);
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, subtree->lookup_ref);
+    lua_pushvalue(L, 3);
+    lua_call(L, 1, 1);
+    if (lua_istable(L, -1))
+        lua_getfield(L, -1, lua_tostring(L, 4));
+    if (lua_istable(L, -1))
+        lua_getfield(L, -1, "properties");
+    if (!lua_istable(L, -1))
+        return luaL_error(L, "No %s in properties lookup", lua_tostring(L, 5));
+
+    lua_pushvalue(L, 1);
+    lua_insert(L, -2);
+    lua_pushvalue(L, 5);
+    lua_pushvalue(L, 6);
+    lua_call(L, 3, 1);
+
+    return 1;
+}
+
+static gboolean subtree_property_pcall(struct subtree *subtree, lua_CFunction func,
+                                       const gchar *object_path, const gchar *interface_name,
+                                       const gchar *property_name, gpointer ptr,
+                                       gpointer *result, GError **error)
+{
+    lua_State *T = thread_acquire(subtree->state);
+    gboolean ret;
+
+    lua_pushcfunction(T, subtree_property);
+    lua_pushlightuserdata(T, subtree->state);
+    lua_pushcclosure(T, func, 1);
+    lua_pushlightuserdata(T, subtree);
+    lua_pushstring(T, subtree_node(subtree, object_path));
+    lua_pushstring(T, interface_name);
+    lua_pushstring(T, property_name);
+    lua_pushlightuserdata(T, ptr);
+
+    ret = pcall_gerror(T, 6, result, error);
+
+    thread_release(subtree->state, T);
+
+    return ret;
+}
+
+static GVariant *subtree_get_property(GDBusConnection *connection,
+                                      const gchar *sender,
+                                      const gchar *object_path,
+                                      const gchar *interface_name,
+                                      const gchar *property_name,
+                                      GError **error,
+                                      gpointer user_data)
+{
+    GVariant *value = NULL;
+
+    g_debug("%s: sender=%s object_path=%s interface_name=%s property_name=%s",
+            __FUNCTION__, sender, object_path, interface_name, property_name);
+
+    subtree_property_pcall(user_data, property_value, object_path, interface_name,
+                           property_name, NULL, (gpointer *) &value, error);
+
+    return value;
+}
+
+static gboolean subtree_set_property(GDBusConnection *connection,
+                                     const gchar *sender,
+                                     const gchar *object_path,
+                                     const gchar *interface_name,
+                                     const gchar *property_name,
+                                     GVariant *value,
+                                     GError **error,
+                                     gpointer user_data)
+{
+    g_debug("%s: sender=%s object_path=%s interface_name=%s property_name=%s",
+            __FUNCTION__, sender, object_path, interface_name, property_name);
+
+    return subtree_property_pcall(user_data, property_store, object_path, interface_name,
+                                  property_name, value, NULL, error);
+}
+
+static const GDBusInterfaceVTable subtree_interface_vtable = {
+    subtree_method_call,
+    subtree_get_property,
+    subtree_set_property,
+    {0}
+};
+
+static const GDBusInterfaceVTable *subtree_dispatch(GDBusConnection *connection,
+                                                    const gchar *sender,
+                                                    const gchar *object_path,
+                                                    const gchar *interface_name,
+                                                    const gchar *node,
+                                                    gpointer *out_user_data,
+                                                    gpointer user_data)
+{
+    *out_user_data = user_data;
+    return &subtree_interface_vtable;
+}
+
+static const GDBusSubtreeVTable subtree_vtable = {
+    subtree_enumerate,
+    subtree_introspect,
+    subtree_dispatch,
+    {0}
+};
+
+/*
+ * Args:
+ * 1) conn
+ * 2) object_path
+ * 3) lookup function, returns objects of node by interface name
+ * 4) enumerate function (optional), returns names of child nodes
+ *
+ * Objects are looked up on demand, so registration does not depend on number
+ * of nodes. Nodes which are not enumerated are dispatched as well.
+ */
+static int bus_register_subtree(lua_State *L)
+{
+    struct easydbus_state *state = lua_touserdata(L, lua_upvalueindex(1));
+    GDBusConnection *conn = get_conn(L, 1);
+    const char *object_path = luaL_checkstring(L, 2);
+    struct subtree *subtree;
+    GError *error = NULL;
+    guint reg_id;
+
+    g_debug("%s: object_path=%s", __FUNCTION__, object_path);
+
+    luaL_argcheck(L, g_variant_is_object_path(object_path), 2, "Invalid object path");
+    luaL_checktype(L, 3, LUA_TFUNCTION);
+    if (!lua_isnoneornil(L, 4))
+        luaL_checktype(L, 4, LUA_TFUNCTION);
+
+    lua_settop(L, 4);
+
+    subtree = g_new0(struct subtree, 1);
+    subtree->state = state;
+    subtree->enumerate_ref = lua_isnil(L, 4) ? LUA_NOREF : luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_settop(L, 3);
+    subtree->lookup_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    subtree->object_path = g_strdup(object_path);
+    subtree->infos = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                           (GDestroyNotify) g_hash_table_unref);
+
+    reg_id = g_dbus_connection_register_subtree(conn,
+                                                object_path,
+                                                &subtree_vtable,
+                                                G_DBUS_SUBTREE_FLAGS_DISPATCH_TO_UNENUMERATED_NODES,
+                                                subtree, /* user_data */
+                                                subtree_free,
+                                                &error);
+    if (!reg_id) {
+        subtree_free(subtree);
+        lua_pushnil(L);
+        lua_pushstring(L, error->message);
+        g_error_free(error);
+        return 2;
+    }
+
+    lua_pushinteger(L, reg_id);
+    return 1;
+}
+
+static int bus_unregister_subtree(lua_State *L)
+{
+    GDBusConnection *conn = get_conn(L, 1);
+    guint reg_id = luaL_checkinteger(L, 2);
+
+    lua_pushboolean(L, g_dbus_connection_unregister_subtree(conn, reg_id) ? 1 : 0);
+    return 1;
+}
+
+struct own_name_ud {
+    struct easydbus_state *state;
+    lua_State *L;
+    gboolean handled;
+    GMainLoop *loop;
+    gboolean success;
+    guint owner_id;
+};
+
+static void own_name_ud_free(gpointer user_data)
+{
+    struct own_name_ud *own_name_ud = user_data;
+    struct easydbus_state *state = own_name_ud->state;
+    lua_State *L = own_name_ud->L;
+
+    lua_pushlightuserdata(state->L, L);
+    lua_pushnil(state->L);
+    lua_rawset(state->L, LUA_REGISTRYINDEX);
+
+    g_free(user_data);
+}
+
+static void name_acquired(GDBusConnection *conn,
+                          const gchar *name,
+                          gpointer user_data)
+{
+    struct own_name_ud *own_name_ud = user_data;
+    lua_State *L = own_name_ud->L;
+
+    g_debug("Acquired name: %s, handled=%d", name, (int) own_name_ud->handled);
+
+    if (own_name_ud->handled)
+        return;
+
+    own_name_ud->handled = TRUE;
+
+    if (own_name_ud->loop) {
+        own_name_ud->success = TRUE;
+        g_main_loop_quit(own_name_ud->loop);
+        return;
+    }
+
+    lua_pushvalue(L, -2);
+    lua_pushvalue(L, -2);
+
+    lua_pushinteger(L, own_name_ud->owner_id);
+    ed_resume(L, 2);
+
+    g_debug("after acquired callback");
+}
+
+static void name_lost(GDBusConnection *conn,
+                      const gchar *name,
+                      gpointer user_data)
+{
+    struct own_name_ud *own_name_ud = user_data;
+    lua_State *L = own_name_ud->L;
+
+    g_debug("Lost name: %s, handled=%d", name, (int) own_name_ud->handled);
+
+    if (own_name_ud->handled)
+        return;
+
+    own_name_ud->handled = TRUE;
+
+    if (own_name_ud->loop) {
+        g_main_loop_quit(own_name_ud->loop);
+        return;
+    }
+
+    lua_pushvalue(L, -2);
+    lua_pushvalue(L, -2);
+
+    lua_pushboolean(L, 0);
+    ed_resume(L, 2);
+
+    g_debug("after lost callback");
+}
+
+static int bus_own_name(lua_State *L)
+{
+    struct easydbus_state *state = lua_touserdata(L, lua_upvalueindex(1));
+    GDBusConnection *conn = get_conn(L, 1);
+    const char *name = luaL_checkstring(L, 2);
+    lua_State *T;
+    int i, n_args = lua_gettop(L);
+    struct own_name_ud *own_name_ud;
+
+    g_debug("%s", __FUNCTION__);
+
+    own_name_ud = g_new0(struct own_name_ud, 1);
+    own_name_ud->state = state;
+    own_name_ud->L = T = lua_newthread(L);
+
+    if (!in_mainloop(state)) {
+        own_name_ud->owner_id =
+            g_bus_own_name_on_connection(conn,
+                                         name,
+                                         G_BUS_NAME_OWNER_FLAGS_NONE,
+                                         name_acquired,
+                                         name_lost,
+                                         own_name_ud,
+                                         own_name_ud_free);
+
+        own_name_ud->loop = g_main_loop_new(state->context, FALSE);
+        g_main_loop_run(own_name_ud->loop);
+        g_main_loop_unref(own_name_ud->loop);
+        own_name_ud->loop = NULL;
+
+        if (own_name_ud->success)
+            lua_pushinteger(L, own_name_ud->owner_id);
+        else
+            lua_pushboolean(L, 0);
+        return 1;
+    }
+
+    for (i = 1; i <= n_args; i++) {
+        lua_pushvalue(L, i);
+    }
+    lua_xmove(L, T, n_args);
+
+    lua_pushlightuserdata(L, T);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+    lua_pop(L, 1);
+
+    own_name_ud->owner_id =
+        g_bus_own_name_on_connection(conn,
+                                     name,
+                                     G_BUS_NAME_OWNER_FLAGS_NONE,
+                                     name_acquired,
+                                     name_lost,
+                                     own_name_ud,
+                                     own_name_ud_free);
+
+    return 0;
+}
+
+static int bus_unown_name(lua_State *L)
+{
+    guint owner_id = luaL_checkinteger(L, 2);
+
+    g_bus_unown_name(owner_id);
 
-    g_free(user_data);
+    return 0;
 }
 
-static void interface_method_call(GDBusConnection *connection,
-                                  const gchar *sender,
-                                  const gchar *object_path,
-                                  const gchar *interface_name,
-                                  const gchar *method_name,
-                                  GVariant *parameters,
-                                  GDBusMethodInvocation *invocation,
-                                  gpointer user_data)
+static int bus_emit(lua_State *L)
 {
-    struct object_ud *obj_ud = user_data;
-    struct easydbus_state *state = obj_ud->state;
-    int ref = obj_ud->ref;
-    lua_State *T;
-    int ret;
-    int n_args;
-    int n_params;
-    int i;
-    GDBusMessage *message;
-    GUnixFDList *fd_list;
+    GDBusConnection *conn = get_conn(L, 1);
+    const char *listener = lua_tostring(L, 2);
+    const char *object_path = luaL_checkstring(L, 3);
+    const char *interface_name = luaL_checkstring(L, 4);
+    const char *signal_name = luaL_checkstring(L, 5);
+    const struct signature *sig = signature_check(L, 6);
+    GVariant *params;
+    GError *error = NULL;
 
-    g_debug("%s: sender=%s object_path=%s interface_name=%s method_name=%s",
-            __FUNCTION__, sender, object_path, interface_name, method_name);
+    g_debug("%s: listener=%s object_path=%s interface_name=%s signal_name=%s sig=%s",
+            __FUNCTION__, listener, object_path, interface_name, signal_name, sig ? sig->sig : NULL);
 
-    T = lua_newthread(state->L);
+    if (listener)
+        luaL_argcheck(L, g_dbus_is_name(listener), 2, "Invalid listener name");
+    luaL_argcheck(L, g_variant_is_object_path(object_path), 3, "Invalid object path");
+    luaL_argcheck(L, g_dbus_is_interface_name(interface_name), 4, "Invalid interface name");
 
-    /* push callback with args */
-    lua_rawgeti(T, LUA_REGISTRYINDEX, ref);
-    lua_pushstring(T, method_name);
-    lua_rawget(T, 1);
-    if (!lua_istable(T, 2))
-        luaL_error(T, "No %s in methods lookup", method_name);
+    params = range_to_tuple(L, 7, lua_gettop(L) + 1, sig, NULL);
 
-    n_args = lua_rawlen(T, 2);
-    for (i = 3; i <= n_args; i++) {
-        lua_rawgeti(T, 2, i);
-        if (lua_type(T, -1) == LUA_TSTRING)
-            g_debug("arg %d: %s", i, lua_tostring(T, -1));
-        else
-            g_debug("arg %d: %s", i, lua_typename(T, lua_type(T, -1)));
-    }
+    g_dbus_connection_emit_signal(conn,
+                                  listener,
+                                  object_path,
+                                  interface_name,
+                                  signal_name,
+                                  params,
+                                  &error);
 
-    /* push params */
-    message = g_dbus_method_invocation_get_message(invocation);
-    fd_list = g_dbus_message_get_unix_fd_list(message);
-    n_params = push_tuple(T, parameters, fd_list);
-    lua_pushcclosure(T, interface_method_return, 0);
-    lua_createtable(T, 2, 0);
-    lua_pushlightuserdata(T, invocation);
-    lua_rawseti(T, -2, 1);
-    lua_rawgeti(T, 2, 2); /* out_sig */
-    lua_rawseti(T, -2, 2);
-    ret = ed_resume(T, n_args + n_params - 1);
-
-    if (ret) {
-        if (ret == LUA_YIELD)
-            g_warning("method handler yielded");
-        else
-            g_warning("method handler error: %s", lua_tostring(T, -1));
+    if (error != NULL) {
+        lua_pushnil(L);
+        lua_pushstring(L, error->message);
+        g_error_free(error);
+        return 2;
     }
 
-    lua_pop(state->L, 1);
+    lua_pushboolean(L, 1);
+    return 1;
 }
 
-static const GDBusInterfaceVTable interface_vtable = {
-    interface_method_call,
-    NULL,
-    NULL,
-    {0}
-};
-
-static int bus_register_object(lua_State *L)
+/*
+ * Args:
+ * 1) conn
+ * 2) table of signals, each as {listener, object_path, interface_name,
+ *    signal_name, signature, parameters...}, with false listener for
+ *    broadcast
+ * 3) options table (optional):
+ *    dedup - of signals with the same object path, interface and name only
+ *            the last one is emitted, in place of the first one
+ *
+ * All signals are marshalled before first one is sent, so invalid signal
+ * raises error with nothing emitted. Connection is flushed once.
+ */
+static int bus_emit_many(lua_State *L)
 {
-    struct easydbus_state *state = lua_touserdata(L, lua_upvalueindex(1));
     GDBusConnection *conn = get_conn(L, 1);
-    const char *object_path = luaL_checkstring(L, 2);
-    const char *interface_name = luaL_checkstring(L, 3);
-    GDBusInterfaceInfo *interface_info;
+    const char *listener, *object_path, *interface_name, *signal_name;
+    GPtrArray *messages;
+    gboolean dedup = FALSE;
+    GDBusMessage *message;
+    GVariant *params;
     GError *error = NULL;
-    guint reg_id;
-    struct object_ud *obj_ud;
+    guint i, n_signals, index;
+    int j, n, base;
 
-    g_debug("%s", __FUNCTION__);
-    g_debug("object_path=%s interface_name=%s", object_path, interface_name);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    n_signals = lua_rawlen(L, 2);
 
-    luaL_argcheck(L, lua_istable(L, 4), 4, "Is not a table");
+    g_debug("%s: conn=%p n_signals=%u", __FUNCTION__, (void *) conn, n_signals);
 
-    interface_info = format_interface_info(L, 4, interface_name);
+    if (lua_istable(L, 3)) {
+        lua_getfield(L, 3, "dedup");
+        dedup = lua_toboolean(L, -1);
+    }
+    lua_settop(L, 3);
 
-    /* Prepare method lookup table */
-    lua_settop(L, 4);
+    /* Index in messages by signal key, kept in Lua so nothing leaks on error */
+    lua_newtable(L);
+    messages = push_ptr_array(L, n_signals, g_object_unref);
+    base = lua_gettop(L);
+    for (i = 0; i < n_signals; i++) {
+        lua_rawgeti(L, 2, i + 1);
+        if (!lua_istable(L, -1))
+            luaL_error(L, "Signal %d is not a table", i + 1);
+        n = lua_rawlen(L, -1);
+        luaL_checkstack(L, n, "too many parameters");
+        for (j = 1; j <= n; j++)
+            lua_rawgeti(L, base + 1, j);
+
+        listener = lua_tostring(L, base + 2);
+        object_path = luaL_optstring(L, base + 3, "");
+        interface_name = luaL_optstring(L, base + 4, "");
+        signal_name = luaL_optstring(L, base + 5, "");
+
+        if (listener && !g_dbus_is_name(listener))
+            luaL_error(L, "Invalid listener name in signal %d", i + 1);
+        if (!g_variant_is_object_path(object_path))
+            luaL_error(L, "Invalid object path in signal %d", i + 1);
+        if (!g_dbus_is_interface_name(interface_name))
+            luaL_error(L, "Invalid interface name in signal %d", i + 1);
+        if (!g_dbus_is_member_name(signal_name))
+            luaL_error(L, "Invalid signal name in signal %d", i + 1);
+
+        params = range_to_tuple(L, base + 7, MAX(base + 7, base + 2 + n),
+                                signature_check(L, base + 6), NULL);
+
+        message = g_dbus_message_new_signal(object_path, interface_name, signal_name);
+        if (listener)
+            g_dbus_message_set_destination(message, listener);
+        g_dbus_message_set_body(message, params);
+
+        index = messages->len;
+        if (dedup) {
+            lua_pushfstring(L, "%s\n%s\n%s", object_path, interface_name, signal_name);
+            lua_pushvalue(L, -1);
+            lua_rawget(L, base - 1);
+            if (lua_isnil(L, -1)) {
+                lua_pop(L, 1);
+                lua_pushinteger(L, index);
+                lua_rawset(L, base - 1);
+            } else {
+                index = lua_tointeger(L, -1);
+            }
+        }
 
-    obj_ud = g_new(struct object_ud, 1);
-    obj_ud->ref = luaL_ref(L, LUA_REGISTRYINDEX);
-    obj_ud->state = state;
+        if (index == messages->len) {
+            g_ptr_array_add(messages, message);
+        } else {
+            g_object_unref(g_ptr_array_index(messages, index));
+            g_ptr_array_index(messages, index) = message;
+        }
 
-    reg_id = g_dbus_connection_register_object(conn,
-                                               object_path,
-                                               interface_info,
-                                               &interface_vtable,
-                                               obj_ud, /* user_data */
-                                               object_ud_free,
-                                               &error);
+        lua_settop(L, base);
+    }
 
-    g_dbus_interface_info_unref(interface_info);
+    for (i = 0; i < messages->len && !error; i++)
+        g_dbus_connection_send_message(conn, g_ptr_array_index(messages, i),
+                                       G_DBUS_SEND_MESSAGE_FLAGS_NONE, NULL, &error);
 
-    if (!reg_id) {
+    /* Messages are written by GDBus worker thread, push them out together */
+    g_dbus_connection_flush(conn, NULL, NULL, NULL);
+
+    /* Sent messages are not needed anymore */
+    g_ptr_array_set_size(messages, 0);
+
+    if (error != NULL) {
         lua_pushnil(L);
         lua_pushstring(L, error->message);
         g_error_free(error);
         return 2;
     }
 
-    lua_pushinteger(L, reg_id);
+    lua_pushboolean(L, 1);
     return 1;
 }
 
-static int bus_unregister_object(lua_State *L)
-{
-    GDBusConnection *conn = get_conn(L, 1);
-    guint reg_id = luaL_checkinteger(L, 2);
-    gboolean ret;
+/*
+ * Condition on string argument of signal, same as argN, argNpath and
+ * arg0namespace keys of match rule.
+ */
+struct match_arg {
+    guint index;
+    gboolean path;
+    gboolean namespace;
+    gchar *value;
+};
 
-    ret = g_dbus_connection_unregister_object(conn, reg_id);
+/*
+ * Single GDBus subscription shared by all handlers with the same match rule.
+ * When conditions can not be matched by GDBus itself, match rule is added by
+ * us and conditions are checked for every received signal, as other rules of
+ * connection may let more signals in.
+ */
+struct route {
+    struct easydbus_state *state;
+    GDBusConnection *conn;
+    guint id;
+    gchar *key;
+    gchar *rule;
+    gboolean add_match;
+    gchar *path_namespace;
+    GArray *args;
+    GQueue handlers;
+    gboolean coalesce;
+    gint coalesce_arg; /* -1 for object path, -2 for single key */
+    guint interval;
+    GHashTable *pending;
+    GQueue pending_keys;
+    guint flush_id;
+};
 
-    lua_pushboolean(L, ret ? 1 : 0);
-    return 1;
+/* Newest signal for coalescing key */
+struct pending_signal {
+    GVariant *parameters;
+};
+
+static void pending_signal_free(gpointer user_data)
+{
+    struct pending_signal *pending = user_data;
+
+    g_variant_unref(pending->parameters);
+    g_free(pending);
 }
 
-struct own_name_ud {
-    struct easydbus_state *state;
-    lua_State *L;
-    gboolean handled;
-    GMainLoop *loop;
-    gboolean success;
-    guint owner_id;
+struct handler {
+    struct route *route;
+    guint id;
+    int ref;
+    GList *link;
 };
 
-static void own_name_ud_free(gpointer user_data)
+/*
+ * Routes by match rule and handlers by id, of single state on connection.
+ * Handler ids are unique within state only.
+ */
+struct router {
+    GHashTable *routes;
+    GHashTable *handlers;
+    guint last_id;
+};
+
+static void router_free(gpointer user_data)
 {
-    struct own_name_ud *own_name_ud = user_data;
-    struct easydbus_state *state = own_name_ud->state;
-    lua_State *L = own_name_ud->L;
+    struct router *router = user_data;
 
-    lua_pushlightuserdata(state->L, L);
-    lua_pushnil(state->L);
-    lua_rawset(state->L, LUA_REGISTRYINDEX);
+    g_hash_table_unref(router->routes);
+    g_hash_table_unref(router->handlers);
+    g_free(router);
+}
+
+static struct router *get_router(GDBusConnection *conn, struct easydbus_state *state)
+{
+    struct router *router;
+
+    router = conn_data_get(conn, state, "easydbus-signal-router");
+    if (!router) {
+        router = g_new0(struct router, 1);
+        router->routes = g_hash_table_new(g_str_hash, g_str_equal);
+        router->handlers = g_hash_table_new_full(NULL, NULL, NULL, g_free);
+        conn_data_set(conn, state, "easydbus-signal-router", router, router_free);
+    }
+
+    return router;
+}
+
+static void match_rule_call(GDBusConnection *conn, const gchar *method_name, const gchar *rule)
+{
+    g_debug("%s: %s %s", __FUNCTION__, method_name, rule);
+
+    /* Peer connection has no bus daemon, signals are only filtered locally */
+    if (!g_dbus_connection_get_unique_name(conn))
+        return;
+
+    /* No reply is expected without callback, same as for rules of GDBus */
+    g_dbus_connection_call(conn,
+                           "org.freedesktop.DBus",
+                           "/org/freedesktop/DBus",
+                           "org.freedesktop.DBus",
+                           method_name,
+                           g_variant_new("(s)", rule),
+                           NULL, /* reply_type */
+                           G_DBUS_CALL_FLAGS_NONE,
+                           -1, /* timeout */
+                           NULL, /* cancellable */
+                           NULL, /* callback */
+                           NULL);
+}
+
+/*
+ * Called by GDBus once route is unsubscribed, or directly if route was not
+ * used at all. Handlers are already removed.
+ */
+static void route_free(gpointer user_data)
+{
+    struct route *route = user_data;
+    guint i;
+
+    g_debug("%s: %p", __FUNCTION__, user_data);
+
+    if (route->add_match)
+        match_rule_call(route->conn, "RemoveMatch", route->rule);
+
+    if (route->flush_id)
+        state_source_remove(route->state, route->flush_id);
+    if (route->pending) {
+        g_queue_clear(&route->pending_keys);
+        g_hash_table_unref(route->pending);
+    }
+
+    for (i = 0; i < route->args->len; i++)
+        g_free(g_array_index(route->args, struct match_arg, i).value);
+    g_array_free(route->args, TRUE);
+    g_free(route->path_namespace);
+    g_free(route->rule);
+    g_free(route->key);
 
     g_free(user_data);
 }
 
-static void name_acquired(GDBusConnection *conn,
-                          const gchar *name,
-                          gpointer user_data)
+/* Every argN and argNpath, and arg0namespace */
+#define MATCH_ARGS_MAX (64 * 2 + 1)
+
+/*
+ * Match options parsed from Lua, with strings owned by options table.
+ */
+struct match_options {
+    const gchar *path_namespace;
+    struct match_arg args[MATCH_ARGS_MAX];
+    guint n_args;
+    gboolean coalesce;
+    gint coalesce_arg;
+    guint interval;
+};
+
+/*
+ * Options table:
+ * path_namespace - object path or any path below it, instead of object path
+ * argN - string argument N (0..63) equal to value
+ * argNpath - string or object path argument N equal to value, or one of them
+ *            ending with '/' and being prefix of other
+ * arg0namespace - string argument 0 equal to value or starting with value
+ *                 followed by '.'
+ * coalesce - 'path', 'argN' or true, only newest signal for each object
+ *            path, value of argument N or at all is delivered
+ * interval - in milliseconds, coalesced signals are delivered at most once
+ *            per interval instead of once per main loop iteration
+ */
+static void check_coalesce_option(lua_State *L, int index, struct match_options *opts)
 {
-    struct own_name_ud *own_name_ud = user_data;
-    lua_State *L = own_name_ud->L;
+    const char *value;
+    char *end;
+    guint64 arg;
 
-    g_debug("Acquired name: %s, handled=%d", name, (int) own_name_ud->handled);
+    opts->coalesce = lua_toboolean(L, -1);
+    opts->coalesce_arg = -2;
 
-    if (own_name_ud->handled)
+    if (lua_type(L, -1) != LUA_TSTRING)
         return;
 
-    own_name_ud->handled = TRUE;
+    value = lua_tostring(L, -1);
+    if (!strcmp(value, "path")) {
+        opts->coalesce_arg = -1;
+    } else {
+        luaL_argcheck(L, !strncmp(value, "arg", 3) && g_ascii_isdigit(value[3]), index,
+                      "coalesce must be 'path' or 'argN'");
+        arg = g_ascii_strtoull(value + 3, &end, 10);
+        luaL_argcheck(L, *end == '\0' && arg < 64, index,
+                      "coalesce must be 'path' or 'argN'");
+        opts->coalesce_arg = arg;
+    }
+}
 
-    if (own_name_ud->loop) {
-        own_name_ud->success = TRUE;
-        g_main_loop_quit(own_name_ud->loop);
+/*
+ * Raises argument error for invalid options, before anything is allocated.
+ */
+static void check_match_options(lua_State *L, int index, struct match_options *opts)
+{
+    struct match_arg *arg;
+    const char *key, *value;
+    gboolean interval = FALSE;
+    guint64 n;
+    char *end;
+
+    memset(opts, 0, sizeof(*opts));
+    opts->coalesce_arg = -2;
+
+    if (!lua_istable(L, index))
         return;
-    }
 
-    lua_pushvalue(L, -2);
-    lua_pushvalue(L, -2);
+    lua_pushnil(L);
+    while (lua_next(L, index) != 0) {
+        luaL_argcheck(L, lua_type(L, -2) == LUA_TSTRING, index, "match option is not a string");
+        key = lua_tostring(L, -2);
+
+        if (!strcmp(key, "coalesce")) {
+            check_coalesce_option(L, index, opts);
+            lua_pop(L, 1);
+            continue;
+        } else if (!strcmp(key, "interval")) {
+            luaL_argcheck(L, lua_isnumber(L, -1) && lua_tointeger(L, -1) >= 0, index,
+                          "interval is not a number");
+            opts->interval = lua_tointeger(L, -1);
+            interval = TRUE;
+            lua_pop(L, 1);
+            continue;
+        }
 
-    lua_pushinteger(L, own_name_ud->owner_id);
-    ed_resume(L, 2);
+        luaL_argcheck(L, lua_type(L, -1) == LUA_TSTRING, index, "match value is not a string");
+        value = lua_tostring(L, -1);
+
+        if (!strcmp(key, "path_namespace")) {
+            luaL_argcheck(L, g_variant_is_object_path(value), index, "Invalid path_namespace");
+            opts->path_namespace = value;
+        } else if (!strncmp(key, "arg", 3) && g_ascii_isdigit(key[3])) {
+            luaL_argcheck(L, opts->n_args < MATCH_ARGS_MAX, index, "Too many match options");
+            arg = &opts->args[opts->n_args];
+            memset(arg, 0, sizeof(*arg));
+            n = g_ascii_strtoull(key + 3, &end, 10);
+            arg->index = MIN(n, 64);
+            if (!strcmp(end, "path"))
+                arg->path = TRUE;
+            else if (!strcmp(end, "namespace") && arg->index == 0)
+                arg->namespace = TRUE;
+            else
+                luaL_argcheck(L, *end == '\0', index, "Unknown match option");
+            luaL_argcheck(L, arg->index < 64, index, "Argument index out of range");
+
+            /* Value stays in options table, which is kept on stack */
+            arg->value = (gchar *) value;
+            opts->n_args++;
+        } else {
+            luaL_argerror(L, index, "Unknown match option");
+        }
 
-    g_debug("after acquired callback");
+        lua_pop(L, 1);
+    }
+
+    luaL_argcheck(L, !interval || opts->coalesce, index, "interval requires coalesce");
 }
 
-static void name_lost(GDBusConnection *conn,
-                      const gchar *name,
-                      gpointer user_data)
+/*
+ * Route owns copies of all match options.
+ */
+static struct route *route_new(const struct match_options *opts)
 {
-    struct own_name_ud *own_name_ud = user_data;
-    lua_State *L = own_name_ud->L;
+    struct route *route = g_new0(struct route, 1);
+    struct match_arg arg;
+    guint i;
+
+    route->path_namespace = g_strdup(opts->path_namespace);
+    route->args = g_array_sized_new(FALSE, FALSE, sizeof(struct match_arg), opts->n_args);
+    for (i = 0; i < opts->n_args; i++) {
+        arg = opts->args[i];
+        arg.value = g_strdup(arg.value);
+        g_array_append_val(route->args, arg);
+    }
+    route->coalesce = opts->coalesce;
+    route->coalesce_arg = opts->coalesce_arg;
+    route->interval = opts->interval;
 
-    g_debug("Lost name: %s, handled=%d", name, (int) own_name_ud->handled);
+    return route;
+}
 
-    if (own_name_ud->handled)
+static void rule_append(GString *rule, const gchar *key, const gchar *value)
+{
+    const gchar *p;
+
+    if (!value)
         return;
 
-    own_name_ud->handled = TRUE;
+    /* Apostrophe can not be escaped inside quotes */
+    g_string_append_printf(rule, ",%s='", key);
+    for (p = value; *p; p++) {
+        if (*p == '\'')
+            g_string_append(rule, "'\\''");
+        else
+            g_string_append_c(rule, *p);
+    }
+    g_string_append_c(rule, '\'');
+}
 
-    if (own_name_ud->loop) {
-        g_main_loop_quit(own_name_ud->loop);
-        return;
+static gint match_arg_compare(gconstpointer a, gconstpointer b)
+{
+    const struct match_arg *arg_a = a, *arg_b = b;
+
+    if (arg_a->index != arg_b->index)
+        return arg_a->index < arg_b->index ? -1 : 1;
+    if (arg_a->path != arg_b->path)
+        return arg_a->path ? 1 : -1;
+    if (arg_a->namespace != arg_b->namespace)
+        return arg_a->namespace ? 1 : -1;
+
+    return strcmp(arg_a->value, arg_b->value);
+}
+
+/*
+ * Arguments are sorted, so the same conditions always give the same rule.
+ */
+static gchar *format_match_rule(const gchar *sender, const gchar *object_path,
+                                const gchar *interface_name, const gchar *signal_name,
+                                const struct route *route)
+{
+    GString *rule = g_string_new("type='signal'");
+    const struct match_arg *arg;
+    gchar key[32];
+    guint i;
+
+    rule_append(rule, "sender", sender);
+    rule_append(rule, "interface", interface_name);
+    rule_append(rule, "member", signal_name);
+    rule_append(rule, "path", object_path);
+    rule_append(rule, "path_namespace", route->path_namespace);
+
+    g_array_sort(route->args, match_arg_compare);
+    for (i = 0; i < route->args->len; i++) {
+        arg = &g_array_index(route->args, struct match_arg, i);
+        g_snprintf(key, sizeof(key), "arg%u%s", arg->index,
+                   arg->path ? "path" : arg->namespace ? "namespace" : "");
+        rule_append(rule, key, arg->value);
+    }
+
+    return g_string_free(rule, FALSE);
+}
+
+static gboolean match_arg_check(const struct match_arg *arg, GVariant *parameters)
+{
+    GVariant *child;
+    const gchar *str;
+    gboolean ret = FALSE;
+
+    if (arg->index >= g_variant_n_children(parameters))
+        return FALSE;
+
+    child = g_variant_get_child_value(parameters, arg->index);
+
+    if (g_variant_is_of_type(child, G_VARIANT_TYPE_STRING) ||
+        (arg->path && g_variant_is_of_type(child, G_VARIANT_TYPE_OBJECT_PATH))) {
+        str = g_variant_get_string(child, NULL);
+
+        if (arg->path)
+            ret = !strcmp(str, arg->value) ||
+                  (g_str_has_suffix(arg->value, "/") && g_str_has_prefix(str, arg->value)) ||
+                  (g_str_has_suffix(str, "/") && g_str_has_prefix(arg->value, str));
+        else if (arg->namespace)
+            ret = g_str_has_prefix(str, arg->value) &&
+                  (str[strlen(arg->value)] == '\0' || str[strlen(arg->value)] == '.');
+        else
+            ret = !strcmp(str, arg->value);
     }
 
-    lua_pushvalue(L, -2);
-    lua_pushvalue(L, -2);
+    g_variant_unref(child);
+
+    return ret;
+}
+
+static gboolean route_matches(const struct route *route,
+                              const gchar *object_path, GVariant *parameters)
+{
+    guint i;
 
-    lua_pushboolean(L, 0);
-    ed_resume(L, 2);
+    if (route->path_namespace &&
+        strcmp(object_path, route->path_namespace) &&
+        !path_is_below(object_path, route->path_namespace))
+        return FALSE;
 
-    g_debug("after lost callback");
+    for (i = 0; i < route->args->len; i++)
+        if (!match_arg_check(&g_array_index(route->args, struct match_arg, i), parameters))
+            return FALSE;
+
+    return TRUE;
 }
 
-static int bus_own_name(lua_State *L)
+/*
+ * Parameters are decoded once, on state->L stack, and passed to every handler
+ * of route. Handlers removed by previous ones are skipped.
+ */
+static void route_dispatch(struct route *route, GVariant *parameters)
 {
-    struct easydbus_state *state = lua_touserdata(L, lua_upvalueindex(1));
-    GDBusConnection *conn = get_conn(L, 1);
-    const char *name = luaL_checkstring(L, 2);
+    struct easydbus_state *state = route->state;
+    struct router *router = get_router(route->conn, state);
+    struct handler *handler;
+    lua_State *L = state->L;
     lua_State *T;
-    int i, n_args = lua_gettop(L);
-    struct own_name_ud *own_name_ud;
+    guint ids_buf[16]; /* enough for most routes, no allocation per signal */
+    guint *ids;
+    guint n_ids, i;
+    GList *link;
+    int top, n_params, n_args;
+    int ret;
+    int j;
 
-    g_debug("%s", __FUNCTION__);
+    n_ids = route->handlers.length;
+    if (!n_ids)
+        return;
 
-    own_name_ud = g_new0(struct own_name_ud, 1);
-    own_name_ud->state = state;
-    own_name_ud->L = T = lua_newthread(L);
+    top = lua_gettop(L);
+    n_params = push_tuple(L, parameters, NULL, state->decode_flags);
 
-    if (!in_mainloop(state)) {
-        own_name_ud->owner_id =
-            g_bus_own_name_on_connection(conn,
-                                         name,
-                                         G_BUS_NAME_OWNER_FLAGS_NONE,
-                                         name_acquired,
-                                         name_lost,
-                                         own_name_ud,
-                                         own_name_ud_free);
+    ids = n_ids <= G_N_ELEMENTS(ids_buf) ? ids_buf : g_new(guint, n_ids);
+    for (link = route->handlers.head, i = 0; link; link = link->next, i++)
+        ids[i] = ((struct handler *) link->data)->id;
 
-        own_name_ud->loop = g_main_loop_new(NULL, FALSE);
-        g_main_loop_run(own_name_ud->loop);
-        g_main_loop_unref(own_name_ud->loop);
-        own_name_ud->loop = NULL;
+    for (i = 0; i < n_ids; i++) {
+        handler = g_hash_table_lookup(router->handlers, GUINT_TO_POINTER(ids[i]));
+        if (!handler)
+            continue;
 
-        if (own_name_ud->success)
-            lua_pushinteger(L, own_name_ud->owner_id);
-        else
-            lua_pushboolean(L, 0);
-        return 1;
-    }
+        T = thread_acquire(state);
 
-    for (i = 1; i <= n_args; i++) {
-        lua_pushvalue(L, i);
-    }
-    lua_xmove(L, T, n_args);
+        lua_rawgeti(T, LUA_REGISTRYINDEX, handler->ref);
+        n_args = lua_rawlen(T, 1);
+        for (j = 1; j <= n_args; j++)
+            lua_rawgeti(T, 1, j);
 
-    lua_pushlightuserdata(L, T);
-    lua_pushvalue(L, -2);
-    lua_rawset(L, LUA_REGISTRYINDEX);
-    lua_pop(L, 1);
+        /* T is on top of L, so copies of parameters are above it */
+        for (j = 1; j <= n_params; j++)
+            lua_pushvalue(L, top + j);
+        lua_xmove(L, T, n_params);
 
-    own_name_ud->owner_id =
-        g_bus_own_name_on_connection(conn,
-                                     name,
-                                     G_BUS_NAME_OWNER_FLAGS_NONE,
-                                     name_acquired,
-                                     name_lost,
-                                     own_name_ud,
-                                     own_name_ud_free);
+        ret = ed_resume(T, n_args + n_params - 1);
+        if (ret && ret != LUA_YIELD)
+            g_warning("signal handler error: %s", lua_tostring(T, -1));
 
-    return 0;
+        thread_release(state, T);
+    }
+
+    lua_settop(L, top);
+    if (ids != ids_buf)
+        g_free(ids);
 }
 
-static int bus_unown_name(lua_State *L)
+/*
+ * Delivers newest signal of every key, in order in which keys first appeared.
+ */
+static gboolean route_flush(gpointer user_data)
 {
-    guint owner_id = luaL_checkinteger(L, 2);
+    struct route *route = user_data;
+    GHashTable *pending = route->pending;
+    GQueue keys = route->pending_keys;
+    struct pending_signal *signal;
+    gchar *key;
+
+    g_debug("%s: %s n=%u", __FUNCTION__, route->rule, keys.length);
+
+    /* Signals received from now on are delivered with next flush */
+    route->flush_id = 0;
+    route->pending = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, pending_signal_free);
+    g_queue_init(&route->pending_keys);
+
+    while ((key = g_queue_pop_head(&keys))) {
+        signal = g_hash_table_lookup(pending, key);
+        route_dispatch(route, signal->parameters);
+    }
 
-    g_bus_unown_name(owner_id);
+    g_hash_table_unref(pending);
 
-    return 0;
+    return FALSE;
 }
 
-static int bus_emit(lua_State *L)
+static gchar *coalesce_key(struct route *route, const gchar *object_path, GVariant *parameters)
 {
-    GDBusConnection *conn = get_conn(L, 1);
-    const char *listener = lua_tostring(L, 2);
-    const char *object_path = luaL_checkstring(L, 3);
-    const char *interface_name = luaL_checkstring(L, 4);
-    const char *signal_name = luaL_checkstring(L, 5);
-    const char *sig = lua_tostring(L, 6);
-    GVariant *params;
-    GError *error = NULL;
+    GVariant *child;
+    gchar *key;
 
-    g_debug("%s: listener=%s object_path=%s interface_name=%s signal_name=%s sig=%s",
-            __FUNCTION__, listener, object_path, interface_name, signal_name, sig);
+    if (route->coalesce_arg == -1)
+        return g_strdup(object_path);
 
-    if (listener)
-        luaL_argcheck(L, g_dbus_is_name(listener), 2, "Invalid listener name");
-    luaL_argcheck(L, g_variant_is_object_path(object_path), 3, "Invalid object path");
-    luaL_argcheck(L, g_dbus_is_interface_name(interface_name), 4, "Invalid interface name");
+    if (route->coalesce_arg < 0 || (gsize) route->coalesce_arg >= g_variant_n_children(parameters))
+        return g_strdup("");
 
-    params = range_to_tuple(L, 7, lua_gettop(L) + 1, sig, NULL);
+    child = g_variant_get_child_value(parameters, route->coalesce_arg);
+    if (g_variant_is_of_type(child, G_VARIANT_TYPE_STRING) ||
+        g_variant_is_of_type(child, G_VARIANT_TYPE_OBJECT_PATH))
+        key = g_variant_dup_string(child, NULL);
+    else
+        key = g_variant_print(child, FALSE);
+    g_variant_unref(child);
 
-    g_dbus_connection_emit_signal(conn,
-                                  listener,
-                                  object_path,
-                                  interface_name,
-                                  signal_name,
-                                  params,
-                                  &error);
+    return key;
+}
 
-    if (error != NULL) {
-        lua_pushnil(L);
-        lua_pushstring(L, error->message);
-        g_error_free(error);
-        return 2;
+/*
+ * Superseded signal is dropped before it is decoded.
+ */
+static void route_coalesce(struct route *route, const gchar *object_path, GVariant *parameters)
+{
+    struct pending_signal *signal;
+    gchar *key = coalesce_key(route, object_path, parameters);
+
+    signal = g_hash_table_lookup(route->pending, key);
+    if (signal) {
+        g_variant_unref(signal->parameters);
+        signal->parameters = g_variant_ref(parameters);
+        g_free(key);
+    } else {
+        signal = g_new(struct pending_signal, 1);
+        signal->parameters = g_variant_ref(parameters);
+        g_hash_table_insert(route->pending, key, signal);
+        g_queue_push_tail(&route->pending_keys, key);
     }
 
-    lua_pushboolean(L, 1);
-    return 1;
+    if (route->flush_id)
+        return;
+
+    if (route->interval)
+        route->flush_id = state_timeout_add(route->state, route->interval, route_flush, route);
+    else
+        route->flush_id = state_idle_add(route->state, route_flush, route);
 }
 
 static void signal_callback(GDBusConnection *conn,
@@ -716,119 +3109,451 @@ static void signal_callback(GDBusConnection *conn,
                             GVariant *parameters,
                             gpointer user_data)
 {
-    struct object_ud *obj_ud = user_data;
-    struct easydbus_state *state = obj_ud->state;
-    int ref = obj_ud->ref;
-    int n_args;
-    lua_State *L;
-    int ret;
-    int i;
+    struct route *route = user_data;
 
-    g_debug("%s", __FUNCTION__);
+    g_debug("%s: %s", __FUNCTION__, route->rule);
 
-    L = lua_newthread(state->L);
+    /* Filtered before any Lua value is created */
+    if (route->add_match && !route_matches(route, object_name, parameters))
+        return;
 
-    lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
-    n_args = lua_rawlen(L, 1);
-    for (i = 1; i <= n_args; i++) {
-        lua_rawgeti(L, 1, i);
+    if (route->coalesce)
+        route_coalesce(route, object_name, parameters);
+    else
+        route_dispatch(route, parameters);
+}
+
+/*
+ * Returns route with the same match rule, or subscribes new one.
+ */
+static struct route *route_get(struct easydbus_state *state, GDBusConnection *conn,
+                               struct router *router, struct route *route,
+                               const gchar *sender, const gchar *object_path,
+                               const gchar *interface_name, const gchar *signal_name)
+{
+    GDBusSignalFlags flags = G_DBUS_SIGNAL_FLAGS_NONE;
+    const struct match_arg *arg0 = NULL;
+    struct route *existing;
+
+    route->state = state;
+    route->conn = conn;
+    route->rule = format_match_rule(sender, object_path, interface_name, signal_name, route);
+    route->key = g_strdup_printf("%s coalesce=%d,%d,%u", route->rule,
+                                 route->coalesce, route->coalesce_arg, route->interval);
+
+    existing = g_hash_table_lookup(router->routes, route->key);
+    if (existing) {
+        route_free(route);
+        return existing;
     }
 
-    ret = ed_resume(L, n_args + push_tuple(L, parameters, NULL) - 1);
-    if (ret && ret != LUA_YIELD)
-        g_warning("signal handler error: %s", lua_tostring(L, -1));
+    if (route->coalesce)
+        route->pending = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, pending_signal_free);
+
+    if (!route->path_namespace && route->args->len == 1 &&
+        g_array_index(route->args, struct match_arg, 0).index == 0) {
+        /* Single arg0 condition is matched by GDBus */
+        arg0 = &g_array_index(route->args, struct match_arg, 0);
+        if (arg0->path)
+            flags |= G_DBUS_SIGNAL_FLAGS_MATCH_ARG0_PATH;
+        else if (arg0->namespace)
+            flags |= G_DBUS_SIGNAL_FLAGS_MATCH_ARG0_NAMESPACE;
+    } else if (route->path_namespace || route->args->len) {
+        route->add_match = TRUE;
+        flags |= G_DBUS_SIGNAL_FLAGS_NO_MATCH_RULE;
+        match_rule_call(conn, "AddMatch", route->rule);
+    }
+
+    route->id = g_dbus_connection_signal_subscribe(conn,
+                                                   sender,
+                                                   interface_name,
+                                                   signal_name,
+                                                   object_path,
+                                                   arg0 ? arg0->value : NULL,
+                                                   flags,
+                                                   signal_callback,
+                                                   route,
+                                                   route_free);
 
-    lua_pop(state->L, 1);
+    g_hash_table_insert(router->routes, route->key, route);
+
+    return route;
 }
 
+/*
+ * Args:
+ * 1) conn
+ * match options (optional table, following args are shifted by one)
+ * 2) sender
+ * 3) object_path
+ * 4) interface_name
+ * 5) signal_name
+ * 6) handler
+ * ...) handler args
+ *
+ * Returns handler id. Handlers with the same sender, object path, interface,
+ * signal and match options share single subscription.
+ */
 static int bus_subscribe(lua_State *L)
 {
     struct easydbus_state *state = lua_touserdata(L, lua_upvalueindex(1));
     GDBusConnection *conn = get_conn(L, 1);
-    const char *sender = lua_tostring(L, 2);
-    const char *object_path = lua_tostring(L, 3);
-    const char *interface_name = lua_tostring(L, 4);
-    const char *signal_name = lua_tostring(L, 5);
+    int a = lua_istable(L, 2) ? 3 : 2; /* first argument after options */
+    const char *sender = lua_tostring(L, a);
+    const char *object_path = lua_tostring(L, a + 1);
+    const char *interface_name = lua_tostring(L, a + 2);
+    const char *signal_name = lua_tostring(L, a + 3);
     int n_params = lua_gettop(L);
-    struct object_ud *obj_ud = g_new(struct object_ud, 1);
-    guint ref_id;
+    struct router *router = get_router(conn, state);
+    struct match_options opts;
+    struct handler *handler;
     int i;
 
-    luaL_argcheck(L, !lua_isnoneornil(L, 6), 6, "Signal handler not specified");
+    luaL_argcheck(L, !lua_isnoneornil(L, a + 4), a + 4, "Signal handler not specified");
 
     g_debug("%s", __FUNCTION__);
 
-    lua_createtable(L, n_params - 5, 0);
+    check_match_options(L, 2, &opts);
+    luaL_argcheck(L, !(object_path && opts.path_namespace), 2,
+                  "path_namespace can not be used with object path");
 
-    for (i = 6; i <= n_params; i++) {
+    lua_createtable(L, n_params - a - 3, 0);
+
+    for (i = a + 4; i <= n_params; i++) {
         lua_pushvalue(L, i);
-        lua_rawseti(L, -2, i - 5);
+        lua_rawseti(L, -2, i - a - 3);
     }
 
-    obj_ud->ref = luaL_ref(L, LUA_REGISTRYINDEX);
-    obj_ud->state = state;
+    handler = g_new0(struct handler, 1);
+    handler->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    handler->id = ++router->last_id;
+    handler->route = route_get(state, conn, router, route_new(&opts),
+                               sender, object_path, interface_name, signal_name);
 
-    ref_id = g_dbus_connection_signal_subscribe(conn,
-                                                sender,
-                                                interface_name,
-                                                signal_name,
-                                                object_path,
-                                                NULL, /* arg0 */
-                                                G_DBUS_SIGNAL_FLAGS_NONE,
-                                                signal_callback,
-                                                obj_ud,
-                                                object_ud_free);
+    g_queue_push_tail(&handler->route->handlers, handler);
+    handler->link = handler->route->handlers.tail;
+    g_hash_table_insert(router->handlers, GUINT_TO_POINTER(handler->id), handler);
 
-    lua_pushinteger(L, ref_id);
+    lua_pushinteger(L, handler->id);
     return 1;
 }
 
+/*
+ * Args:
+ * 1) conn
+ * 2) handler id
+ *
+ * Subscription is removed together with its last handler.
+ */
 static int bus_unsubscribe(lua_State *L)
 {
+    struct easydbus_state *state = lua_touserdata(L, lua_upvalueindex(1));
     GDBusConnection *conn = get_conn(L, 1);
-    guint ref_id = luaL_checkinteger(L, 2);
+    guint handler_id = luaL_checkinteger(L, 2);
+    struct router *router = get_router(conn, state);
+    struct handler *handler;
+    struct route *route;
 
     g_debug("%s", __FUNCTION__);
 
-    g_dbus_connection_signal_unsubscribe(conn, ref_id);
+    handler = g_hash_table_lookup(router->handlers, GUINT_TO_POINTER(handler_id));
+    if (!handler)
+        return 0;
+
+    route = handler->route;
+    g_queue_delete_link(&route->handlers, handler->link);
+    luaL_unref(L, LUA_REGISTRYINDEX, handler->ref);
+    g_hash_table_remove(router->handlers, GUINT_TO_POINTER(handler_id));
+
+    if (g_queue_is_empty(&route->handlers)) {
+        g_hash_table_remove(router->routes, route->key);
+        g_dbus_connection_signal_unsubscribe(conn, route->id);
+    }
 
     return 0;
 }
 
+/*
+ * Args:
+ * 1) conn
+ *
+ * Closes peer connection. Shared bus connections can not be closed.
+ */
+static int bus_close(lua_State *L)
+{
+    GDBusConnection *conn = get_conn(L, 1);
+    GError *error = NULL;
+
+    luaL_argcheck(L, g_object_get_data(G_OBJECT(conn), PEER_CONN), 1,
+                  "Only connections of dbus.connect() and dbus.server() can be closed");
+
+    if (!g_dbus_connection_close_sync(conn, NULL, &error)) {
+        lua_pushnil(L);
+        push_error(L, error);
+        g_error_free(error);
+        return 2;
+    }
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
 luaL_Reg bus_funcs[] = {
     {"call", bus_call},
+    {"call_many", bus_call_many},
+    {"send", bus_send},
     {"introspect", bus_introspect},
+    {"invalidate_introspection", bus_invalidate_introspection},
     {"register_object", bus_register_object},
     {"unregister_object", bus_unregister_object},
+    {"property_changed", bus_property_changed},
+    {"method_return", bus_method_return},
+    {"handler_error", bus_handler_error},
+    {"register_object_manager", bus_register_object_manager},
+    {"register_subtree", bus_register_subtree},
+    {"unregister_subtree", bus_unregister_subtree},
+    {"register_pool", bus_register_pool},
     {"own_name", bus_own_name},
     {"unown_name", bus_unown_name},
     {"emit", bus_emit},
+    {"emit_many", bus_emit_many},
     {"subscribe", bus_subscribe},
     {"unsubscribe", bus_unsubscribe},
+    {"close", bus_close},
     {NULL, NULL},
 };
 
-int new_conn(lua_State *L, GBusType bus_type)
+int new_conn(lua_State *L, struct easydbus_state *state, GBusType bus_type)
 {
     GError *error = NULL;
+    GDBusConnection *conn = NULL;
+    gchar *address;
+
+    if (state->own_context && state->bus_conns[bus_type]) {
+        conn = state->bus_conns[bus_type];
+    } else if (state->own_context) {
+        /*
+         * Shared connection would be used by all states in process, so
+         * state with own context gets private one, same for every call.
+         * Context is already thread-default, so connection callbacks are
+         * dispatched by it.
+         */
+        address = g_dbus_address_get_for_bus_sync(bus_type, NULL, &error);
+        if (address)
+            conn = g_dbus_connection_new_for_address_sync(address,
+                                                          G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+                                                          G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+                                                          NULL, /* observer */
+                                                          NULL, /* cancellable */
+                                                          &error);
+        g_free(address);
+        state->bus_conns[bus_type] = conn;
+    } else {
+        conn = g_bus_get_sync(bus_type, NULL, &error);
+    }
+    g_assert_no_error(error);
+
+    push_conn(L, state, conn);
+
+    return 1;
+}
+
+/*
+ * Args:
+ * 1) address, e.g. 'unix:path=/run/example' or 'unix:abstract=example'
+ * 2) options table (optional):
+ *    bus - address is of message bus, not of peer
+ *
+ * Connection is private, so it is not shared with any other user.
+ */
+int connect_conn(lua_State *L, struct easydbus_state *state)
+{
+    const char *address = luaL_checkstring(L, 1);
+    GDBusConnectionFlags flags = G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT;
     GDBusConnection *conn;
+    GError *error = NULL;
 
-    conn = g_bus_get_sync(bus_type, NULL, &error);
-    g_assert_no_error(error);
+    if (lua_istable(L, 2)) {
+        lua_getfield(L, 2, "bus");
+        if (lua_toboolean(L, -1))
+            flags |= G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION;
+        lua_pop(L, 1);
+    }
+
+    conn = g_dbus_connection_new_for_address_sync(address,
+                                                  flags,
+                                                  NULL, /* observer */
+                                                  NULL, /* cancellable */
+                                                  &error);
+    if (!conn) {
+        lua_pushnil(L);
+        push_error(L, error);
+        g_error_free(error);
+        return 2;
+    }
+
+    push_conn(L, state, conn);
+    conn_keep_until_closed(conn);
+
+    return 1;
+}
+
+static int conn_ref__gc(lua_State *L)
+{
+    GDBusConnection **conn = lua_touserdata(L, 1);
+
+    g_object_unref(*conn);
+
+    return 0;
+}
+
+static void conn_closed(GDBusConnection *conn, gboolean remote_peer_vanished,
+                        GError *error, gpointer user_data)
+{
+    g_debug("%s: conn=%p remote_peer_vanished=%d", __FUNCTION__, (void *) conn,
+            remote_peer_vanished);
+
+    g_object_unref(conn);
+}
+
+/*
+ * Takes over reference of peer connection and drops it once connection is
+ * closed, so registrations live as long as peer is connected.
+ */
+void conn_keep_until_closed(GDBusConnection *conn)
+{
+    g_object_set_data(G_OBJECT(conn), PEER_CONN, GINT_TO_POINTER(TRUE));
 
-    lua_createtable(L, 1, 0);
+    if (g_dbus_connection_is_closed(conn)) {
+        g_object_unref(conn);
+        return;
+    }
+
+    g_signal_connect(conn, "closed", G_CALLBACK(conn_closed), NULL);
+}
+
+/*
+ * Data attached to connection is kept separately for each state, so that
+ * tables inside are used only from thread of that state. Connections are
+ * shared between states, so only lookup of state on connection is locked.
+ */
+#define CONN_STATE_DATA "easydbus-state-data"
+
+static GMutex conn_data_lock;
+
+static void datalist_free(gpointer user_data)
+{
+    GData **datalist = user_data;
+
+    g_datalist_clear(datalist);
+    g_free(datalist);
+}
+
+static GData **conn_datalist(GDBusConnection *conn, struct easydbus_state *state, gboolean create)
+{
+    GHashTable *states;
+    GData **datalist = NULL;
+    GWeakRef *weak;
+
+    g_mutex_lock(&conn_data_lock);
+
+    states = g_object_get_data(G_OBJECT(conn), CONN_STATE_DATA);
+    if (!states && create) {
+        states = g_hash_table_new_full(NULL, NULL, NULL, datalist_free);
+        g_object_set_data_full(G_OBJECT(conn), CONN_STATE_DATA, states,
+                               (GDestroyNotify) g_hash_table_unref);
+    }
+
+    if (states)
+        datalist = g_hash_table_lookup(states, state);
+
+    if (!datalist && create) {
+        datalist = g_new(GData *, 1);
+        g_datalist_init(datalist);
+        g_hash_table_insert(states, state, datalist);
+
+        /* Connection may outlive state, see conn_data_clear() */
+        weak = g_new(GWeakRef, 1);
+        g_weak_ref_init(weak, conn);
+        state->data_conns = g_slist_prepend(state->data_conns, weak);
+    }
+
+    g_mutex_unlock(&conn_data_lock);
+
+    return datalist;
+}
+
+gpointer conn_data_get(GDBusConnection *conn, struct easydbus_state *state, const gchar *key)
+{
+    GData **datalist = conn_datalist(conn, state, FALSE);
+
+    return datalist ? g_datalist_get_data(datalist, key) : NULL;
+}
+
+void conn_data_set(GDBusConnection *conn, struct easydbus_state *state, const gchar *key,
+                   gpointer data, GDestroyNotify destroy)
+{
+    g_datalist_set_data_full(conn_datalist(conn, state, TRUE), key, data, destroy);
+}
+
+/*
+ * Drops data of state from connections still alive, so that they do not
+ * refer to closed state, nor to new state allocated at the same address.
+ */
+void conn_data_clear(struct easydbus_state *state)
+{
+    GDBusConnection *conn;
+    GHashTable *states;
+    GWeakRef *weak;
+    GSList *l;
+
+    for (l = state->data_conns; l; l = l->next) {
+        weak = l->data;
+        conn = g_weak_ref_get(weak);
+        if (conn) {
+            g_mutex_lock(&conn_data_lock);
+            states = g_object_get_data(G_OBJECT(conn), CONN_STATE_DATA);
+            if (states)
+                g_hash_table_remove(states, state);
+            g_mutex_unlock(&conn_data_lock);
+            g_object_unref(conn);
+        }
+        g_weak_ref_clear(weak);
+        g_free(weak);
+    }
+
+    g_slist_free(state->data_conns);
+    state->data_conns = NULL;
+}
+
+/*
+ * Pushes bus object of conn. Bus object holds its own reference, so closed
+ * peer connection is not freed while still used from Lua.
+ */
+void push_conn(lua_State *L, struct easydbus_state *state, GDBusConnection *conn)
+{
+    GDBusConnection **ref;
+
+    state->n_conns++;
+
+    lua_createtable(L, 2, 0);
 
     lua_pushlightuserdata(L, conn);
     lua_rawseti(L, -2, 1);
 
+    ref = lua_newuserdata(L, sizeof(*ref));
+    *ref = g_object_ref(conn);
+    lua_pushlightuserdata(L, CONN_REF_MT);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_setmetatable(L, -2);
+    lua_rawseti(L, -2, 2);
+
     lua_pushlightuserdata(L, BUS_MT);
     lua_rawget(L, LUA_REGISTRYINDEX);
 
     lua_setmetatable(L, -2);
 
     g_debug("Created conn=%p", (void *) conn);
-
-    return 1;
 }
 
 int luaopen_easydbus_bus(lua_State *L)
@@ -846,5 +3571,31 @@ int luaopen_easydbus_bus(lua_State *L)
     lua_pushvalue(L, -2);
     lua_rawset(L, LUA_REGISTRYINDEX);
 
+    lua_pushlightuserdata(L, PENDING_HANDLERS);
+    lua_newtable(L);
+    lua_createtable(L, 0, 1);
+    lua_pushliteral(L, "k");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
+    lua_pushlightuserdata(L, PENDING_INVOCATION_MT);
+    lua_newtable(L);
+    lua_pushcfunction(L, pending_invocation__gc);
+    lua_setfield(L, -2, "__gc");
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
+    lua_pushlightuserdata(L, PTR_ARRAY_MT);
+    lua_newtable(L);
+    lua_pushcfunction(L, ptr_array__gc);
+    lua_setfield(L, -2, "__gc");
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
+    lua_pushlightuserdata(L, CONN_REF_MT);
+    lua_newtable(L);
+    lua_pushcfunction(L, conn_ref__gc);
+    lua_setfield(L, -2, "__gc");
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
     return 1;
 }
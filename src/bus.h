@@ -12,6 +12,49 @@
 
 #include <gio/gio.h>
 
-int new_conn(lua_State *L, GBusType bus_type);
+#include "easydbus.h"
+#include "signature.h"
+
+struct call_options {
+    gboolean no_reply;
+    GDBusCallFlags flags;
+    gint timeout;
+    const GVariantType *reply_type;
+    GCancellable *cancellable;
+};
+
+/* Validated method call target */
+struct call {
+    GDBusConnection *conn;
+    const gchar *bus_name;
+    const gchar *object_path;
+    const gchar *interface_name;
+    const gchar *method_name;
+    const struct signature *sig;
+};
+
+gboolean in_mainloop(struct easydbus_state *state);
+guint state_idle_add(struct easydbus_state *state, GSourceFunc func, gpointer data);
+guint state_timeout_add(struct easydbus_state *state, guint interval,
+                        GSourceFunc func, gpointer data);
+void state_source_remove(struct easydbus_state *state, guint id);
+
+void check_call_options(lua_State *L, int index, struct call_options *opts);
+int do_call(lua_State *L, struct easydbus_state *state, const struct call *call,
+            const struct call_options *opts, int index);
+int do_send(lua_State *L, const struct call *call, const struct call_options *opts, int index);
+
+void invoke_method(struct easydbus_state *state, lua_State *T,
+                   const gchar *method_name, GVariant *parameters,
+                   GDBusMethodInvocation *invocation);
+
+int new_conn(lua_State *L, struct easydbus_state *state, GBusType bus_type);
+int connect_conn(lua_State *L, struct easydbus_state *state);
+void push_conn(lua_State *L, struct easydbus_state *state, GDBusConnection *conn);
+void conn_keep_until_closed(GDBusConnection *conn);
+gpointer conn_data_get(GDBusConnection *conn, struct easydbus_state *state, const gchar *key);
+void conn_data_set(GDBusConnection *conn, struct easydbus_state *state, const gchar *key,
+                   gpointer data, GDestroyNotify destroy);
+void conn_data_clear(struct easydbus_state *state);
 
 int luaopen_easydbus_bus(lua_State *L);
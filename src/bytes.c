@@ -0,0 +1,175 @@
+/*
+ * Copyright 2016, Grinn
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "bytes.h"
+
+#include "compat.h"
+
+#include <string.h>
+
+static int bytes_mt;
+#define BYTES_MT ((void *) &bytes_mt)
+
+void push_bytes(lua_State *L, GVariant *value)
+{
+    struct bytes *bytes = lua_newuserdata(L, sizeof(*bytes));
+
+    bytes->value = g_variant_ref(value);
+    bytes->data = g_variant_get_fixed_array(value, &bytes->size, sizeof(guint8));
+
+    lua_pushlightuserdata(L, BYTES_MT);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_setmetatable(L, -2);
+}
+
+struct bytes *bytes_test(lua_State *L, int index)
+{
+    struct bytes *bytes = lua_touserdata(L, index);
+
+    if (lua_type(L, index) != LUA_TUSERDATA || !lua_getmetatable(L, index))
+        return NULL;
+
+    lua_pushlightuserdata(L, BYTES_MT);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    if (!lua_rawequal(L, -1, -2))
+        bytes = NULL;
+    lua_pop(L, 2);
+
+    return bytes;
+}
+
+static struct bytes *bytes_check(lua_State *L, int index)
+{
+    struct bytes *bytes = bytes_test(L, index);
+
+    if (!bytes)
+        luaL_argerror(L, index, "bytes expected");
+
+    return bytes;
+}
+
+/*
+ * Args:
+ * 1) bytes
+ * 2) start (optional, default 1)
+ * 3) end (optional, default -1)
+ *
+ * Same as string.sub().
+ */
+static int bytes_sub(lua_State *L)
+{
+    struct bytes *bytes = bytes_check(L, 1);
+    lua_Integer size = bytes->size;
+    lua_Integer start = luaL_optinteger(L, 2, 1);
+    lua_Integer end = luaL_optinteger(L, 3, -1);
+
+    if (start < 0)
+        start = MAX(size + start + 1, 1);
+    else if (start == 0)
+        start = 1;
+    if (end < 0)
+        end = size + end + 1;
+    else if (end > size)
+        end = size;
+
+    if (start > end)
+        lua_pushliteral(L, "");
+    else
+        lua_pushlstring(L, (const char *) bytes->data + start - 1, end - start + 1);
+
+    return 1;
+}
+
+static int bytes_tostring(lua_State *L)
+{
+    struct bytes *bytes = bytes_check(L, 1);
+
+    lua_pushlstring(L, (const char *) bytes->data, bytes->size);
+    return 1;
+}
+
+static int bytes__index(lua_State *L)
+{
+    struct bytes *bytes = lua_touserdata(L, 1);
+    const char *key;
+    lua_Integer i;
+
+    if (lua_type(L, 2) == LUA_TNUMBER) {
+        i = lua_tointeger(L, 2);
+        if (i >= 1 && (gsize) i <= bytes->size)
+            lua_pushinteger(L, bytes->data[i - 1]);
+        else
+            lua_pushnil(L);
+        return 1;
+    }
+
+    key = lua_tostring(L, 2);
+    if (key && !strcmp(key, "sub"))
+        lua_pushcfunction(L, bytes_sub);
+    else if (key && !strcmp(key, "tostring"))
+        lua_pushcfunction(L, bytes_tostring);
+    else
+        lua_pushnil(L);
+
+    return 1;
+}
+
+static int bytes__len(lua_State *L)
+{
+    struct bytes *bytes = lua_touserdata(L, 1);
+
+    lua_pushinteger(L, bytes->size);
+    return 1;
+}
+
+static int bytes__gc(lua_State *L)
+{
+    struct bytes *bytes = lua_touserdata(L, 1);
+
+    g_variant_unref(bytes->value);
+
+    return 0;
+}
+
+static luaL_Reg bytes_funcs[] = {
+    {"__index", bytes__index},
+    {"__len", bytes__len},
+    {"__tostring", bytes_tostring},
+    {"__gc", bytes__gc},
+    {NULL, NULL},
+};
+
+/*
+ * Args:
+ * 1) string
+ *
+ * Creates buffer with copy of string, which may be sent many times.
+ */
+static int easydbus_bytes(lua_State *L)
+{
+    size_t len;
+    const char *str = luaL_checklstring(L, 1, &len);
+    GVariant *value = g_variant_new_fixed_array(G_VARIANT_TYPE_BYTE, str, len, sizeof(guint8));
+
+    g_variant_ref_sink(value);
+    push_bytes(L, value);
+    g_variant_unref(value);
+
+    return 1;
+}
+
+int luaopen_easydbus_bytes(lua_State *L)
+{
+    /* Set bytes mt in registry */
+    lua_pushlightuserdata(L, BYTES_MT);
+    luaL_newlibtable(L, bytes_funcs);
+    luaL_setfuncs(L, bytes_funcs, 0);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
+    lua_pushcfunction(L, easydbus_bytes);
+
+    return 1;
+}
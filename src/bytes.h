@@ -0,0 +1,27 @@
+/*
+ * Copyright 2016, Grinn
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+#include <gio/gio.h>
+
+/*
+ * Byte buffer sharing data of 'ay' GVariant, so received bytes are not copied.
+ */
+struct bytes {
+    GVariant *value;
+    const guint8 *data;
+    gsize size;
+};
+
+void push_bytes(lua_State *L, GVariant *value);
+struct bytes *bytes_test(lua_State *L, int index);
+
+int luaopen_easydbus_bytes(lua_State *L);
@@ -0,0 +1,101 @@
+/*
+ * Copyright 2016, Grinn
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "cancellable.h"
+
+#include "compat.h"
+
+static int cancellable_mt;
+#define CANCELLABLE_MT ((void *) &cancellable_mt)
+
+/*
+ * Returns NULL for nil.
+ */
+GCancellable *cancellable_check(lua_State *L, int index)
+{
+    GCancellable **cancellable = lua_touserdata(L, index);
+
+    if (lua_isnoneornil(L, index))
+        return NULL;
+
+    if (lua_type(L, index) == LUA_TUSERDATA && lua_getmetatable(L, index)) {
+        lua_pushlightuserdata(L, CANCELLABLE_MT);
+        lua_rawget(L, LUA_REGISTRYINDEX);
+        if (lua_rawequal(L, -1, -2)) {
+            lua_pop(L, 2);
+            return *cancellable;
+        }
+        lua_pop(L, 2);
+    }
+
+    luaL_argerror(L, index, "cancellable expected");
+    return NULL;
+}
+
+static int cancellable_cancel(lua_State *L)
+{
+    GCancellable *cancellable = cancellable_check(L, 1);
+
+    luaL_argcheck(L, cancellable != NULL, 1, "cancellable expected");
+    g_cancellable_cancel(cancellable);
+
+    return 0;
+}
+
+static int cancellable_is_cancelled(lua_State *L)
+{
+    GCancellable *cancellable = cancellable_check(L, 1);
+
+    luaL_argcheck(L, cancellable != NULL, 1, "cancellable expected");
+    lua_pushboolean(L, g_cancellable_is_cancelled(cancellable));
+
+    return 1;
+}
+
+static int cancellable__gc(lua_State *L)
+{
+    GCancellable **cancellable = lua_touserdata(L, 1);
+
+    g_object_unref(*cancellable);
+
+    return 0;
+}
+
+static luaL_Reg cancellable_funcs[] = {
+    {"cancel", cancellable_cancel},
+    {"is_cancelled", cancellable_is_cancelled},
+    {"__gc", cancellable__gc},
+    {NULL, NULL},
+};
+
+static int easydbus_cancellable(lua_State *L)
+{
+    GCancellable **cancellable = lua_newuserdata(L, sizeof(*cancellable));
+
+    *cancellable = g_cancellable_new();
+
+    lua_pushlightuserdata(L, CANCELLABLE_MT);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_setmetatable(L, -2);
+
+    return 1;
+}
+
+int luaopen_easydbus_cancellable(lua_State *L)
+{
+    /* Set cancellable mt in registry */
+    lua_pushlightuserdata(L, CANCELLABLE_MT);
+    luaL_newlibtable(L, cancellable_funcs);
+    luaL_setfuncs(L, cancellable_funcs, 0);
+    lua_pushliteral(L, "__index");
+    lua_pushvalue(L, -2);
+    lua_rawset(L, -3);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
+    lua_pushcfunction(L, easydbus_cancellable);
+
+    return 1;
+}
@@ -0,0 +1,17 @@
+/*
+ * Copyright 2016, Grinn
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+#include <gio/gio.h>
+
+GCancellable *cancellable_check(lua_State *L, int index);
+
+int luaopen_easydbus_cancellable(lua_State *L);
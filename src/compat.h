@@ -10,6 +10,13 @@
 #include "lauxlib.h"
 #include "lualib.h"
 
+#if LUA_VERSION_NUM < 502
+
+#define lua_getuservalue(L, index) lua_getfenv(L, index)
+#define lua_setuservalue(L, index) lua_setfenv(L, index)
+
+#endif
+
 #if LUA_VERSION_NUM < 503
 
 #define ed_resume(L, args) lua_resume(L, args)
@@ -21,7 +21,21 @@ struct easydbus_state {
     gint max_priority;
     gint timeout;
     int ref_cb;
+    int epoll_fd;
+    GArray *epoll_set;
+    GArray *epoll_next;
+    gint epoll_timeout;
+    GArray *prev_fds;
+    GHashTable *fd_index;
+    GArray *fd_next;
+    guint decode_flags;
+    gboolean own_context;
+    gboolean context_acquired;
+    GDBusConnection *bus_conns[3]; /* private ones by GBusType, with own context */
+    guint n_conns;
+    GSList *data_conns; /* weak refs of connections with conn_data_set() data */
     lua_State *L;
 };
 
 int easydbus_is_dbus_type(lua_State *L, int index);
+struct easydbus_state *easydbus_get_state(lua_State *L);
@@ -12,10 +12,20 @@ local running = coroutine.running
 local yield = coroutine.yield
 local unpack = unpack or table.unpack
 
+-- method handler which raises error after it was resumed still replies
+local handler_error = dbus.bus.handler_error
+dbus.bus.handler_error = nil
+local function resume_task(co, ...)
+   local ok, err = resume(co, ...)
+   if not ok then
+      handler_error(co, err)
+   end
+end
+
 -- wrappers
 local function task(func, ...)
    local args = {...}
-   args[#args+1] = resume
+   args[#args+1] = resume_task
    args[#args+1] = running()
    func(unpack(args))
 end
@@ -23,8 +33,24 @@ end
 local old_mainloop = dbus.mainloop
 function dbus.mainloop(...)
    local old_call = dbus.bus.call
-   dbus.bus.call = function(...)
-      return yield(task(old_call, ...))
+   dbus.bus.call = function(bus, opts, ...)
+      -- calls without reply do not wait
+      if type(opts) == 'table' and opts.no_reply then
+         return old_call(bus, opts, ...)
+      end
+      return yield(task(old_call, bus, opts, ...))
+   end
+   local old_call_many = dbus.bus.call_many
+   dbus.bus.call_many = function(...)
+      return yield(task(old_call_many, ...))
+   end
+   local old_introspect = dbus.bus.introspect
+   dbus.bus.introspect = function(...)
+      return yield(task(old_introspect, ...))
+   end
+   local old_proxy_call = dbus.proxy.call
+   dbus.proxy.call = function(...)
+      return yield(task(old_proxy_call, ...))
    end
    local old_own_name = dbus.bus.own_name
    dbus.bus.own_name = function(...)
@@ -34,6 +60,9 @@ function dbus.mainloop(...)
    local ret = {old_mainloop(...)}
 
    dbus.bus.call = old_call
+   dbus.bus.call_many = old_call_many
+   dbus.bus.introspect = old_introspect
+   dbus.proxy.call = old_proxy_call
    dbus.bus.own_name = old_own_name
 
    return unpack(ret)
@@ -43,18 +72,40 @@ end
 local object_mt = {}
 object_mt.__index = object_mt
 
-local function object_method_wrapper(func, ...)
-   local args = {...}
-   local nargs = #args
-   local cb = args[nargs-1]
-   local arg = args[nargs]
-   args[nargs-1] = nil
-   args[nargs] = nil
-   cb(arg, func(unpack(args)))
+-- called from pooled coroutines, arguments are passed without any table
+local method_return = dbus.bus.method_return
+dbus.bus.method_return = nil
+local function method_runner(invocation, out_sig, func, ...)
+   return method_return(invocation, out_sig, func(...))
 end
 function object_mt:add_method(method_name, in_sig, out_sig, func, ...)
    assert(func ~= nil, 'Method handler not specified')
-   self.methods[method_name] = {in_sig, out_sig, object_method_wrapper, func, ...}
+   in_sig = dbus.signature(tostring(in_sig))
+   out_sig = dbus.signature(tostring(out_sig))
+   self.methods[method_name] = {in_sig, out_sig, method_runner, func, ...}
+end
+function object_mt:add_property(property_name, sig, value, access, setter)
+   access = access or 'read'
+   assert(access == 'read' or access == 'write' or access == 'readwrite',
+          'Invalid property access')
+   self.properties[property_name] = {
+      sig = dbus.signature(tostring(sig)),
+      value = value,
+      access = access,
+      setter = setter,
+   }
+end
+function object_mt:get_property(property_name)
+   local property = assert(self.properties[property_name], 'No such property')
+   return property.value
+end
+function object_mt:set_property(property_name, value)
+   local property = assert(self.properties[property_name], 'No such property')
+   property.value = value
+   -- PropertiesChanged is emitted from mainloop, so changes are coalesced
+   for reg_id,bus in pairs(self.registrations) do
+      bus:property_changed(reg_id, property_name)
+   end
 end
 
 local function create_object(_, path, interface)
@@ -63,6 +114,8 @@ local function create_object(_, path, interface)
       path = path,
       interface = interface,
       methods = {},
+      properties = {},
+      registrations = {},
    }
    setmetatable(object, object_mt)
    return object
@@ -76,12 +129,28 @@ dbus.object = object_mt
 local EObject_mt = {}
 EObject_mt.__index = EObject_mt
 
-function EObject_mt:add_method(interface, ...)
-   local obs = self.objects
+local function get_object(EObject, interface)
+   local obs = EObject.objects
    if not obs[interface] then
-      obs[interface] = create_object(nil, self.path, interface)
+      obs[interface] = create_object(nil, EObject.path, interface)
    end
-   obs[interface]:add_method(...)
+   return obs[interface]
+end
+
+function EObject_mt:add_method(interface, ...)
+   get_object(self, interface):add_method(...)
+end
+
+function EObject_mt:add_property(interface, ...)
+   get_object(self, interface):add_property(...)
+end
+
+function EObject_mt:get_property(interface, ...)
+   return get_object(self, interface):get_property(...)
+end
+
+function EObject_mt:set_property(interface, ...)
+   get_object(self, interface):set_property(...)
 end
 
 local function create_EObject(_, path)
@@ -97,14 +166,25 @@ setmetatable(EObject_mt, {__call = create_EObject})
 
 dbus.EObject = EObject_mt
 
+-- registration id -> object, for unregister_object
+local registered = {}
+
 local old_register_object = dbus.bus.register_object
+local function register_object(bus, obj)
+   local reg_id, err = old_register_object(bus, obj.path, obj.interface, obj.methods, obj.properties)
+   if reg_id then
+      obj.registrations[reg_id] = bus
+      registered[reg_id] = obj
+   end
+   return reg_id, err
+end
 function dbus.bus:register_object(object)
    local mt = getmetatable(object)
    if mt == object_mt then
-      return old_register_object(self, object.path, object.interface, object.methods)
+      return register_object(self, object)
    elseif mt == EObject_mt then
       for _,obj in pairs(object.objects) do
-         local ret = old_register_object(self, obj.path, obj.interface, obj.methods)
+         local ret = register_object(self, obj)
          if not ret then
             return ret
          end
@@ -113,6 +193,42 @@ function dbus.bus:register_object(object)
    end
 end
 
+local old_unregister_object = dbus.bus.unregister_object
+function dbus.bus:unregister_object(reg_id)
+   local ret = old_unregister_object(self, reg_id)
+   if ret and registered[reg_id] then
+      registered[reg_id].registrations[reg_id] = nil
+      registered[reg_id] = nil
+   end
+   return ret
+end
+
+-- subtree
+local old_register_subtree = dbus.bus.register_subtree
+function dbus.bus:register_subtree(object_path, lookup, enumerate)
+   -- C side expects objects by interface name
+   local function lookup_interfaces(node)
+      local object = lookup(node)
+      local mt = getmetatable(object)
+      if mt == object_mt then
+         return {[object.interface] = object}
+      elseif mt == EObject_mt then
+         return object.objects
+      end
+   end
+   return old_register_subtree(self, object_path, lookup_interfaces, enumerate)
+end
+
+-- worker pool
+local old_register_pool = dbus.bus.register_pool
+function dbus.bus:register_pool(module, n_workers)
+   -- module is loaded here only to know what to register
+   local object = require(module)
+   assert(getmetatable(object) == object_mt, 'Module does not return object')
+   return old_register_pool(self, object.path, object.interface, object.methods,
+                            module, n_workers)
+end
+
 -- add_callback
 local old_add_callback = dbus.add_callback
 function dbus.add_callback(func, ...)
@@ -133,23 +249,173 @@ end
 local proxy_mt = {}
 proxy_mt.__index = proxy_mt
 
-function proxy_mt.add_method(proxy, method_name, interface_name, sig)
-   sig = sig or false
+function proxy_mt.add_method(proxy, method_name, interface_name, sig, out_sig)
+   local method = dbus.proxy.method(method_name, interface_name, sig, out_sig)
    proxy[method_name] = function(proxy, ...)
-      return proxy._bus:call(proxy._service, proxy._object_path, interface_name, method_name, sig or false, ...)
+      return dbus.proxy.call(proxy._proxy, method, ...)
    end
 end
 
-function dbus.bus:new_proxy(service, object_path)
+function proxy_mt:introspect()
+   local node, err = self._bus:introspect(self._service, self._object_path)
+   if not node then
+      return nil, err
+   end
+   for interface_name,interface in pairs(node.interfaces) do
+      for method_name,method in pairs(interface.methods) do
+         self:add_method(method_name, interface_name, method.in_sig, method.out_sig)
+      end
+   end
+   return true
+end
+
+function dbus.bus:new_proxy(service, object_path, introspect)
    local proxy = {
       _bus = self,
       _service = service,
       _object_path = object_path,
+      _proxy = dbus.proxy.new(self, service, object_path),
    }
    setmetatable(proxy, proxy_mt)
+   if introspect then
+      local ok, err = proxy:introspect()
+      if not ok then
+         return nil, err
+      end
+   end
    return proxy
 end
 
+-- property cache
+local properties_mt = {}
+properties_mt.__index = properties_mt
+
+local PROPERTIES = 'org.freedesktop.DBus.Properties'
+
+local function properties_changed(props, interface, changed, invalidated)
+   if interface ~= props._interface then
+      return
+   end
+   for property_name,value in pairs(changed) do
+      props.values[property_name] = value
+   end
+   for _,property_name in ipairs(invalidated) do
+      props.values[property_name] = nil
+   end
+   if props.on_changed then
+      props.on_changed(changed, invalidated)
+   end
+end
+
+function properties_mt:get(property_name)
+   local value = self.values[property_name]
+   if value == nil then
+      -- invalidated properties are fetched on demand
+      local err
+      value, err = self._bus:call(self._service, self._object_path, PROPERTIES, 'Get',
+                                  'ss', self._interface, property_name)
+      if value == nil then
+         return nil, err
+      end
+      self.values[property_name] = value
+   end
+   return value
+end
+
+function properties_mt:set(property_name, sig, value)
+   return self._bus:call(self._service, self._object_path, PROPERTIES, 'Set',
+                         'ssv', self._interface, property_name, dbus.type(value, sig))
+end
+
+function properties_mt:close()
+   self._bus:unsubscribe(self._subscription)
+end
+
+function dbus.bus:new_property_cache(service, object_path, interface)
+   local props = {
+      _bus = self,
+      _service = service,
+      _object_path = object_path,
+      _interface = interface,
+      values = {},
+   }
+   setmetatable(props, properties_mt)
+   -- subscribe first, so no change is missed between GetAll and signal
+   props._subscription = self:subscribe(service, object_path, PROPERTIES,
+                                        'PropertiesChanged', properties_changed, props)
+   local values, err = self:call(service, object_path, PROPERTIES, 'GetAll', 's', interface)
+   if not values then
+      props:close()
+      return nil, err
+   end
+   for property_name,value in pairs(values) do
+      props.values[property_name] = value
+   end
+   return props
+end
+
+-- object manager client
+local object_manager_mt = {}
+object_manager_mt.__index = object_manager_mt
+
+local OBJECT_MANAGER = 'org.freedesktop.DBus.ObjectManager'
+
+local function interfaces_added(manager, object_path, interfaces)
+   local object = manager.objects[object_path]
+   if not object then
+      object = {}
+      manager.objects[object_path] = object
+   end
+   for interface,props in pairs(interfaces) do
+      object[interface] = props
+   end
+   if manager.on_added then
+      manager.on_added(object_path, interfaces)
+   end
+end
+
+local function interfaces_removed(manager, object_path, interfaces)
+   local object = manager.objects[object_path]
+   if object then
+      for _,interface in ipairs(interfaces) do
+         object[interface] = nil
+      end
+      if next(object) == nil then
+         manager.objects[object_path] = nil
+      end
+   end
+   if manager.on_removed then
+      manager.on_removed(object_path, interfaces)
+   end
+end
+
+function object_manager_mt:close()
+   self._bus:unsubscribe(self._added)
+   self._bus:unsubscribe(self._removed)
+end
+
+function dbus.bus:new_object_manager(service, object_path)
+   local manager = {
+      _bus = self,
+      _service = service,
+      _object_path = object_path,
+      objects = {},
+   }
+   setmetatable(manager, object_manager_mt)
+   -- subscribe first, so no change is missed before GetManagedObjects reply
+   manager._added = self:subscribe(service, object_path, OBJECT_MANAGER,
+                                   'InterfacesAdded', interfaces_added, manager)
+   manager._removed = self:subscribe(service, object_path, OBJECT_MANAGER,
+                                     'InterfacesRemoved', interfaces_removed, manager)
+   local objects, err = self:call(service, object_path, OBJECT_MANAGER, 'GetManagedObjects')
+   if not objects then
+      manager:close()
+      return nil, err
+   end
+   manager.objects = objects
+   return manager
+end
+
 -- simpledbus-like names
 dbus.SystemBus = dbus.system
 dbus.SessionBus = dbus.session
@@ -14,18 +14,30 @@
 #include <gio/gio.h>
 #include <glib-unix.h>
 
+#include <errno.h>
+#include <string.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include "bus.h"
+#include "bytes.h"
+#include "cancellable.h"
 #include "compat.h"
 #include "easydbus.h"
+#include "error.h"
+#include "lazy.h"
 #include "poll.h"
+#include "proxy.h"
+#include "server.h"
+#include "signature.h"
 #include "utils.h"
 
 static int type_mt;
 #define TYPE_MT ((void *) &type_mt)
 
+static int state_key;
+#define STATE_KEY ((void *) &state_key)
+
 int easydbus_is_dbus_type(lua_State *L, int index)
 {
     int ret = 1;
@@ -73,6 +85,21 @@ static int ed_typecall(lua_State *L)
     return 1;
 }
 
+/*
+ * Returns state of easydbus loaded into L, or NULL.
+ */
+struct easydbus_state *easydbus_get_state(lua_State *L)
+{
+    struct easydbus_state *state;
+
+    lua_pushlightuserdata(L, STATE_KEY);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    state = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    return state;
+}
+
 static gboolean on_signal(gpointer user_data)
 {
     struct easydbus_state *state = user_data;
@@ -84,37 +111,18 @@ static gboolean on_signal(gpointer user_data)
     return TRUE;
 }
 
+/*
+ * Called by host event loop when epoll fd is readable or timeout has passed.
+ */
 static int easydbus_handle_epoll(lua_State *L)
 {
     struct easydbus_state *state = lua_touserdata(L, lua_upvalueindex(1));
-    int fd;
-    int revents;
-    int i;
-    int n_args = lua_gettop(L);
 
     g_debug("%s", __FUNCTION__);
 
-    gpoll_fds_clear(state);
-
-    for (i = 1; i <= n_args; i++) {
-        luaL_argcheck(L, lua_istable(L, i), i, "Is not table");
+    luaL_argcheck(L, state->epoll_fd >= 0, 1, "epoll callback is not set");
 
-        lua_rawgeti(L, i, 1);
-        fd = lua_tointeger(L, -1);
-        if (fd == 0 && !lua_isnumber(L, -1)) {
-            g_warning("Type: %s", lua_typename(L, lua_type(L, -1)));
-            luaL_argerror(L, i, "fd is not a number");
-        }
-
-        lua_rawgeti(L, i, 2);
-        revents = lua_tointeger(L, -1);
-        if (fd == 0 && !lua_isnumber(L, -1))
-            luaL_argerror(L, i, "revents is not a number");
-
-        gpoll_fds_set(state, fd, revents);
-
-        lua_pop(L, 2);
-    }
+    gpoll_fds_read(state);
 
     gpoll_dispatch(state);
 
@@ -125,12 +133,23 @@ static int easydbus_handle_epoll(lua_State *L)
 
 static int easydbus_system(lua_State *L)
 {
-    return new_conn(L, G_BUS_TYPE_SYSTEM);
+    struct easydbus_state *state = lua_touserdata(L, lua_upvalueindex(1));
+
+    return new_conn(L, state, G_BUS_TYPE_SYSTEM);
 }
 
 static int easydbus_session(lua_State *L)
 {
-    return new_conn(L, G_BUS_TYPE_SESSION);
+    struct easydbus_state *state = lua_touserdata(L, lua_upvalueindex(1));
+
+    return new_conn(L, state, G_BUS_TYPE_SESSION);
+}
+
+static int easydbus_connect(lua_State *L)
+{
+    struct easydbus_state *state = lua_touserdata(L, lua_upvalueindex(1));
+
+    return connect_conn(L, state);
 }
 
 /*
@@ -145,6 +164,12 @@ static int easydbus_set_epoll_cb(lua_State *L)
 
     luaL_argcheck(L, lua_isfunction(L, 1), 1, "Is not a function");
 
+    if (!gpoll_init(state)) {
+        lua_pushnil(L);
+        lua_pushstring(L, g_strerror(errno));
+        return 2;
+    }
+
     lua_newtable(L);
     for (i = 1; i <= n_args; i++) {
         lua_pushvalue(L, i);
@@ -158,6 +183,22 @@ static int easydbus_set_epoll_cb(lua_State *L)
     return 1;
 }
 
+/*
+ * Signals are watched from main context of state, so mainloop of any state
+ * can be interrupted.
+ */
+static guint signal_add(struct easydbus_state *state, int signum)
+{
+    GSource *source = g_unix_signal_source_new(signum);
+    guint id;
+
+    g_source_set_callback(source, on_signal, state, NULL);
+    id = g_source_attach(source, state->context);
+    g_source_unref(source);
+
+    return id;
+}
+
 static int easydbus_mainloop(lua_State *L)
 {
     struct easydbus_state *state = lua_touserdata(L, lua_upvalueindex(1));
@@ -166,15 +207,15 @@ static int easydbus_mainloop(lua_State *L)
 
     state->loop = g_main_loop_new(state->context, FALSE);
 
-    sigint_id = g_unix_signal_add(SIGINT, on_signal, state);
-    sigterm_id = g_unix_signal_add(SIGTERM, on_signal, state);
+    sigint_id = signal_add(state, SIGINT);
+    sigterm_id = signal_add(state, SIGTERM);
 
     g_debug("Entering mainloop");
     g_main_loop_run(state->loop);
     g_debug("Exiting mainloop");
 
-    g_source_remove(sigint_id);
-    g_source_remove(sigterm_id);
+    state_source_remove(state, sigint_id);
+    state_source_remove(state, sigterm_id);
 
     g_main_loop_unref(state->loop);
     state->loop = NULL;
@@ -245,11 +286,45 @@ static int easydbus_add_callback(lua_State *L)
     lua_rawset(L, LUA_REGISTRYINDEX);
     lua_pop(L, 1);
 
-    g_idle_add(add_callback, T);
+    state_idle_add(state, add_callback, T);
 
     return 0;
 }
 
+/*
+ * Switches state to its own main context, so it is not dispatched together
+ * with other GLib users in process. Context stays thread-default of calling
+ * thread until state is closed, so state should be used only from that
+ * thread. Must be called before first connection is created.
+ */
+static int easydbus_own_context(lua_State *L)
+{
+    struct easydbus_state *state = lua_touserdata(L, lua_upvalueindex(1));
+
+    if (state->own_context) {
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+
+    if (state->n_conns || in_mainloop(state)) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "connection already created");
+        return 2;
+    }
+
+    /* Default context may be owned by other thread, e.g. of pool worker */
+    if (state->context_acquired)
+        g_main_context_release(state->context);
+
+    state->context = g_main_context_new();
+    state->context_acquired = g_main_context_acquire(state->context);
+    g_main_context_push_thread_default(state->context);
+    state->own_context = TRUE;
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
 static int easydbus_pack(lua_State *L)
 {
     int i;
@@ -263,24 +338,85 @@ static int easydbus_pack(lua_State *L)
     return 1;  /* return table */
 }
 
+/*
+ * Args:
+ * 1) table with decode options:
+ *    bytes = 'table' | 'string' | 'buffer'
+ *    lazy = boolean, containers as proxies decoded on access
+ */
+static int easydbus_set_decode_options(lua_State *L)
+{
+    struct easydbus_state *state = lua_touserdata(L, lua_upvalueindex(1));
+    const char *bytes;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    lua_getfield(L, 1, "bytes");
+    bytes = lua_tostring(L, -1);
+    if (bytes) {
+        state->decode_flags &= ~(DECODE_BYTES_STRING | DECODE_BYTES_BUFFER);
+        if (!strcmp(bytes, "string"))
+            state->decode_flags |= DECODE_BYTES_STRING;
+        else if (!strcmp(bytes, "buffer"))
+            state->decode_flags |= DECODE_BYTES_BUFFER;
+        else if (strcmp(bytes, "table"))
+            luaL_argerror(L, 1, "bytes must be 'table', 'string' or 'buffer'");
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, 1, "lazy");
+    if (!lua_isnil(L, -1)) {
+        if (lua_toboolean(L, -1))
+            state->decode_flags |= DECODE_LAZY;
+        else
+            state->decode_flags &= ~DECODE_LAZY;
+    }
+    lua_pop(L, 1);
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
 static luaL_Reg funcs[] = {
     {"system", easydbus_system},
     {"session", easydbus_session},
+    {"connect", easydbus_connect},
     {"handle_epoll", easydbus_handle_epoll},
     {"set_epoll_cb", easydbus_set_epoll_cb},
     {"mainloop", easydbus_mainloop},
     {"mainloop_quit", easydbus_mainloop_quit},
     {"add_callback", easydbus_add_callback}, /* only for internal mainloop */
+    {"own_context", easydbus_own_context},
     {"pack", easydbus_pack},
+    {"set_decode_options", easydbus_set_decode_options},
     {NULL, NULL},
 };
 
 static int easydbus_state__gc(lua_State *L)
 {
     struct easydbus_state *state = lua_touserdata(L, 1);
+    guint i;
 
     g_debug("%s %p", __FUNCTION__, (void *) state);
-    g_main_context_release(state->context);
+    gpoll_free(state);
+    conn_data_clear(state);
+
+    /* Closed while context is still thread-default, as it dispatches them */
+    for (i = 0; i < G_N_ELEMENTS(state->bus_conns); i++) {
+        if (!state->bus_conns[i])
+            continue;
+        g_dbus_connection_close_sync(state->bus_conns[i], NULL, NULL);
+        g_object_unref(state->bus_conns[i]);
+        state->bus_conns[i] = NULL;
+    }
+
+    if (state->context_acquired)
+        g_main_context_release(state->context);
+
+    if (state->own_context) {
+        g_main_context_pop_thread_default(state->context);
+        g_main_context_unref(state->context);
+    }
 
     return 0;
 }
@@ -314,8 +450,18 @@ LUALIB_API int luaopen_easydbus_core(lua_State *L)
     state->allocated_nfds = 0;
     state->nfds = 0;
     state->ref_cb = -1;
+    state->epoll_fd = -1;
+    state->decode_flags = 0;
+    state->own_context = FALSE;
+    state->context_acquired = FALSE;
+    memset(state->bus_conns, 0, sizeof(state->bus_conns));
+    state->n_conns = 0;
     state->L = L;
 
+    lua_pushlightuserdata(L, STATE_KEY);
+    lua_pushvalue(L, 1);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
     /* Set functions */
     luaL_newlibtable(L, funcs);
     lua_pushvalue(L, 1);
@@ -328,6 +474,50 @@ LUALIB_API int luaopen_easydbus_core(lua_State *L)
     lua_call(L, 1, 1);
     lua_rawset(L, 2);
 
+    /* Init proxy */
+    lua_pushliteral(L, "proxy");
+    lua_pushcfunction(L, luaopen_easydbus_proxy);
+    lua_pushvalue(L, 1);
+    lua_call(L, 1, 1);
+    lua_rawset(L, 2);
+
+    /* Init peer server */
+    lua_pushliteral(L, "server");
+    lua_pushcfunction(L, luaopen_easydbus_server);
+    lua_pushvalue(L, 1);
+    lua_call(L, 1, 1);
+    lua_rawset(L, 2);
+
+    /* Init signature */
+    lua_pushliteral(L, "signature");
+    lua_pushcfunction(L, luaopen_easydbus_signature);
+    lua_call(L, 0, 1);
+    lua_rawset(L, 2);
+
+    /* Init bytes buffer */
+    lua_pushliteral(L, "bytes");
+    lua_pushcfunction(L, luaopen_easydbus_bytes);
+    lua_call(L, 0, 1);
+    lua_rawset(L, 2);
+
+    /* Init cancellable */
+    lua_pushliteral(L, "cancellable");
+    lua_pushcfunction(L, luaopen_easydbus_cancellable);
+    lua_call(L, 0, 1);
+    lua_rawset(L, 2);
+
+    /* Init error objects */
+    lua_pushliteral(L, "error");
+    lua_pushcfunction(L, luaopen_easydbus_error);
+    lua_call(L, 0, 1);
+    lua_rawset(L, 2);
+
+    /* Init lazy proxies */
+    lua_pushliteral(L, "totable");
+    lua_pushcfunction(L, luaopen_easydbus_lazy);
+    lua_call(L, 0, 1);
+    lua_rawset(L, 2);
+
     /* Push type metatable */
     lua_pushliteral(L, "type");
     lua_newtable(L);
@@ -344,7 +534,7 @@ LUALIB_API int luaopen_easydbus_core(lua_State *L)
 
     lua_rawset(L, -3);
 
-    g_main_context_acquire(state->context);
+    state->context_acquired = g_main_context_acquire(state->context);
 
     return 1;
 }
@@ -0,0 +1,185 @@
+/*
+ * Copyright 2016, Grinn
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "error.h"
+
+#include "compat.h"
+
+static int error_mt;
+#define ERROR_MT ((void *) &error_mt)
+
+static void push_error_table(lua_State *L, const char *name, const char *message)
+{
+    lua_createtable(L, 0, 2);
+    lua_pushstring(L, name);
+    lua_setfield(L, -2, "name");
+    lua_pushstring(L, message);
+    lua_setfield(L, -2, "message");
+
+    lua_pushlightuserdata(L, ERROR_MT);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_setmetatable(L, -2);
+}
+
+/*
+ * Pushes {name = ..., message = ...} error object. Remote errors keep their
+ * D-Bus error name, local ones get name encoded by GDBus.
+ */
+void push_error(lua_State *L, const GError *error)
+{
+    GError *copy = g_error_copy(error);
+    gchar *name;
+
+    name = g_dbus_error_get_remote_error(copy);
+    if (name)
+        g_dbus_error_strip_remote_error(copy);
+    else
+        name = g_dbus_error_encode_gerror(copy);
+
+    push_error_table(L, name, copy->message);
+
+    g_free(name);
+    g_error_free(copy);
+}
+
+static gboolean error_test(lua_State *L, int index)
+{
+    gboolean ret = FALSE;
+
+    if (lua_istable(L, index) && lua_getmetatable(L, index)) {
+        lua_pushlightuserdata(L, ERROR_MT);
+        lua_rawget(L, LUA_REGISTRYINDEX);
+        ret = lua_rawequal(L, -1, -2);
+        lua_pop(L, 2);
+    }
+
+    return ret;
+}
+
+/*
+ * Replies with error raised by method handler. Error objects are sent with
+ * their name, anything else as org.freedesktop.DBus.Error.Failed.
+ */
+void return_error(lua_State *L, int index, GDBusMethodInvocation *invocation)
+{
+    const char *name;
+    const char *message;
+
+    if (index < 0)
+        index = lua_gettop(L) + index + 1;
+
+    if (error_test(L, index)) {
+        lua_getfield(L, index, "name");
+        lua_getfield(L, index, "message");
+        name = lua_tostring(L, -2);
+        message = lua_tostring(L, -1);
+
+        g_dbus_method_invocation_return_dbus_error(invocation, name, message ? message : "");
+
+        lua_pop(L, 2);
+        return;
+    }
+
+    message = lua_tostring(L, index);
+    g_warning("method handler error: %s", message);
+
+    g_dbus_method_invocation_return_dbus_error(invocation, "org.freedesktop.DBus.Error.Failed",
+                                               message ? message : lua_typename(L, lua_type(L, index)));
+}
+
+/*
+ * GDBus encodes GError of unknown domain with a generic name, so names of
+ * error objects are registered with codes of own domain on first use.
+ */
+static void register_error_name(const char *name)
+{
+    static GMutex lock;
+    static gint last_code;
+
+    g_mutex_lock(&lock);
+    if (g_dbus_error_register_error(g_quark_from_static_string("easydbus-error-quark"),
+                                    last_code + 1, name))
+        last_code++;
+    g_mutex_unlock(&lock);
+}
+
+/*
+ * Sets error raised by Lua handler, e.g. of property. Error objects keep their
+ * name, anything else is org.freedesktop.DBus.Error.Failed.
+ */
+void set_gerror(lua_State *L, int index, GError **error)
+{
+    const char *name;
+    const char *message;
+    GError *dbus_error;
+
+    if (index < 0)
+        index = lua_gettop(L) + index + 1;
+
+    if (error_test(L, index)) {
+        lua_getfield(L, index, "name");
+        lua_getfield(L, index, "message");
+        name = lua_tostring(L, -2);
+        message = lua_tostring(L, -1);
+
+        register_error_name(name);
+        dbus_error = g_dbus_error_new_for_dbus_error(name, message ? message : "");
+        g_dbus_error_strip_remote_error(dbus_error);
+        g_propagate_error(error, dbus_error);
+
+        lua_pop(L, 2);
+        return;
+    }
+
+    message = lua_tostring(L, index);
+    g_set_error(error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED, "%s",
+                message ? message : lua_typename(L, lua_type(L, index)));
+}
+
+static int error__tostring(lua_State *L)
+{
+    lua_getfield(L, 1, "name");
+    lua_pushliteral(L, ": ");
+    lua_getfield(L, 1, "message");
+    lua_concat(L, 3);
+
+    return 1;
+}
+
+static luaL_Reg error_funcs[] = {
+    {"__tostring", error__tostring},
+    {NULL, NULL},
+};
+
+/*
+ * Args:
+ * 1) error name
+ * 2) error message (optional)
+ */
+static int easydbus_error(lua_State *L)
+{
+    const char *name = luaL_checkstring(L, 1);
+    const char *message = luaL_optstring(L, 2, "");
+
+    luaL_argcheck(L, g_dbus_is_interface_name(name), 1, "Invalid error name");
+
+    push_error_table(L, name, message);
+
+    return 1;
+}
+
+int luaopen_easydbus_error(lua_State *L)
+{
+    /* Set error mt in registry */
+    lua_pushlightuserdata(L, ERROR_MT);
+    luaL_newlibtable(L, error_funcs);
+    luaL_setfuncs(L, error_funcs, 0);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
+    lua_pushcfunction(L, easydbus_error);
+
+    return 1;
+}
@@ -0,0 +1,19 @@
+/*
+ * Copyright 2016, Grinn
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+#include <gio/gio.h>
+
+void push_error(lua_State *L, const GError *error);
+void return_error(lua_State *L, int index, GDBusMethodInvocation *invocation);
+void set_gerror(lua_State *L, int index, GError **error);
+
+int luaopen_easydbus_error(lua_State *L);
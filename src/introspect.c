@@ -0,0 +1,360 @@
+/*
+ * Copyright 2016, Grinn
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "introspect.h"
+
+#include "bus.h"
+#include "compat.h"
+
+#include <string.h>
+
+/*
+ * Introspection data is cached per connection and state as name -> (path ->
+ * node). All entries of a name are dropped, when its owner changes. Owner
+ * changes are followed only for cached names. Peer connections have no bus
+ * daemon announcing owner changes, so nothing is cached there.
+ */
+#define INTROSPECT_CACHE "easydbus-introspect-cache"
+
+struct cache {
+    GHashTable *names;
+    GWeakRef conn;
+};
+
+struct cached_name {
+    struct cache *cache;
+    GHashTable *paths;
+    guint owner_changed_id;
+};
+
+static void name_owner_changed(GDBusConnection *conn,
+                               const gchar *sender_name,
+                               const gchar *object_path,
+                               const gchar *interface_name,
+                               const gchar *signal_name,
+                               GVariant *parameters,
+                               gpointer user_data)
+{
+    struct cache *cache = user_data;
+    const gchar *name;
+
+    g_variant_get(parameters, "(&s&s&s)", &name, NULL, NULL);
+
+    g_debug("%s: name=%s", __FUNCTION__, name);
+
+    g_hash_table_remove(cache->names, name);
+}
+
+/*
+ * Subscription of finalized connection is already gone, otherwise it is
+ * removed together with cached data.
+ */
+static void cached_name_free(gpointer user_data)
+{
+    struct cached_name *cached = user_data;
+    GDBusConnection *conn = g_weak_ref_get(&cached->cache->conn);
+
+    if (conn) {
+        g_dbus_connection_signal_unsubscribe(conn, cached->owner_changed_id);
+        g_object_unref(conn);
+    }
+
+    g_hash_table_unref(cached->paths);
+    g_free(cached);
+}
+
+/* Dropped together with connection, or earlier with its state */
+static void cache_free(gpointer user_data)
+{
+    struct cache *cache = user_data;
+
+    g_hash_table_unref(cache->names);
+    g_weak_ref_clear(&cache->conn);
+    g_free(cache);
+}
+
+static struct cache *get_cache(GDBusConnection *conn, struct easydbus_state *state)
+{
+    struct cache *cache = conn_data_get(conn, state, INTROSPECT_CACHE);
+
+    if (cache)
+        return cache;
+
+    cache = g_new(struct cache, 1);
+    cache->names = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, cached_name_free);
+    g_weak_ref_init(&cache->conn, conn);
+    conn_data_set(conn, state, INTROSPECT_CACHE, cache, cache_free);
+
+    return cache;
+}
+
+static gboolean cache_enabled(GDBusConnection *conn)
+{
+    return g_dbus_connection_get_unique_name(conn) != NULL;
+}
+
+static struct cached_name *lookup_name(GDBusConnection *conn, struct easydbus_state *state,
+                                       const gchar *name)
+{
+    struct cache *cache = conn_data_get(conn, state, INTROSPECT_CACHE);
+
+    return cache ? g_hash_table_lookup(cache->names, name) : NULL;
+}
+
+GDBusNodeInfo *introspect_lookup(GDBusConnection *conn, struct easydbus_state *state,
+                                 const gchar *name, const gchar *path)
+{
+    struct cached_name *cached = lookup_name(conn, state, name);
+    GDBusNodeInfo *node = cached ? g_hash_table_lookup(cached->paths, path) : NULL;
+
+    return node ? g_dbus_node_info_ref(node) : NULL;
+}
+
+/*
+ * Drops cached data of single path, or of all paths when path is NULL.
+ */
+void introspect_invalidate(GDBusConnection *conn, struct easydbus_state *state,
+                           const gchar *name, const gchar *path)
+{
+    struct cached_name *cached = lookup_name(conn, state, name);
+
+    g_debug("%s: name=%s path=%s", __FUNCTION__, name, path);
+
+    if (!cached)
+        return;
+
+    if (path)
+        g_hash_table_remove(cached->paths, path);
+    else
+        g_hash_table_remove(cached->cache->names, name);
+}
+
+static void cache_insert(GDBusConnection *conn, struct easydbus_state *state,
+                         const gchar *name, const gchar *path, GDBusNodeInfo *node)
+{
+    struct cache *cache;
+    struct cached_name *cached;
+
+    if (!cache_enabled(conn))
+        return;
+
+    cache = get_cache(conn, state);
+    cached = g_hash_table_lookup(cache->names, name);
+    if (!cached) {
+        cached = g_new(struct cached_name, 1);
+        cached->cache = cache;
+        cached->paths = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                              (GDestroyNotify) g_dbus_node_info_unref);
+        /* Bus daemon filters by arg0, so other owner changes do not wake us */
+        cached->owner_changed_id = g_dbus_connection_signal_subscribe(conn,
+                                                                      "org.freedesktop.DBus",
+                                                                      "org.freedesktop.DBus",
+                                                                      "NameOwnerChanged",
+                                                                      "/org/freedesktop/DBus",
+                                                                      name,
+                                                                      G_DBUS_SIGNAL_FLAGS_NONE,
+                                                                      name_owner_changed,
+                                                                      cache,
+                                                                      NULL);
+        g_hash_table_insert(cache->names, g_strdup(name), cached);
+    }
+
+    g_hash_table_insert(cached->paths, g_strdup(path), g_dbus_node_info_ref(node));
+}
+
+static GDBusNodeInfo *parse_reply(GVariant *result, GError **error)
+{
+    const gchar *xml_data;
+
+    g_variant_get(result, "(&s)", &xml_data);
+
+    return g_dbus_node_info_new_for_xml(xml_data, error);
+}
+
+GDBusNodeInfo *introspect_sync(GDBusConnection *conn, struct easydbus_state *state,
+                               const gchar *name, const gchar *path, GError **error)
+{
+    GDBusNodeInfo *node = introspect_lookup(conn, state, name, path);
+    GVariant *result;
+
+    if (node)
+        return node;
+
+    result = g_dbus_connection_call_sync(conn,
+                                         name,
+                                         path,
+                                         "org.freedesktop.DBus.Introspectable",
+                                         "Introspect",
+                                         NULL,
+                                         G_VARIANT_TYPE("(s)"),
+                                         G_DBUS_CALL_FLAGS_NONE,
+                                         -1,
+                                         NULL,
+                                         error);
+    if (!result)
+        return NULL;
+
+    node = parse_reply(result, error);
+    g_variant_unref(result);
+
+    if (node)
+        cache_insert(conn, state, name, path, node);
+
+    return node;
+}
+
+struct introspect_data {
+    struct easydbus_state *state;
+    gchar *name;
+    gchar *path;
+    introspect_cb callback;
+    gpointer user_data;
+};
+
+static void introspect_callback(GObject *source, GAsyncResult *res, gpointer user_data)
+{
+    struct introspect_data *data = user_data;
+    GDBusConnection *conn = G_DBUS_CONNECTION(source);
+    GDBusNodeInfo *node = NULL;
+    GError *error = NULL;
+    GVariant *result;
+
+    result = g_dbus_connection_call_finish(conn, res, &error);
+    if (result) {
+        node = parse_reply(result, &error);
+        g_variant_unref(result);
+    }
+
+    if (node)
+        cache_insert(conn, data->state, data->name, data->path, node);
+
+    data->callback(node, error, data->user_data);
+
+    if (node)
+        g_dbus_node_info_unref(node);
+    g_clear_error(&error);
+    g_free(data->name);
+    g_free(data->path);
+    g_free(data);
+}
+
+void introspect_async(GDBusConnection *conn, struct easydbus_state *state,
+                      const gchar *name, const gchar *path,
+                      introspect_cb callback, gpointer user_data)
+{
+    struct introspect_data *data = g_new(struct introspect_data, 1);
+
+    data->state = state;
+    data->name = g_strdup(name);
+    data->path = g_strdup(path);
+    data->callback = callback;
+    data->user_data = user_data;
+
+    g_dbus_connection_call(conn,
+                           name,
+                           path,
+                           "org.freedesktop.DBus.Introspectable",
+                           "Introspect",
+                           NULL,
+                           G_VARIANT_TYPE("(s)"),
+                           G_DBUS_CALL_FLAGS_NONE,
+                           -1,
+                           NULL,
+                           introspect_callback,
+                           data);
+}
+
+static void push_args_signature(lua_State *L, GDBusArgInfo **args)
+{
+    luaL_Buffer b;
+    int i;
+
+    luaL_buffinit(L, &b);
+    for (i = 0; args && args[i]; i++)
+        luaL_addstring(&b, args[i]->signature);
+    luaL_pushresult(&b);
+}
+
+static void push_interface_info(lua_State *L, GDBusInterfaceInfo *iface)
+{
+    GDBusPropertyInfo *prop;
+    int i;
+
+    lua_createtable(L, 0, 3);
+
+    lua_newtable(L);
+    for (i = 0; iface->methods && iface->methods[i]; i++) {
+        lua_createtable(L, 0, 2);
+        push_args_signature(L, iface->methods[i]->in_args);
+        lua_setfield(L, -2, "in_sig");
+        push_args_signature(L, iface->methods[i]->out_args);
+        lua_setfield(L, -2, "out_sig");
+        lua_setfield(L, -2, iface->methods[i]->name);
+    }
+    lua_setfield(L, -2, "methods");
+
+    lua_newtable(L);
+    for (i = 0; iface->signals && iface->signals[i]; i++) {
+        lua_createtable(L, 0, 1);
+        push_args_signature(L, iface->signals[i]->args);
+        lua_setfield(L, -2, "sig");
+        lua_setfield(L, -2, iface->signals[i]->name);
+    }
+    lua_setfield(L, -2, "signals");
+
+    lua_newtable(L);
+    for (i = 0; iface->properties && iface->properties[i]; i++) {
+        prop = iface->properties[i];
+        lua_createtable(L, 0, 2);
+        lua_pushstring(L, prop->signature);
+        lua_setfield(L, -2, "sig");
+        switch (prop->flags & (G_DBUS_PROPERTY_INFO_FLAGS_READABLE | G_DBUS_PROPERTY_INFO_FLAGS_WRITABLE)) {
+        case G_DBUS_PROPERTY_INFO_FLAGS_READABLE:
+            lua_pushliteral(L, "read");
+            break;
+        case G_DBUS_PROPERTY_INFO_FLAGS_WRITABLE:
+            lua_pushliteral(L, "write");
+            break;
+        case G_DBUS_PROPERTY_INFO_FLAGS_READABLE | G_DBUS_PROPERTY_INFO_FLAGS_WRITABLE:
+            lua_pushliteral(L, "readwrite");
+            break;
+        default:
+            lua_pushliteral(L, "none");
+        }
+        lua_setfield(L, -2, "access");
+        lua_setfield(L, -2, prop->name);
+    }
+    lua_setfield(L, -2, "properties");
+}
+
+/*
+ * {
+ *   interfaces = {[name] = {methods = {[name] = {in_sig =, out_sig =}},
+ *                           signals = {[name] = {sig =}},
+ *                           properties = {[name] = {sig =, access =}}}},
+ *   nodes = {child names ...},
+ * }
+ */
+void push_node_info(lua_State *L, GDBusNodeInfo *node)
+{
+    int i;
+
+    lua_createtable(L, 0, 2);
+
+    lua_newtable(L);
+    for (i = 0; node->interfaces && node->interfaces[i]; i++) {
+        push_interface_info(L, node->interfaces[i]);
+        lua_setfield(L, -2, node->interfaces[i]->name);
+    }
+    lua_setfield(L, -2, "interfaces");
+
+    lua_newtable(L);
+    for (i = 0; node->nodes && node->nodes[i]; i++) {
+        lua_pushstring(L, node->nodes[i]->path);
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_setfield(L, -2, "nodes");
+}
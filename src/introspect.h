@@ -0,0 +1,29 @@
+/*
+ * Copyright 2016, Grinn
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+#include <gio/gio.h>
+
+#include "easydbus.h"
+
+typedef void (*introspect_cb)(GDBusNodeInfo *node, GError *error, gpointer user_data);
+
+GDBusNodeInfo *introspect_lookup(GDBusConnection *conn, struct easydbus_state *state,
+                                 const gchar *name, const gchar *path);
+void introspect_invalidate(GDBusConnection *conn, struct easydbus_state *state,
+                           const gchar *name, const gchar *path);
+GDBusNodeInfo *introspect_sync(GDBusConnection *conn, struct easydbus_state *state,
+                               const gchar *name, const gchar *path, GError **error);
+void introspect_async(GDBusConnection *conn, struct easydbus_state *state,
+                      const gchar *name, const gchar *path,
+                      introspect_cb callback, gpointer user_data);
+
+void push_node_info(lua_State *L, GDBusNodeInfo *node);
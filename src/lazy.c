@@ -0,0 +1,293 @@
+/*
+ * Copyright 2016, Grinn
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "lazy.h"
+
+#include "compat.h"
+#include "utils.h"
+
+#include <string.h>
+
+static int lazy_mt;
+#define LAZY_MT ((void *) &lazy_mt)
+
+/* Key of dictionary index (key -> position) in proxy cache */
+static int lazy_index;
+#define LAZY_INDEX ((void *) &lazy_index)
+
+static inline gboolean is_dict(GVariant *value)
+{
+    const gchar *sig = g_variant_get_type_string(value);
+
+    return sig[0] == 'a' && sig[1] == '{';
+}
+
+void push_lazy(lua_State *L, GVariant *value, GUnixFDList *fd_list, guint flags)
+{
+    struct lazy *lazy = lua_newuserdata(L, sizeof(*lazy));
+
+    lazy->value = g_variant_ref(value);
+    lazy->fd_list = fd_list ? g_object_ref(fd_list) : NULL;
+    lazy->flags = flags;
+
+    lua_pushlightuserdata(L, LAZY_MT);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_setmetatable(L, -2);
+
+    /* Cache of already pushed children */
+    lua_newtable(L);
+    lua_setuservalue(L, -2);
+}
+
+struct lazy *lazy_test(lua_State *L, int index)
+{
+    struct lazy *lazy = lua_touserdata(L, index);
+
+    if (lua_type(L, index) != LUA_TUSERDATA || !lua_getmetatable(L, index))
+        return NULL;
+
+    lua_pushlightuserdata(L, LAZY_MT);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    if (!lua_rawequal(L, -1, -2))
+        lazy = NULL;
+    lua_pop(L, 2);
+
+    return lazy;
+}
+
+/*
+ * Push dictionary index of proxy, building it on first use. Only keys, which
+ * are basic types, are pushed.
+ */
+static void push_index(lua_State *L, struct lazy *lazy, int cache)
+{
+    GVariant *entry, *key;
+    gsize n, i;
+
+    lua_pushlightuserdata(L, LAZY_INDEX);
+    lua_rawget(L, cache);
+    if (!lua_isnil(L, -1))
+        return;
+    lua_pop(L, 1);
+
+    n = g_variant_n_children(lazy->value);
+    lua_createtable(L, 0, n);
+    for (i = 0; i < n; i++) {
+        entry = g_variant_get_child_value(lazy->value, i);
+        key = g_variant_get_child_value(entry, 0);
+        push_variant(L, key, lazy->fd_list, lazy->flags);
+        lua_pushinteger(L, i);
+        lua_rawset(L, -3);
+        g_variant_unref(key);
+        g_variant_unref(entry);
+    }
+
+    lua_pushlightuserdata(L, LAZY_INDEX);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, cache);
+}
+
+/*
+ * Returns position of child with Lua key at given index or -1.
+ */
+static gssize child_position(lua_State *L, struct lazy *lazy, int key, int cache)
+{
+    gssize pos = -1;
+    lua_Integer i;
+
+    if (is_dict(lazy->value)) {
+        push_index(L, lazy, cache);
+        lua_pushvalue(L, key);
+        lua_rawget(L, -2);
+        if (!lua_isnil(L, -1))
+            pos = lua_tointeger(L, -1);
+        lua_pop(L, 2);
+    } else if (lua_type(L, key) == LUA_TNUMBER && lua_isinteger(L, key)) {
+        i = lua_tointeger(L, key);
+        if (i >= 1 && (gsize) i <= g_variant_n_children(lazy->value))
+            pos = i - 1;
+    }
+
+    return pos;
+}
+
+/*
+ * Push child value at position and store it in cache under key.
+ */
+static void push_child(lua_State *L, struct lazy *lazy, gsize pos, int key, int cache)
+{
+    GVariant *child, *entry;
+
+    child = g_variant_get_child_value(lazy->value, pos);
+    if (is_dict(lazy->value)) {
+        entry = child;
+        child = g_variant_get_child_value(entry, 1);
+        g_variant_unref(entry);
+    }
+
+    push_variant(L, child, lazy->fd_list, lazy->flags);
+    g_variant_unref(child);
+
+    lua_pushvalue(L, key);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, cache);
+}
+
+/*
+ * Args:
+ * 1) value
+ *
+ * Converts proxy to Lua tables recursively. Other values are returned as is.
+ */
+static int lazy_totable(lua_State *L)
+{
+    struct lazy *lazy = lazy_test(L, 1);
+
+    luaL_checkany(L, 1);
+
+    if (!lazy) {
+        lua_settop(L, 1);
+        return 1;
+    }
+
+    push_variant(L, lazy->value, lazy->fd_list, lazy->flags & ~DECODE_LAZY);
+    return 1;
+}
+
+/*
+ * Dictionary keys take precedence over totable() method.
+ */
+static int lazy__index(lua_State *L)
+{
+    struct lazy *lazy = lua_touserdata(L, 1);
+    gssize pos;
+
+    lua_settop(L, 2);
+    lua_getuservalue(L, 1);
+
+    lua_pushvalue(L, 2);
+    lua_rawget(L, 3);
+    if (!lua_isnil(L, -1))
+        return 1;
+    lua_pop(L, 1);
+
+    pos = child_position(L, lazy, 2, 3);
+    if (pos >= 0) {
+        push_child(L, lazy, pos, 2, 3);
+        return 1;
+    }
+
+    if (lua_type(L, 2) == LUA_TSTRING && !strcmp(lua_tostring(L, 2), "totable")) {
+        lua_pushcfunction(L, lazy_totable);
+        return 1;
+    }
+
+    lua_pushnil(L);
+    return 1;
+}
+
+static int lazy__len(lua_State *L)
+{
+    struct lazy *lazy = lua_touserdata(L, 1);
+
+    lua_pushinteger(L, g_variant_n_children(lazy->value));
+    return 1;
+}
+
+/*
+ * Args:
+ * 1) proxy
+ * 2) previous key or nil
+ */
+static int lazy_next(lua_State *L)
+{
+    struct lazy *lazy = lua_touserdata(L, 1);
+    gssize pos = -1;
+    GVariant *entry, *key;
+
+    lua_settop(L, 2);
+    lua_getuservalue(L, 1);
+
+    if (!lua_isnil(L, 2)) {
+        pos = child_position(L, lazy, 2, 3);
+        if (pos < 0)
+            return luaL_error(L, "invalid key to 'next'");
+    }
+
+    pos++;
+    if ((gsize) pos >= g_variant_n_children(lazy->value)) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    if (is_dict(lazy->value)) {
+        entry = g_variant_get_child_value(lazy->value, pos);
+        key = g_variant_get_child_value(entry, 0);
+        push_variant(L, key, lazy->fd_list, lazy->flags);
+        g_variant_unref(key);
+        g_variant_unref(entry);
+    } else {
+        lua_pushinteger(L, pos + 1);
+    }
+
+    lua_pushvalue(L, 4);
+    lua_rawget(L, 3);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        push_child(L, lazy, pos, 4, 3);
+    }
+
+    return 2;
+}
+
+static int lazy__pairs(lua_State *L)
+{
+    lua_pushcfunction(L, lazy_next);
+    lua_pushvalue(L, 1);
+    lua_pushnil(L);
+    return 3;
+}
+
+static int lazy__tostring(lua_State *L)
+{
+    struct lazy *lazy = lua_touserdata(L, 1);
+
+    lua_pushfstring(L, "<dbus lazy '%s'>: %p", g_variant_get_type_string(lazy->value), (void *) lazy);
+    return 1;
+}
+
+static int lazy__gc(lua_State *L)
+{
+    struct lazy *lazy = lua_touserdata(L, 1);
+
+    g_variant_unref(lazy->value);
+    if (lazy->fd_list)
+        g_object_unref(lazy->fd_list);
+
+    return 0;
+}
+
+static luaL_Reg lazy_funcs[] = {
+    {"__index", lazy__index},
+    {"__len", lazy__len},
+    {"__pairs", lazy__pairs},
+    {"__tostring", lazy__tostring},
+    {"__gc", lazy__gc},
+    {NULL, NULL},
+};
+
+int luaopen_easydbus_lazy(lua_State *L)
+{
+    /* Set lazy mt in registry */
+    lua_pushlightuserdata(L, LAZY_MT);
+    luaL_newlibtable(L, lazy_funcs);
+    luaL_setfuncs(L, lazy_funcs, 0);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
+    lua_pushcfunction(L, lazy_totable);
+
+    return 1;
+}
@@ -0,0 +1,29 @@
+/*
+ * Copyright 2016, Grinn
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+#include <gio/gio.h>
+#include <gio/gunixfdlist.h>
+
+/*
+ * Proxy over received container value. Children are pushed to Lua only when
+ * accessed and then cached in proxy's user value.
+ */
+struct lazy {
+    GVariant *value;
+    GUnixFDList *fd_list;
+    guint flags;
+};
+
+void push_lazy(lua_State *L, GVariant *value, GUnixFDList *fd_list, guint flags);
+struct lazy *lazy_test(lua_State *L, int index);
+
+int luaopen_easydbus_lazy(lua_State *L);
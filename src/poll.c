@@ -7,7 +7,10 @@
 #include "compat.h"
 #include "poll.h"
 
+#include <errno.h>
+#include <string.h>
 #include <sys/epoll.h>
+#include <unistd.h>
 
 static int gio_to_epoll(int gio_events)
 {
@@ -39,7 +42,7 @@ static int epoll_to_gio(int epoll_events)
         gio_events |= G_IO_PRI;
     if (epoll_events & EPOLLERR)
         gio_events |= G_IO_ERR;
-    if (epoll_events & EPOLLIN)
+    if (epoll_events & EPOLLHUP)
         gio_events |= G_IO_HUP;
 
     return gio_events;
@@ -48,15 +51,8 @@ static int epoll_to_gio(int epoll_events)
 void gpoll_dispatch(struct easydbus_state *state)
 {
     gboolean some_ready;
-    int i;
-
-    g_debug("%s", __FUNCTION__);
 
-    for (i = 0; i < state->nfds; i++) {
-        g_debug("fd = %d", state->fds[i].fd);
-        g_debug("events = %d", state->fds[i].events);
-        g_debug("revents = %d", state->fds[i].revents);
-    }
+    g_debug("%s: nfds = %d", __FUNCTION__, (int) state->nfds);
 
     some_ready = g_main_context_check(state->context, state->max_priority, state->fds, state->nfds);
     g_debug("%s: some_ready = %d", __FUNCTION__, (int) some_ready);
@@ -89,76 +85,252 @@ static void gpoll_prepare(struct easydbus_state *state)
     g_debug("after: %p %d %p %d", (void *) state->context, (int) state->max_priority, (void *) state->fds, (int) state->allocated_nfds);
 }
 
-static void push_epoll_fds(lua_State *L, struct easydbus_state *state)
+struct epoll_entry {
+    int fd;
+    guint32 events;
+};
+
+static gint epoll_entry_compare(gconstpointer a, gconstpointer b)
 {
-    int i;
-    int events;
+    const struct epoll_entry *ea = a;
+    const struct epoll_entry *eb = b;
 
-    lua_createtable(L, state->nfds, 0);
-    for (i = 0; i < state->nfds; i++) {
-        lua_createtable(L, 0, 2);
-        lua_pushnumber(L, state->fds[i].fd);
-        lua_setfield(L, -2, "fd");
+    return ea->fd - eb->fd;
+}
+
+/*
+ * Collects polled fds into array sorted by fd. Sources polling the same fd
+ * are merged, as epoll accepts every fd only once.
+ */
+static void epoll_collect(struct easydbus_state *state, GArray *set)
+{
+    struct epoll_entry *entries;
+    int i, n = 0;
+
+    g_array_set_size(set, state->nfds);
+    entries = (struct epoll_entry *) set->data;
 
-        events = gio_to_epoll(state->fds[i].events);
+    for (i = 0; i < state->nfds; i++) {
+        entries[i].fd = state->fds[i].fd;
+        entries[i].events = gio_to_epoll(state->fds[i].events);
+    }
 
-        lua_pushnumber(L, events);
-        lua_setfield(L, -2, "events");
+    g_array_sort(set, epoll_entry_compare);
 
-        lua_rawseti(L, -2, i + 1);
+    for (i = 0; i < state->nfds; i++) {
+        if (n && entries[n - 1].fd == entries[i].fd)
+            entries[n - 1].events |= entries[i].events;
+        else
+            entries[n++] = entries[i];
     }
 
-    lua_pushinteger(L, state->timeout);
+    g_array_set_size(set, n);
 }
 
-void update_epoll(lua_State *L, struct easydbus_state *state)
+static void epoll_ctl_entry(struct easydbus_state *state, int op, const struct epoll_entry *entry)
 {
-    int cb_args;
-    int cb_index;
-    int i;
+    struct epoll_event event;
 
-    g_debug("update_epoll %d", state->ref_cb);
+    g_debug("%s: op=%d fd=%d events=%u", __FUNCTION__, op, entry->fd, (unsigned) entry->events);
 
-    if (state->ref_cb >= 0) {
-        lua_rawgeti(L, LUA_REGISTRYINDEX, state->ref_cb);
+    event.events = entry->events;
+    event.data.fd = entry->fd;
 
-        cb_args = lua_rawlen(L, -1);
-        cb_index = lua_gettop(L);
+    if (!epoll_ctl(state->epoll_fd, op, entry->fd, &event))
+        return;
 
-        for (i = 1; i <= cb_args; i++) {
-            lua_rawgeti(L, cb_index, i);
-        }
+    /* Fd is still registered from previous set */
+    if (op == EPOLL_CTL_ADD && errno == EEXIST &&
+        !epoll_ctl(state->epoll_fd, EPOLL_CTL_MOD, entry->fd, &event))
+        return;
 
-        gpoll_prepare(state);
-        push_epoll_fds(L, state);
+    /* Closed fds are removed from epoll set by kernel */
+    if (op == EPOLL_CTL_DEL && (errno == ENOENT || errno == EBADF))
+        return;
 
-        lua_pcall(L, cb_args + 1, 0, 0);
-    } else {
-        g_warning("epoll callback is not set");
+    g_warning("epoll_ctl(%d, %d) failed: %s", op, entry->fd, g_strerror(errno));
+}
+
+/*
+ * Maps fd to index of its first entry in polled fds. Entries with the same fd
+ * are chained in fd_next.
+ */
+static void fd_index_rebuild(struct easydbus_state *state)
+{
+    gpointer first;
+    int i;
+
+    g_hash_table_remove_all(state->fd_index);
+    g_array_set_size(state->fd_next, state->nfds);
+
+    for (i = state->nfds - 1; i >= 0; i--) {
+        first = g_hash_table_lookup(state->fd_index, GINT_TO_POINTER(state->fds[i].fd));
+        g_array_index(state->fd_next, gint, i) = first ? GPOINTER_TO_INT(first) - 1 : -1;
+        g_hash_table_insert(state->fd_index, GINT_TO_POINTER(state->fds[i].fd),
+                            GINT_TO_POINTER(i + 1));
     }
 }
 
-void gpoll_fds_clear(struct easydbus_state *state)
+/*
+ * Applies current fd set to epoll fd, so nothing is done when fd set did not
+ * change. Otherwise fds which are not polled anymore are removed and all
+ * others are added again, as fd closed and reopened with the same number is
+ * silently dropped from epoll set.
+ */
+static void epoll_sync(struct easydbus_state *state)
+{
+    GArray *old = state->epoll_set;
+    GArray *new = state->epoll_next;
+    struct epoll_entry *o, *n;
+    guint i = 0, j = 0;
+    GArray *tmp;
+
+    /* Query result is the same as before, so are indexes of fds */
+    if (state->prev_fds->len == (guint) state->nfds &&
+        !memcmp(state->prev_fds->data, state->fds, state->nfds * sizeof(GPollFD)))
+        return;
+
+    g_array_set_size(state->prev_fds, 0);
+    g_array_append_vals(state->prev_fds, state->fds, state->nfds);
+
+    fd_index_rebuild(state);
+
+    epoll_collect(state, new);
+
+    while (i < old->len || j < new->len) {
+        o = i < old->len ? &g_array_index(old, struct epoll_entry, i) : NULL;
+        n = j < new->len ? &g_array_index(new, struct epoll_entry, j) : NULL;
+
+        if (o && (!n || o->fd < n->fd)) {
+            epoll_ctl_entry(state, EPOLL_CTL_DEL, o);
+            i++;
+        } else {
+            epoll_ctl_entry(state, EPOLL_CTL_ADD, n);
+            if (o && o->fd == n->fd)
+                i++;
+            j++;
+        }
+    }
+
+    tmp = state->epoll_set;
+    state->epoll_set = state->epoll_next;
+    state->epoll_next = tmp;
+}
+
+/*
+ * Creates epoll fd which is watched by host event loop instead of separate
+ * fds of main context.
+ */
+gboolean gpoll_init(struct easydbus_state *state)
+{
+    if (state->epoll_fd >= 0)
+        return TRUE;
+
+    state->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (state->epoll_fd < 0)
+        return FALSE;
+
+    state->epoll_set = g_array_new(FALSE, FALSE, sizeof(struct epoll_entry));
+    state->epoll_next = g_array_new(FALSE, FALSE, sizeof(struct epoll_entry));
+    state->epoll_timeout = -2;
+    state->prev_fds = g_array_new(FALSE, FALSE, sizeof(GPollFD));
+    state->fd_index = g_hash_table_new(NULL, NULL);
+    state->fd_next = g_array_new(FALSE, FALSE, sizeof(gint));
+
+    return TRUE;
+}
+
+void gpoll_free(struct easydbus_state *state)
+{
+    if (state->epoll_fd < 0)
+        return;
+
+    close(state->epoll_fd);
+    state->epoll_fd = -1;
+
+    g_array_free(state->epoll_set, TRUE);
+    g_array_free(state->epoll_next, TRUE);
+    g_array_free(state->prev_fds, TRUE);
+    g_hash_table_unref(state->fd_index);
+    g_array_free(state->fd_next, TRUE);
+}
+
+/*
+ * Sets revents of all polled fds matching ready fd. Fds which are not polled
+ * anymore are ignored.
+ */
+static void fds_set(struct easydbus_state *state, int fd, guint32 revents)
 {
+    gpointer first = g_hash_table_lookup(state->fd_index, GINT_TO_POINTER(fd));
+    gushort gio_revents = epoll_to_gio(revents);
     int i;
 
-    for (i = 0; i < state->nfds; i++) {
-        state->fds[i].revents = 0;
+    if (!first) {
+        g_debug("%s: stale fd=%d", __FUNCTION__, fd);
+        return;
     }
+
+    for (i = GPOINTER_TO_INT(first) - 1; i >= 0; i = g_array_index(state->fd_next, gint, i))
+        state->fds[i].revents = gio_revents & (state->fds[i].events | G_IO_ERR | G_IO_HUP | G_IO_NVAL);
 }
 
-void gpoll_fds_set(struct easydbus_state *state, int fd, int revents)
+/*
+ * Reads all ready fds from epoll fd into revents of polled fds. Revents of
+ * other fds are already cleared by g_main_context_query().
+ */
+void gpoll_fds_read(struct easydbus_state *state)
 {
+    struct epoll_event events[64];
+    int i, n;
+
+    n = epoll_wait(state->epoll_fd, events, G_N_ELEMENTS(events), 0);
+    if (n < 0) {
+        g_warning("epoll_wait failed: %s", g_strerror(errno));
+        return;
+    }
+
+    for (i = 0; i < n; i++)
+        fds_set(state, events[i].data.fd, events[i].events);
+}
+
+/*
+ * Prepares next main context iteration and updates epoll fd. Callback is
+ * called with epoll fd and timeout, unless there is still no timeout. Timers
+ * of host loop are one-shot, so finite timeouts are always reported.
+ */
+void update_epoll(lua_State *L, struct easydbus_state *state)
+{
+    int cb_args;
+    int cb_index;
     int i;
 
-    for (i = 0; i < state->nfds; i++) {
-        if (state->fds[i].fd == fd) {
-            g_debug("Found FD=%d, setting revents=%d", (int) fd, (int) revents);
-            state->fds[i].revents = epoll_to_gio(revents);
-            break;
-        }
+    g_debug("update_epoll %d", state->ref_cb);
+
+    if (state->ref_cb < 0) {
+        g_warning("epoll callback is not set");
+        return;
+    }
+
+    gpoll_prepare(state);
+    epoll_sync(state);
+
+    if (state->timeout == -1 && state->epoll_timeout == -1)
+        return;
+
+    state->epoll_timeout = state->timeout;
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, state->ref_cb);
+
+    cb_args = lua_rawlen(L, -1);
+    cb_index = lua_gettop(L);
+
+    for (i = 1; i <= cb_args; i++) {
+        lua_rawgeti(L, cb_index, i);
     }
 
-    if (i >= state->nfds)
-        g_error("Didn't found FD");
+    lua_pushinteger(L, state->epoll_fd);
+    lua_pushinteger(L, state->timeout);
+
+    lua_pcall(L, cb_args + 1, 0, 0);
+    lua_settop(L, cb_index - 1);
 }
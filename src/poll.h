@@ -8,7 +8,8 @@
 
 #include "easydbus.h"
 
+gboolean gpoll_init(struct easydbus_state *state);
+void gpoll_free(struct easydbus_state *state);
 void gpoll_dispatch(struct easydbus_state *state);
+void gpoll_fds_read(struct easydbus_state *state);
 void update_epoll(lua_State *L, struct easydbus_state *state);
-void gpoll_fds_clear(struct easydbus_state *state);
-void gpoll_fds_set(struct easydbus_state *state, int fd, int revents);
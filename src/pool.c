@@ -0,0 +1,276 @@
+/*
+ * Copyright 2016, Grinn
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#define LUA_LIB
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+#include "pool.h"
+
+#include "bus.h"
+#include "compat.h"
+#include "easydbus.h"
+#include "threads.h"
+
+static int pool_stop;
+#define POOL_STOP ((gpointer) &pool_stop)
+
+/*
+ * Object registered in pool context, which is iterated by dispatcher thread.
+ * Invocations are queued there and picked by first idle worker.
+ */
+struct pool {
+    GMainContext *context;
+    GMainLoop *loop;
+    GAsyncQueue *queue;
+    guint n_workers;
+};
+
+/* Owned by worker thread */
+struct worker {
+    GAsyncQueue *queue;
+    gchar *module;
+    gchar *lua_path;
+    gchar *lua_cpath;
+};
+
+static void worker_free(struct worker *worker)
+{
+    g_async_queue_unref(worker->queue);
+    g_free(worker->module);
+    g_free(worker->lua_path);
+    g_free(worker->lua_cpath);
+    g_free(worker);
+}
+
+static void set_package_path(lua_State *L, const char *field, const gchar *value)
+{
+    if (!value)
+        return;
+
+    lua_getglobal(L, "package");
+    lua_pushstring(L, value);
+    lua_setfield(L, -2, field);
+    lua_pop(L, 1);
+}
+
+static int require(lua_State *L, const char *module)
+{
+    lua_getglobal(L, "require");
+    lua_pushstring(L, module);
+    return lua_pcall(L, 1, 1, 0);
+}
+
+/*
+ * Loads easydbus on its own main context and then handler module, which
+ * returns object. Leaves state and methods table of object on stack.
+ */
+static int worker_load(lua_State *L)
+{
+    struct worker *worker = lua_touserdata(L, 1);
+    struct easydbus_state *state;
+
+    if (require(L, "easydbus.core"))
+        lua_error(L);
+
+    lua_getfield(L, -1, "own_context");
+    lua_call(L, 0, 0);
+
+    state = easydbus_get_state(L);
+    if (!state)
+        luaL_error(L, "easydbus state not found");
+
+    if (require(L, worker->module))
+        lua_error(L);
+    if (!lua_istable(L, -1))
+        luaL_error(L, "module %s does not return object", worker->module);
+
+    lua_getfield(L, -1, "methods");
+    if (!lua_istable(L, -1))
+        luaL_error(L, "module %s does not return object", worker->module);
+
+    /* Returned as state, methods */
+    lua_pushlightuserdata(L, state);
+    lua_insert(L, -2);
+
+    return 2;
+}
+
+static gpointer worker_run(gpointer user_data)
+{
+    struct worker *worker = user_data;
+    struct easydbus_state *state = NULL;
+    GDBusMethodInvocation *invocation;
+    lua_State *L, *T;
+    int ref = LUA_NOREF;
+
+    L = luaL_newstate();
+    luaL_openlibs(L);
+    set_package_path(L, "path", worker->lua_path);
+    set_package_path(L, "cpath", worker->lua_cpath);
+
+    lua_pushcfunction(L, worker_load);
+    lua_pushlightuserdata(L, worker);
+    if (lua_pcall(L, 1, 2, 0)) {
+        g_warning("Worker failed to load %s: %s", worker->module, lua_tostring(L, -1));
+    } else {
+        ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        state = lua_touserdata(L, -1);
+    }
+    lua_settop(L, 0);
+
+    while ((invocation = g_async_queue_pop(worker->queue)) != POOL_STOP) {
+        if (!state) {
+            g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR,
+                                                  G_DBUS_ERROR_FAILED,
+                                                  "Worker failed to load %s", worker->module);
+            continue;
+        }
+
+        T = thread_acquire(state);
+
+        lua_rawgeti(T, LUA_REGISTRYINDEX, ref);
+        invoke_method(state, T,
+                      g_dbus_method_invocation_get_method_name(invocation),
+                      g_dbus_method_invocation_get_parameters(invocation),
+                      invocation);
+
+        thread_release(state, T);
+
+        /* Dispatch whatever handler has scheduled, without waiting */
+        while (g_main_context_iteration(state->context, FALSE));
+    }
+
+    g_debug("%s: worker done", __FUNCTION__);
+
+    lua_close(L);
+    worker_free(worker);
+
+    return NULL;
+}
+
+static void pool_method_call(GDBusConnection *connection,
+                             const gchar *sender,
+                             const gchar *object_path,
+                             const gchar *interface_name,
+                             const gchar *method_name,
+                             GVariant *parameters,
+                             GDBusMethodInvocation *invocation,
+                             gpointer user_data)
+{
+    struct pool *pool = user_data;
+
+    g_debug("%s: sender=%s object_path=%s method_name=%s",
+            __FUNCTION__, sender, object_path, method_name);
+
+    /* Reference is passed to worker, which returns from method */
+    g_async_queue_push(pool->queue, invocation);
+}
+
+static const GDBusInterfaceVTable pool_vtable = {
+    pool_method_call,
+    NULL,
+    NULL,
+    {0}
+};
+
+/*
+ * Workers finish queued invocations before they stop.
+ */
+static void pool_stop_workers(struct pool *pool)
+{
+    guint i;
+
+    for (i = 0; i < pool->n_workers; i++)
+        g_async_queue_push(pool->queue, POOL_STOP);
+}
+
+static void pool_destroy(struct pool *pool)
+{
+    g_main_loop_unref(pool->loop);
+    g_main_context_unref(pool->context);
+    g_async_queue_unref(pool->queue);
+    g_free(pool);
+}
+
+static gpointer pool_dispatch(gpointer user_data)
+{
+    struct pool *pool = user_data;
+
+    g_main_context_push_thread_default(pool->context);
+    g_main_loop_run(pool->loop);
+    g_main_context_pop_thread_default(pool->context);
+
+    g_debug("%s: pool done", __FUNCTION__);
+
+    pool_destroy(pool);
+
+    return NULL;
+}
+
+/*
+ * Called in pool context once object is unregistered.
+ */
+static void pool_free(gpointer user_data)
+{
+    struct pool *pool = user_data;
+
+    g_debug("%s: %p", __FUNCTION__, user_data);
+
+    pool_stop_workers(pool);
+    g_main_loop_quit(pool->loop);
+}
+
+/*
+ * Registers object, which methods are handled by n_workers Lua states, each
+ * running on its own thread. Object is unregistered as any other.
+ */
+guint pool_register(GDBusConnection *conn, const gchar *object_path,
+                    GDBusInterfaceInfo *interface_info,
+                    const struct pool_options *opts, GError **error)
+{
+    struct pool *pool;
+    struct worker *worker;
+    guint i, reg_id;
+
+    pool = g_new0(struct pool, 1);
+    pool->context = g_main_context_new();
+    pool->loop = g_main_loop_new(pool->context, FALSE);
+    pool->queue = g_async_queue_new();
+    pool->n_workers = opts->n_workers;
+
+    for (i = 0; i < pool->n_workers; i++) {
+        worker = g_new0(struct worker, 1);
+        worker->queue = g_async_queue_ref(pool->queue);
+        worker->module = g_strdup(opts->module);
+        worker->lua_path = g_strdup(opts->lua_path);
+        worker->lua_cpath = g_strdup(opts->lua_cpath);
+
+        g_thread_unref(g_thread_new("easydbus-worker", worker_run, worker));
+    }
+
+    /* Method calls are dispatched in pool context */
+    g_main_context_push_thread_default(pool->context);
+    reg_id = g_dbus_connection_register_object(conn,
+                                               object_path,
+                                               interface_info,
+                                               &pool_vtable,
+                                               pool, /* user_data */
+                                               pool_free,
+                                               error);
+    g_main_context_pop_thread_default(pool->context);
+
+    if (!reg_id) {
+        pool_stop_workers(pool);
+        pool_destroy(pool);
+        return 0;
+    }
+
+    g_thread_unref(g_thread_new("easydbus-pool", pool_dispatch, pool));
+
+    return reg_id;
+}
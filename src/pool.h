@@ -0,0 +1,23 @@
+/*
+ * Copyright 2016, Grinn
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+/* Each worker is a thread with own Lua state */
+#define POOL_WORKERS_PER_CPU 4
+
+struct pool_options {
+    const gchar *module;
+    guint n_workers;
+    const gchar *lua_path;
+    const gchar *lua_cpath;
+};
+
+guint pool_register(GDBusConnection *conn, const gchar *object_path,
+                    GDBusInterfaceInfo *interface_info,
+                    const struct pool_options *opts, GError **error);
@@ -0,0 +1,197 @@
+/*
+ * Copyright 2016, Grinn
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "proxy.h"
+
+#include "bus.h"
+#include "compat.h"
+#include "easydbus.h"
+#include "signature.h"
+
+/*
+ * Proxy holds names validated and copied once, so calls through it do no
+ * per call validation.
+ */
+struct proxy {
+    GDBusConnection *conn;
+    gchar *bus_name;
+    gchar *object_path;
+};
+
+struct proxy_method {
+    gchar *interface_name;
+    gchar *method_name;
+    const struct signature *in_sig;
+    const GVariantType *reply_type;
+};
+
+static int proxy_mt;
+#define PROXY_MT ((void *) &proxy_mt)
+
+static int proxy_method_mt;
+#define PROXY_METHOD_MT ((void *) &proxy_method_mt)
+
+static void *check_udata(lua_State *L, int index, void *mt, const char *msg)
+{
+    void *udata = lua_touserdata(L, index);
+
+    if (udata && lua_getmetatable(L, index)) {
+        lua_pushlightuserdata(L, mt);
+        lua_rawget(L, LUA_REGISTRYINDEX);
+        if (lua_rawequal(L, -1, -2)) {
+            lua_pop(L, 2);
+            return udata;
+        }
+        lua_pop(L, 2);
+    }
+
+    luaL_argerror(L, index, msg);
+    return NULL;
+}
+
+/*
+ * Args:
+ * 1) bus
+ * 2) bus_name
+ * 3) object_path
+ */
+static int proxy_new(lua_State *L)
+{
+    const char *bus_name = luaL_checkstring(L, 2);
+    const char *object_path = luaL_checkstring(L, 3);
+    struct proxy *proxy;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    luaL_argcheck(L, g_dbus_is_name(bus_name), 2, "Invalid bus name");
+    luaL_argcheck(L, g_variant_is_object_path(object_path), 3, "Invalid object path");
+
+    proxy = lua_newuserdata(L, sizeof(*proxy));
+    lua_rawgeti(L, 1, 1);
+    proxy->conn = g_object_ref(lua_touserdata(L, -1));
+    lua_pop(L, 1);
+    proxy->bus_name = g_strdup(bus_name);
+    proxy->object_path = g_strdup(object_path);
+
+    lua_pushlightuserdata(L, PROXY_MT);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_setmetatable(L, -2);
+
+    return 1;
+}
+
+static int proxy__gc(lua_State *L)
+{
+    struct proxy *proxy = lua_touserdata(L, 1);
+
+    g_object_unref(proxy->conn);
+    g_free(proxy->bus_name);
+    g_free(proxy->object_path);
+
+    return 0;
+}
+
+static int proxy_method__gc(lua_State *L)
+{
+    struct proxy_method *method = lua_touserdata(L, 1);
+
+    g_free(method->interface_name);
+    g_free(method->method_name);
+
+    return 0;
+}
+
+/*
+ * Args:
+ * 1) method_name
+ * 2) interface_name
+ * 3) in signature (nil or false to guess from values)
+ * 4) out signature (optional, checked against reply)
+ */
+static int proxy_method(lua_State *L)
+{
+    const char *method_name = luaL_checkstring(L, 1);
+    const char *interface_name = luaL_checkstring(L, 2);
+    const struct signature *in_sig = signature_check(L, 3);
+    const struct signature *out_sig = signature_check(L, 4);
+    struct proxy_method *method;
+
+    luaL_argcheck(L, g_dbus_is_member_name(method_name), 1, "Invalid method name");
+    luaL_argcheck(L, g_dbus_is_interface_name(interface_name), 2, "Invalid interface name");
+
+    method = lua_newuserdata(L, sizeof(*method));
+    method->method_name = g_strdup(method_name);
+    method->interface_name = g_strdup(interface_name);
+    method->in_sig = in_sig;
+    method->reply_type = out_sig ? G_VARIANT_TYPE(out_sig->tuple.sig) : NULL;
+
+    lua_pushlightuserdata(L, PROXY_METHOD_MT);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_setmetatable(L, -2);
+
+    return 1;
+}
+
+/*
+ * Args:
+ * 1) proxy
+ * 2) method
+ * 3) parameters ...
+ * last-1) callback
+ * last) callback_arg
+ */
+static int proxy_call(lua_State *L)
+{
+    struct easydbus_state *state = lua_touserdata(L, lua_upvalueindex(1));
+    struct proxy *proxy = check_udata(L, 1, PROXY_MT, "proxy expected");
+    struct proxy_method *method = check_udata(L, 2, PROXY_METHOD_MT, "proxy method expected");
+    struct call_options opts = {
+        .no_reply = FALSE,
+        .flags = G_DBUS_CALL_FLAGS_NONE,
+        .timeout = -1,
+        .reply_type = method->reply_type,
+        .cancellable = NULL,
+    };
+    struct call call = {
+        .conn = proxy->conn,
+        .bus_name = proxy->bus_name,
+        .object_path = proxy->object_path,
+        .interface_name = method->interface_name,
+        .method_name = method->method_name,
+        .sig = method->in_sig,
+    };
+
+    return do_call(L, state, &call, &opts, 3);
+}
+
+static luaL_Reg proxy_funcs[] = {
+    {"new", proxy_new},
+    {"method", proxy_method},
+    {"call", proxy_call},
+    {NULL, NULL},
+};
+
+int luaopen_easydbus_proxy(lua_State *L)
+{
+    /* Set proxy mt in registry */
+    lua_pushlightuserdata(L, PROXY_MT);
+    lua_createtable(L, 0, 1);
+    lua_pushcfunction(L, proxy__gc);
+    lua_setfield(L, -2, "__gc");
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
+    /* Set proxy method mt in registry */
+    lua_pushlightuserdata(L, PROXY_METHOD_MT);
+    lua_createtable(L, 0, 1);
+    lua_pushcfunction(L, proxy_method__gc);
+    lua_setfield(L, -2, "__gc");
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
+    luaL_newlibtable(L, proxy_funcs);
+    lua_pushvalue(L, 1);
+    luaL_setfuncs(L, proxy_funcs, 1);
+
+    return 1;
+}
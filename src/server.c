@@ -0,0 +1,247 @@
+/*
+ * Copyright 2016, Grinn
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "server.h"
+
+#include "bus.h"
+#include "compat.h"
+#include "easydbus.h"
+#include "error.h"
+#include "threads.h"
+
+#include <gio/gio.h>
+#include <unistd.h>
+
+static int server_mt;
+#define SERVER_MT ((void *) &server_mt)
+
+struct server {
+    struct easydbus_state *state;
+    GDBusServer *server;
+    GDBusAuthObserver *observer;
+    gulong handler_id;
+    int ref;
+};
+
+/*
+ * Called from GDBus worker thread, so no Lua is run here. Peers without
+ * credentials, e.g. authenticated anonymously, are rejected.
+ */
+static gboolean authorize_peer(GDBusAuthObserver *observer, GIOStream *stream,
+                               GCredentials *credentials, gpointer user_data)
+{
+    uid_t uid = GPOINTER_TO_UINT(user_data);
+    GError *error = NULL;
+    uid_t peer_uid;
+
+    if (!credentials) {
+        g_debug("%s: no peer credentials", __FUNCTION__);
+        return FALSE;
+    }
+
+    peer_uid = g_credentials_get_unix_user(credentials, &error);
+    if (error) {
+        g_debug("%s: %s", __FUNCTION__, error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+
+    g_debug("%s: peer_uid=%u uid=%u", __FUNCTION__, (unsigned) peer_uid, (unsigned) uid);
+
+    return peer_uid == uid;
+}
+
+static struct server *server_check(lua_State *L, int index)
+{
+    struct server *srv = NULL;
+
+    if (lua_type(L, index) == LUA_TUSERDATA && lua_getmetatable(L, index)) {
+        lua_pushlightuserdata(L, SERVER_MT);
+        lua_rawget(L, LUA_REGISTRYINDEX);
+        if (lua_rawequal(L, -1, -2))
+            srv = lua_touserdata(L, index);
+        lua_pop(L, 2);
+    }
+
+    luaL_argcheck(L, srv && srv->server, index, "server expected");
+
+    return srv;
+}
+
+/*
+ * Peer connection is kept until it is closed by either side.
+ */
+static gboolean on_new_connection(GDBusServer *server, GDBusConnection *conn, gpointer user_data)
+{
+    struct server *srv = user_data;
+    struct easydbus_state *state = srv->state;
+    lua_State *T;
+    int n_args;
+    int ret;
+    int i;
+
+    g_debug("%s: conn=%p", __FUNCTION__, (void *) conn);
+
+    conn_keep_until_closed(g_object_ref(conn));
+
+    T = thread_acquire(state);
+
+    lua_rawgeti(T, LUA_REGISTRYINDEX, srv->ref);
+    n_args = lua_rawlen(T, 1);
+    for (i = 1; i <= n_args; i++)
+        lua_rawgeti(T, 1, i);
+    push_conn(T, state, conn);
+
+    ret = ed_resume(T, n_args);
+    if (ret && ret != LUA_YIELD)
+        g_warning("connection handler error: %s", lua_tostring(T, -1));
+
+    thread_release(state, T);
+
+    return TRUE;
+}
+
+static int server_address(lua_State *L)
+{
+    struct server *srv = server_check(L, 1);
+
+    lua_pushstring(L, g_dbus_server_get_client_address(srv->server));
+    return 1;
+}
+
+static int server_stop(lua_State *L)
+{
+    struct server *srv = server_check(L, 1);
+
+    g_dbus_server_stop(srv->server);
+    return 0;
+}
+
+static int server__gc(lua_State *L)
+{
+    struct server *srv = lua_touserdata(L, 1);
+
+    if (!srv->server)
+        return 0;
+
+    g_debug("%s: %p", __FUNCTION__, (void *) srv);
+
+    g_signal_handler_disconnect(srv->server, srv->handler_id);
+    g_dbus_server_stop(srv->server);
+    g_object_unref(srv->server);
+    srv->server = NULL;
+    g_object_unref(srv->observer);
+
+    luaL_unref(L, LUA_REGISTRYINDEX, srv->ref);
+
+    return 0;
+}
+
+static luaL_Reg server_funcs[] = {
+    {"address", server_address},
+    {"stop", server_stop},
+    {"__gc", server__gc},
+    {NULL, NULL},
+};
+
+/*
+ * Args:
+ * 1) address to listen on, e.g. 'unix:path=/run/example' or
+ *    'unix:abstract=example'
+ * options (optional table, following args are shifted by one):
+ *    uid - only peers running as this user are accepted, by default the
+ *          user of this process
+ * 2) callback, called with bus object of every new peer connection
+ * ...) callback args, passed before bus object
+ */
+static int easydbus_server(lua_State *L)
+{
+    struct easydbus_state *state = lua_touserdata(L, lua_upvalueindex(1));
+    const char *address = luaL_checkstring(L, 1);
+    int a = lua_istable(L, 2) ? 3 : 2; /* callback */
+    int n_args = lua_gettop(L);
+    lua_Integer uid = getuid();
+    GDBusAuthObserver *observer;
+    GDBusServer *server;
+    GError *error = NULL;
+    struct server *srv;
+    gchar *guid;
+    int i;
+
+    if (a == 3) {
+        lua_getfield(L, 2, "uid");
+        if (!lua_isnil(L, -1)) {
+            luaL_argcheck(L, lua_isnumber(L, -1), 2, "uid is not a number");
+            uid = lua_tointeger(L, -1);
+            luaL_argcheck(L, uid >= 0 && uid <= G_MAXUINT32, 2, "uid out of range");
+        }
+        lua_pop(L, 1);
+    }
+    luaL_argcheck(L, lua_isfunction(L, a), a, "Is not a function");
+
+    observer = g_dbus_auth_observer_new();
+    g_signal_connect(observer, "authorize-authenticated-peer",
+                     G_CALLBACK(authorize_peer), GUINT_TO_POINTER((guint) uid));
+
+    guid = g_dbus_generate_guid();
+    server = g_dbus_server_new_sync(address,
+                                    G_DBUS_SERVER_FLAGS_NONE,
+                                    guid,
+                                    observer,
+                                    NULL, /* cancellable */
+                                    &error);
+    g_free(guid);
+
+    if (!server) {
+        g_object_unref(observer);
+        lua_pushnil(L);
+        push_error(L, error);
+        g_error_free(error);
+        return 2;
+    }
+
+    srv = lua_newuserdata(L, sizeof(*srv));
+    srv->state = state;
+    srv->server = server;
+    srv->observer = observer;
+
+    lua_pushlightuserdata(L, SERVER_MT);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_setmetatable(L, -2);
+
+    lua_createtable(L, n_args - a + 1, 0);
+    for (i = a; i <= n_args; i++) {
+        lua_pushvalue(L, i);
+        lua_rawseti(L, -2, i - a + 1);
+    }
+    srv->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    /* Emitted in thread-default main context, which is the one of state */
+    srv->handler_id = g_signal_connect(server, "new-connection",
+                                       G_CALLBACK(on_new_connection), srv);
+    g_dbus_server_start(server);
+
+    g_debug("%s: listening on %s", __FUNCTION__, g_dbus_server_get_client_address(server));
+
+    return 1;
+}
+
+int luaopen_easydbus_server(lua_State *L)
+{
+    /* Set server mt in registry */
+    lua_pushlightuserdata(L, SERVER_MT);
+    luaL_newlibtable(L, server_funcs);
+    luaL_setfuncs(L, server_funcs, 0);
+    lua_pushliteral(L, "__index");
+    lua_pushvalue(L, -2);
+    lua_rawset(L, -3);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
+    lua_pushvalue(L, 1);
+    lua_pushcclosure(L, easydbus_server, 1);
+
+    return 1;
+}
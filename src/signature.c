@@ -0,0 +1,262 @@
+/*
+ * Copyright 2016, Grinn
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "signature.h"
+
+#include "compat.h"
+
+#include <string.h>
+
+static int signature_mt;
+#define SIGNATURE_MT ((void *) &signature_mt)
+
+G_LOCK_DEFINE_STATIC(signatures);
+static GHashTable *signatures;
+
+static guint compile_types(const gchar *start, const gchar *end, struct signature_type **types);
+
+static const gchar *intern_range(const gchar *start, const gchar *end)
+{
+    gchar *str = g_strndup(start, end - start);
+    const gchar *interned = g_intern_string(str);
+
+    g_free(str);
+
+    return interned;
+}
+
+static inline gsize align_offset(gsize offset, guint alignment)
+{
+    return (offset + alignment - 1) & ~((gsize) alignment - 1);
+}
+
+/*
+ * Alignment and fixed size follow GVariant serialization format, so values
+ * can be written directly into serialized buffer.
+ */
+static void set_type_info(struct signature_type *type)
+{
+    const struct signature_type *child;
+    gsize offset = 0;
+    gboolean fixed = TRUE;
+    guint i;
+
+    switch (type->sig[0]) {
+    case 'b':
+    case 'y':
+        type->alignment = 1;
+        type->fixed_size = 1;
+        break;
+    case 'n':
+    case 'q':
+        type->alignment = 2;
+        type->fixed_size = 2;
+        break;
+    case 'i':
+    case 'u':
+    case 'h':
+        type->alignment = 4;
+        type->fixed_size = 4;
+        break;
+    case 'x':
+    case 't':
+    case 'd':
+        type->alignment = 8;
+        type->fixed_size = 8;
+        break;
+    case 'v':
+        type->alignment = 8;
+        type->fixed_size = 0;
+        break;
+    case 'a':
+        type->alignment = type->children[0].alignment;
+        type->fixed_size = 0;
+        break;
+    case '(':
+    case '{':
+        type->alignment = 1;
+        for (i = 0; i < type->n_children; i++) {
+            child = &type->children[i];
+
+            type->alignment = MAX(type->alignment, child->alignment);
+            if (child->fixed_size)
+                offset = align_offset(offset, child->alignment) + child->fixed_size;
+            else
+                fixed = FALSE;
+        }
+
+        if (fixed) {
+            offset = align_offset(offset, type->alignment);
+            /* Unit type occupies one byte */
+            type->fixed_size = offset ? offset : 1;
+        } else {
+            type->fixed_size = 0;
+        }
+        break;
+    default:
+        type->alignment = 1;
+        type->fixed_size = 0;
+    }
+}
+
+static void compile_type(struct signature_type *type, const gchar *start, const gchar *end)
+{
+    type->sig = intern_range(start, end);
+
+    switch (start[0]) {
+    case 'a':
+        type->n_children = compile_types(start + 1, end, &type->children);
+        break;
+    case '(':
+    case '{':
+        type->n_children = compile_types(start + 1, end - 1, &type->children);
+        break;
+    default:
+        type->n_children = 0;
+        type->children = NULL;
+    }
+
+    set_type_info(type);
+}
+
+static guint compile_types(const gchar *start, const gchar *end, struct signature_type **types)
+{
+    const gchar *startptr, *endptr;
+    guint i, n = 0;
+
+    for (startptr = start; startptr < end; startptr = endptr) {
+        g_variant_type_string_scan(startptr, end, &endptr);
+        n++;
+    }
+
+    *types = n ? g_new0(struct signature_type, n) : NULL;
+
+    for (startptr = start, i = 0; startptr < end; startptr = endptr, i++) {
+        g_variant_type_string_scan(startptr, end, &endptr);
+        compile_type(&(*types)[i], startptr, endptr);
+    }
+
+    return n;
+}
+
+static struct signature *compile_signature(const char *sig)
+{
+    struct signature *signature;
+    gchar *tuple;
+
+    g_debug("%s: sig=%s", __FUNCTION__, sig);
+
+    signature = g_new0(struct signature, 1);
+    signature->sig = g_intern_string(sig);
+
+    tuple = g_strconcat("(", sig, ")", NULL);
+    compile_type(&signature->tuple, tuple, tuple + strlen(tuple));
+    g_free(tuple);
+
+    return signature;
+}
+
+/*
+ * Returns compiled signature or NULL if sig is not a valid D-Bus signature.
+ */
+const struct signature *signature_lookup(const char *sig)
+{
+    struct signature *signature;
+
+    G_LOCK(signatures);
+
+    if (!signatures)
+        signatures = g_hash_table_new(g_str_hash, g_str_equal);
+
+    signature = g_hash_table_lookup(signatures, sig);
+    if (!signature && g_variant_is_signature(sig)) {
+        signature = compile_signature(sig);
+        g_hash_table_insert(signatures, (gpointer) signature->sig, signature);
+    }
+
+    G_UNLOCK(signatures);
+
+    return signature;
+}
+
+/*
+ * Accepts signature string or precompiled signature object. Returns NULL for
+ * nil and false, which means that types should be guessed from Lua values.
+ */
+const struct signature *signature_check(lua_State *L, int index)
+{
+    const struct signature *signature;
+    const char *sig;
+
+    switch (lua_type(L, index)) {
+    case LUA_TSTRING:
+        sig = lua_tostring(L, index);
+        signature = signature_lookup(sig);
+        if (!signature)
+            luaL_error(L, "Invalid signature: %s", sig);
+        return signature;
+    case LUA_TUSERDATA:
+        if (lua_getmetatable(L, index)) {
+            lua_pushlightuserdata(L, SIGNATURE_MT);
+            lua_rawget(L, LUA_REGISTRYINDEX);
+            if (lua_rawequal(L, -1, -2)) {
+                lua_pop(L, 2);
+                return *(const struct signature **) lua_touserdata(L, index);
+            }
+            lua_pop(L, 2);
+        }
+        luaL_argerror(L, index, "signature expected");
+        return NULL;
+    default:
+        return NULL;
+    }
+}
+
+static int signature__tostring(lua_State *L)
+{
+    const struct signature **signature = lua_touserdata(L, 1);
+
+    lua_pushstring(L, (*signature)->sig);
+    return 1;
+}
+
+static luaL_Reg signature_funcs[] = {
+    {"__tostring", signature__tostring},
+    {NULL, NULL},
+};
+
+/*
+ * Args:
+ * 1) signature string
+ */
+static int easydbus_signature(lua_State *L)
+{
+    const struct signature **signature;
+
+    luaL_argcheck(L, lua_type(L, 1) == LUA_TSTRING, 1, "string expected");
+
+    signature = lua_newuserdata(L, sizeof(*signature));
+    *signature = signature_check(L, 1);
+
+    lua_pushlightuserdata(L, SIGNATURE_MT);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_setmetatable(L, -2);
+
+    return 1;
+}
+
+int luaopen_easydbus_signature(lua_State *L)
+{
+    /* Set signature mt in registry */
+    lua_pushlightuserdata(L, SIGNATURE_MT);
+    luaL_newlibtable(L, signature_funcs);
+    luaL_setfuncs(L, signature_funcs, 0);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
+    lua_pushcfunction(L, easydbus_signature);
+
+    return 1;
+}
@@ -0,0 +1,36 @@
+/*
+ * Copyright 2016, Grinn
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+#include <gio/gio.h>
+
+/*
+ * Compiled D-Bus signature. Signatures are parsed once, interned in a process
+ * wide cache and never freed, so pointers to them may be kept anywhere
+ * (including light userdata) and shared between threads.
+ */
+struct signature_type {
+    const gchar *sig;      /* interned single complete type, e.g. "a{sv}" */
+    guint alignment;       /* serialized alignment: 1, 2, 4 or 8 */
+    gsize fixed_size;      /* serialized size or 0 if size is variable */
+    guint n_children;      /* array: 1, dict entry: 2, tuple: n, basic: 0 */
+    struct signature_type *children;
+};
+
+struct signature {
+    const gchar *sig;      /* interned signature, e.g. "sa{sv}" */
+    struct signature_type tuple; /* all types as tuple, e.g. "(sa{sv})" */
+};
+
+const struct signature *signature_lookup(const char *sig);
+const struct signature *signature_check(lua_State *L, int index);
+
+int luaopen_easydbus_signature(lua_State *L);
@@ -0,0 +1,77 @@
+/*
+ * Copyright 2016, Grinn
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "threads.h"
+
+#include "compat.h"
+
+static int thread_pool;
+#define THREAD_POOL ((void *) &thread_pool)
+
+/* Number of idle threads kept for reuse */
+#define THREAD_POOL_MAX 32
+
+static void push_thread_pool(lua_State *L)
+{
+    lua_pushlightuserdata(L, THREAD_POOL);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        lua_createtable(L, THREAD_POOL_MAX, 0);
+        lua_pushlightuserdata(L, THREAD_POOL);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, LUA_REGISTRYINDEX);
+    }
+}
+
+/*
+ * Pushes idle thread on state->L stack, taken from pool or newly created.
+ */
+lua_State *thread_acquire(struct easydbus_state *state)
+{
+    lua_State *L = state->L;
+    int n;
+
+    push_thread_pool(L);
+
+    n = lua_rawlen(L, -1);
+    if (n) {
+        lua_rawgeti(L, -1, n);
+        lua_pushnil(L);
+        lua_rawseti(L, -3, n);
+    } else {
+        lua_newthread(L);
+    }
+
+    lua_remove(L, -2);
+
+    return lua_tothread(L, -1);
+}
+
+/*
+ * Pops thread acquired with thread_acquire() from state->L stack. Thread is
+ * put back to pool only if it has finished cleanly, so suspended threads and
+ * threads with errors are left to garbage collector.
+ */
+void thread_release(struct easydbus_state *state, lua_State *T)
+{
+    lua_State *L = state->L;
+    int n;
+
+    if (lua_status(T) == 0) {
+        lua_settop(T, 0);
+
+        push_thread_pool(L);
+        n = lua_rawlen(L, -1);
+        if (n < THREAD_POOL_MAX) {
+            lua_pushvalue(L, -2);
+            lua_rawseti(L, -2, n + 1);
+        }
+        lua_pop(L, 1);
+    }
+
+    lua_pop(L, 1);
+}
@@ -0,0 +1,12 @@
+/*
+ * Copyright 2016, Grinn
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include "easydbus.h"
+
+lua_State *thread_acquire(struct easydbus_state *state);
+void thread_release(struct easydbus_state *state, lua_State *T);
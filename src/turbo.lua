@@ -5,10 +5,9 @@
 --
 
 local wrapper = {}
-wrapper.fds = {}
+wrapper.epoll_fd = false
 wrapper.timeout = false
-
-local unpack = unpack or table.unpack
+wrapper.pending = false
 
 function wrapper:init(easydbus, turbo)
    local yield = coroutine.yield
@@ -19,11 +18,29 @@ function wrapper:init(easydbus, turbo)
    self.turbo = turbo
    self.time = turbo.util.gettimemonotonic
 
-   easydbus.set_epoll_cb(self.update_fds, self)
+   easydbus.set_epoll_cb(self.update_epoll, self)
 
    self.old_bus_call = easydbus.bus.call
-   easydbus.bus.call = function(...)
-      return yield(task(self.old_bus_call, ...))
+   easydbus.bus.call = function(bus, opts, ...)
+      if type(opts) == 'table' and opts.no_reply then
+         return self.old_bus_call(bus, opts, ...)
+      end
+      return yield(task(self.old_bus_call, bus, opts, ...))
+   end
+
+   self.old_bus_call_many = easydbus.bus.call_many
+   easydbus.bus.call_many = function(...)
+      return yield(task(self.old_bus_call_many, ...))
+   end
+
+   self.old_introspect = easydbus.bus.introspect
+   easydbus.bus.introspect = function(...)
+      return yield(task(self.old_introspect, ...))
+   end
+
+   self.old_proxy_call = easydbus.proxy.call
+   easydbus.proxy.call = function(...)
+      return yield(task(self.old_proxy_call, ...))
    end
 
    self.old_request_name = easydbus.bus.request_name
@@ -31,43 +48,33 @@ function wrapper:init(easydbus, turbo)
       return yield(task(self.old_request_name, ...))
    end
 end
-function wrapper:add_fds(fds)
-   for _,fd_rec in pairs(fds) do
-      local fd = fd_rec.fd
-      local events = fd_rec.events
-      self.tio:add_handler(fd, events, self.fd_handler, self)
-   end
-end
-function wrapper:delete_fds(fds)
-   for _,fd_rec in pairs(fds) do
-      local fd = fd_rec.fd
-      self.tio:remove_handler(fd)
-   end
-end
 function wrapper:fd_handler_cont()
-   self.easydbus.handle_epoll(unpack(self.epoll_fds))
-   self.epoll_fds = false
+   self.pending = false
+   self.easydbus.handle_epoll()
 end
-function wrapper:fd_handler(fd, revents)
-   local new_entry = {fd, revents}
-   if not self.epoll_fds then
-      self.epoll_fds = {new_entry}
+function wrapper:fd_handler()
+   if not self.pending then
+      self.pending = true
       self.tio:add_callback(self.fd_handler_cont, self)
-   else
-      table.insert(self.epoll_fds, new_entry)
    end
 end
 function wrapper:timeout_handler()
+   self.timeout = false
    self.easydbus.handle_epoll()
 end
-function wrapper:update_fds(fds, timeout)
+-- all fds are watched through single epoll_fd
+function wrapper:update_epoll(epoll_fd, timeout)
    if self.timeout then
       self.tio:remove_timeout(self.timeout)
       self.timeout = false
    end
-   self:delete_fds(self.fds)
-   self.fds = fds
-   self:add_fds(self.fds)
+   if epoll_fd ~= self.epoll_fd then
+      if self.epoll_fd then
+         self.tio:remove_handler(self.epoll_fd)
+      end
+      self.epoll_fd = epoll_fd
+      self.tio:add_handler(epoll_fd, self.turbo.ioloop.READ, self.fd_handler, self)
+   end
    if timeout >= 0 then
       self.timeout = self.tio:add_timeout(self.time() + timeout, self.timeout_handler, self)
    end
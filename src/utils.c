@@ -4,12 +4,103 @@
  * SPDX-License-Identifier: MIT
  */
 
+#include "bytes.h"
 #include "compat.h"
+#include "lazy.h"
 #include "utils.h"
 
 #include <string.h>
 
-int push_variant(lua_State *L, GVariant *value, GUnixFDList *fd_list)
+static void push_fixed_array(lua_State *L, GVariant *value, char elem_type, guint flags)
+{
+    gconstpointer data;
+    gsize n, i;
+
+    switch (elem_type) {
+    case 'y':
+        if (flags & DECODE_BYTES_BUFFER) {
+            push_bytes(L, value);
+            break;
+        }
+        data = g_variant_get_fixed_array(value, &n, sizeof(guint8));
+        if (flags & DECODE_BYTES_STRING) {
+            lua_pushlstring(L, data, n);
+            break;
+        }
+        lua_createtable(L, n, 0);
+        for (i = 0; i < n; i++) {
+            lua_pushinteger(L, ((const guint8 *) data)[i]);
+            lua_rawseti(L, -2, i + 1);
+        }
+        break;
+    case 'b':
+        data = g_variant_get_fixed_array(value, &n, sizeof(guint8));
+        lua_createtable(L, n, 0);
+        for (i = 0; i < n; i++) {
+            lua_pushboolean(L, ((const guint8 *) data)[i] ? 1 : 0);
+            lua_rawseti(L, -2, i + 1);
+        }
+        break;
+    case 'n':
+        data = g_variant_get_fixed_array(value, &n, sizeof(gint16));
+        lua_createtable(L, n, 0);
+        for (i = 0; i < n; i++) {
+            lua_pushinteger(L, ((const gint16 *) data)[i]);
+            lua_rawseti(L, -2, i + 1);
+        }
+        break;
+    case 'q':
+        data = g_variant_get_fixed_array(value, &n, sizeof(guint16));
+        lua_createtable(L, n, 0);
+        for (i = 0; i < n; i++) {
+            lua_pushinteger(L, ((const guint16 *) data)[i]);
+            lua_rawseti(L, -2, i + 1);
+        }
+        break;
+    case 'i':
+        data = g_variant_get_fixed_array(value, &n, sizeof(gint32));
+        lua_createtable(L, n, 0);
+        for (i = 0; i < n; i++) {
+            lua_pushinteger(L, ((const gint32 *) data)[i]);
+            lua_rawseti(L, -2, i + 1);
+        }
+        break;
+    case 'u':
+        data = g_variant_get_fixed_array(value, &n, sizeof(guint32));
+        lua_createtable(L, n, 0);
+        for (i = 0; i < n; i++) {
+            lua_pushinteger(L, ((const guint32 *) data)[i]);
+            lua_rawseti(L, -2, i + 1);
+        }
+        break;
+    case 'x':
+        data = g_variant_get_fixed_array(value, &n, sizeof(gint64));
+        lua_createtable(L, n, 0);
+        for (i = 0; i < n; i++) {
+            lua_pushinteger(L, ((const gint64 *) data)[i]);
+            lua_rawseti(L, -2, i + 1);
+        }
+        break;
+    case 't':
+        data = g_variant_get_fixed_array(value, &n, sizeof(guint64));
+        lua_createtable(L, n, 0);
+        for (i = 0; i < n; i++) {
+            lua_pushinteger(L, ((const guint64 *) data)[i]);
+            lua_rawseti(L, -2, i + 1);
+        }
+        break;
+    case 'd':
+        data = g_variant_get_fixed_array(value, &n, sizeof(gdouble));
+        lua_createtable(L, n, 0);
+        for (i = 0; i < n; i++) {
+            lua_pushnumber(L, ((const gdouble *) data)[i]);
+            lua_rawseti(L, -2, i + 1);
+        }
+        break;
+    }
+}
+
+int push_variant(lua_State *L, GVariant *value, GUnixFDList *fd_list, guint flags)
 {
     GVariant *elem;
     gsize n, i;
@@ -18,7 +109,15 @@ int push_variant(lua_State *L, GVariant *value, GUnixFDList *fd_list)
 
     switch (g_variant_classify(value)) {
     case G_VARIANT_CLASS_ARRAY:
-        if (g_variant_get_type_string(value)[1] == '{') {
+    {
+        char elem_type = g_variant_get_type_string(value)[1];
+
+        if (strchr("ybnqiuxtd", elem_type)) {
+            /* Fixed width elements are read in place, without child GVariants */
+            push_fixed_array(L, value, elem_type, flags);
+        } else if (flags & DECODE_LAZY) {
+            push_lazy(L, value, fd_list, flags);
+        } else if (elem_type == '{') {
             GVariant *key, *val;
 
             n = g_variant_n_children(value);
@@ -29,8 +128,8 @@ int push_variant(lua_State *L, GVariant *value, GUnixFDList *fd_list)
                 val = g_variant_get_child_value(elem, 1);
                 g_variant_unref(elem);
 
-                push_variant(L, key, fd_list);
-                push_variant(L, val, fd_list);
+                push_variant(L, key, fd_list, flags);
+                push_variant(L, val, fd_list, flags);
                 lua_rawset(L, -3);
 
                 g_variant_unref(key);
@@ -41,19 +140,25 @@ int push_variant(lua_State *L, GVariant *value, GUnixFDList *fd_list)
             lua_createtable(L, n, 0);
             for (i = 0; i < n; i++) {
                 elem = g_variant_get_child_value(value, i);
-                push_variant(L, elem, fd_list);
+                push_variant(L, elem, fd_list, flags);
                 lua_rawseti(L, -2, i+1);
                 g_variant_unref(elem);
             }
             return 0;
         }
         break;
+    }
     case G_VARIANT_CLASS_TUPLE:
+        if (flags & DECODE_LAZY) {
+            push_lazy(L, value, fd_list, flags);
+            break;
+        }
+
         n = g_variant_n_children(value);
         lua_createtable(L, n, 0);
         for (i = 0; i < n; i++) {
             elem = g_variant_get_child_value(value, i);
-            push_variant(L, elem, fd_list);
+            push_variant(L, elem, fd_list, flags);
             lua_rawseti(L, -2, i+1);
             g_variant_unref(elem);
         }
@@ -101,7 +206,7 @@ int push_variant(lua_State *L, GVariant *value, GUnixFDList *fd_list)
         break;
     case G_VARIANT_CLASS_VARIANT:
         elem = g_variant_get_variant(value);
-        push_variant(L, elem, fd_list);
+        push_variant(L, elem, fd_list, flags);
         g_variant_unref(elem);
         break;
     default:
@@ -116,7 +221,7 @@ int push_variant(lua_State *L, GVariant *value, GUnixFDList *fd_list)
     return 1;
 }
 
-int push_tuple(lua_State *L, GVariant *value, GUnixFDList *fd_list)
+int push_tuple(lua_State *L, GVariant *value, GUnixFDList *fd_list, guint flags)
 {
     GVariant *elem;
     gsize n, i;
@@ -124,261 +229,575 @@ int push_tuple(lua_State *L, GVariant *value, GUnixFDList *fd_list)
     n = g_variant_n_children(value);
     for (i = 0; i < n; i++) {
         elem = g_variant_get_child_value(value, i);
-        push_variant(L, elem, fd_list);
+        push_variant(L, elem, fd_list, flags);
         g_variant_unref(elem);
     }
 
     return n;
 }
 
-static GVariant *to_variant(lua_State *L, int index, const char *sig, GUnixFDList *fd_list);
+/*
+ * Lua values are serialized directly into GVariant serialization format, so
+ * whole message body is built in one buffer and wrapped with a single
+ * g_variant_new_from_bytes(). Values are written in native byte order and
+ * framing offsets in little endian, as GVariant expects.
+ *
+ * Buffers are kept per thread and reused between calls, so no allocation
+ * takes place once they have grown. Buffers grown by a single large message
+ * are released afterwards, so they do not pin its memory for good.
+ * Marshalling never calls back into Lua, thus it is not reentered.
+ */
+struct marshal {
+    GByteArray *data;
+    GArray *offsets; /* stack of framing offsets of open containers */
+    guint max_offsets; /* most offsets on stack at once */
+    GUnixFDList *fd_list;
+};
+
+static void guess_free(gpointer data)
+{
+    g_string_free(data, TRUE);
+}
+
+static GPrivate marshal_data = G_PRIVATE_INIT((GDestroyNotify) g_byte_array_unref);
+static GPrivate marshal_offsets = G_PRIVATE_INIT((GDestroyNotify) g_array_unref);
+static GPrivate marshal_guess = G_PRIVATE_INIT(guess_free);
+
+/* Largest buffer size kept for reuse, in bytes */
+#define MARSHAL_BUFFER_MAX (64 * 1024)
+
+static const guint8 zeros[8];
+
+static void write_value(lua_State *L, int index, const struct signature_type *type, struct marshal *m);
+
+static const struct signature_type *lookup_type(lua_State *L, const char *sig)
+{
+    const struct signature *signature = sig ? signature_lookup(sig) : NULL;
+
+    if (!signature || signature->tuple.n_children != 1)
+        luaL_error(L, "Invalid value type: %s", sig);
+
+    return signature->tuple.children;
+}
+
+static const struct signature_type *guess_type(lua_State *L, int index)
+{
+    const struct signature_type *type;
+    const struct lazy *lazy;
+    const char *sig;
+
+    switch (lua_type(L, index)) {
+    case LUA_TBOOLEAN:
+        return lookup_type(L, "b");
+    case LUA_TNUMBER:
+        return lookup_type(L, "i");
+    case LUA_TSTRING:
+        return lookup_type(L, "s");
+    case LUA_TTABLE:
+        if (easydbus_is_dbus_type(L, index)) {
+            lua_rawgeti(L, index, 2);
+            type = lookup_type(L, lua_tostring(L, -1));
+            lua_pop(L, 1);
+            return type;
+        }
+
+        if (lua_rawlen(L, index) == 0)
+            return lookup_type(L, "a{sv}");
 
-static GVariant *to_tuple(lua_State *L, int index, const char *sig, GUnixFDList *fd_list)
+        lua_rawgeti(L, index, 1);
+        switch (lua_type(L, -1)) {
+        case LUA_TBOOLEAN:
+            sig = "ab";
+            break;
+        case LUA_TSTRING:
+            sig = "as";
+            break;
+        case LUA_TNUMBER:
+            if (lua_isinteger(L, -1))
+                sig = "ai";
+            else
+                sig = "ad";
+            break;
+        default:
+            sig = "av";
+        }
+        lua_pop(L, 1);
+        return lookup_type(L, sig);
+    case LUA_TUSERDATA:
+        lazy = lazy_test(L, index);
+        if (lazy)
+            return lookup_type(L, g_variant_get_type_string(lazy->value));
+        if (bytes_test(L, index))
+            return lookup_type(L, "ay");
+        /* fallthrough */
+    default:
+        luaL_error(L, "Unsupported output type: %s", lua_typename(L, lua_type(L, index)));
+        return NULL;
+    }
+}
+
+/*
+ * Signature of values at stack indexes [index_begin, index_end) guessed from
+ * Lua types.
+ */
+static const struct signature *guess_signature(lua_State *L, int index_begin, int index_end)
 {
-    GVariantBuilder elem_builder;
-    char *elem_sig;
+    GString *sig = g_private_get(&marshal_guess);
     int i;
-    int n_arg = lua_rawlen(L, index);
-    int ret;
-    const char *startptr, *endptr;
-
-    startptr = &sig[1];
-
-    g_variant_builder_init(&elem_builder, G_VARIANT_TYPE_TUPLE);
-
-    for (i = 1; i <= n_arg; i++) {
-        lua_rawgeti(L, index, i);
-        ret = g_variant_type_string_scan(startptr, NULL, &endptr);
-        if (!ret)
-            g_error("Invalid tuple type: %s", startptr);
-        elem_sig = g_strndup(startptr, endptr - startptr);
-        g_variant_builder_add_value(&elem_builder, to_variant(L, lua_gettop(L), elem_sig, fd_list));
-        g_free(elem_sig);
+
+    if (!sig) {
+        sig = g_string_new(NULL);
+        g_private_set(&marshal_guess, sig);
+    }
+
+    g_string_truncate(sig, 0);
+    for (i = index_begin; i < index_end; i++)
+        g_string_append(sig, guess_type(L, i)->sig);
+
+    return signature_lookup(sig->str);
+}
+
+static inline void write_padding(struct marshal *m, guint alignment)
+{
+    gsize padding = -m->data->len & (alignment - 1);
+
+    if (padding)
+        g_byte_array_append(m->data, zeros, padding);
+}
+
+static void write_zeros(struct marshal *m, gsize size)
+{
+    while (size > 0) {
+        gsize n = MIN(size, sizeof(zeros));
+
+        g_byte_array_append(m->data, zeros, n);
+        size -= n;
+    }
+}
+
+static inline void push_offset(struct marshal *m, gsize start)
+{
+    gsize offset = m->data->len - start;
+
+    g_array_append_val(m->offsets, offset);
+    m->max_offsets = MAX(m->max_offsets, m->offsets->len);
+}
+
+static guint offset_size(gsize body_size, gsize n_offsets)
+{
+    if (body_size + n_offsets <= G_MAXUINT8)
+        return 1;
+    if (body_size + 2 * n_offsets <= G_MAXUINT16)
+        return 2;
+    if (body_size + 4 * n_offsets <= G_MAXUINT32)
+        return 4;
+    return 8;
+}
+
+/*
+ * Append framing offsets pushed since first_offset and pop them. Arrays keep
+ * offsets in order, tuples in reverse order.
+ */
+static void write_offsets(struct marshal *m, gsize start, guint first_offset, gboolean reverse)
+{
+    guint n_offsets = m->offsets->len - first_offset;
+    guint size, i;
+    guint64 offset;
+
+    if (n_offsets == 0)
+        return;
+
+    size = offset_size(m->data->len - start, n_offsets);
+
+    for (i = 0; i < n_offsets; i++) {
+        offset = g_array_index(m->offsets, gsize, first_offset + (reverse ? n_offsets - 1 - i : i));
+        offset = GUINT64_TO_LE(offset);
+        g_byte_array_append(m->data, (const guint8 *) &offset, size);
+    }
+
+    g_array_set_size(m->offsets, first_offset);
+}
+
+static int unwrap_dbus_type(lua_State *L, int index, const struct signature_type *type)
+{
+    const char *val_type;
+
+    /* Check value type and signature */
+    lua_rawgeti(L, index, 2);
+    val_type = lua_tostring(L, -1);
+    if (g_strcmp0(val_type, type->sig) != 0)
+        luaL_error(L, "Value type (%s) is different than signature (%s)", val_type, type->sig);
+    lua_pop(L, 1);
+
+    /* Push value */
+    lua_rawgeti(L, index, 1);
+    return lua_gettop(L);
+}
+
+/*
+ * Write fixed size basic type at already reserved and aligned position.
+ */
+static void write_fixed(lua_State *L, int index, const struct signature_type *type, gsize pos, struct marshal *m)
+{
+    guint8 *dest = m->data->data + pos;
+    GError *error = NULL;
+    gboolean is_type = FALSE;
+    union {
+        guint8 y;
+        gint16 n;
+        guint16 q;
+        gint32 i;
+        guint32 u;
+        gint64 x;
+        guint64 t;
+        gdouble d;
+    } v;
+
+    if (easydbus_is_dbus_type(L, index)) {
+        index = unwrap_dbus_type(L, index, type);
+        is_type = TRUE;
+    }
+
+    switch (type->sig[0]) {
+    case 'b':
+        v.y = lua_toboolean(L, index) ? 1 : 0;
+        break;
+    case 'y':
+        v.y = lua_tointeger(L, index);
+        break;
+    case 'n':
+        v.n = lua_tointeger(L, index);
+        break;
+    case 'q':
+        v.q = lua_tointeger(L, index);
+        break;
+    case 'i':
+        v.i = lua_tointeger(L, index);
+        break;
+    case 'u':
+        v.u = lua_tointeger(L, index);
+        break;
+    case 'x':
+        v.x = lua_tointeger(L, index);
+        break;
+    case 't':
+        v.t = lua_tointeger(L, index);
+        break;
+    case 'd':
+        v.d = lua_tonumber(L, index);
+        break;
+    case 'h':
+        if (!m->fd_list)
+            luaL_error(L, "FD is not supported");
+        v.i = g_unix_fd_list_append(m->fd_list, lua_tointeger(L, index), &error);
+        if (v.i < 0) {
+            lua_pushfstring(L, "Failed to add handle: %s", error->message);
+            g_error_free(error);
+            lua_error(L);
+        }
+        break;
+    default:
+        luaL_error(L, "Unsupported output signature: %s", type->sig);
+    }
+
+    memcpy(dest, &v, type->fixed_size);
+
+    /* Remove pushed value from type table */
+    if (is_type)
         lua_pop(L, 1);
-        startptr = endptr;
+}
+
+static void write_string(lua_State *L, int index, const struct signature_type *type, struct marshal *m)
+{
+    size_t len;
+    const char *str = lua_tolstring(L, index, &len);
+
+    if (!str)
+        luaL_error(L, "string expected");
+
+    switch (type->sig[0]) {
+    case 's':
+        /* Embedded nul bytes are rejected too */
+        if (!g_utf8_validate(str, len, NULL))
+            luaL_error(L, "Invalid UTF-8 string");
+        break;
+    case 'o':
+        if (strlen(str) != len || !g_variant_is_object_path(str))
+            luaL_error(L, "Invalid object path: %s", str);
+        break;
+    case 'g':
+        if (strlen(str) != len || !g_variant_is_signature(str))
+            luaL_error(L, "Invalid signature: %s", str);
+        break;
     }
 
-    return g_variant_builder_end(&elem_builder);
+    /* Include terminating nul byte */
+    g_byte_array_append(m->data, (const guint8 *) str, len + 1);
 }
 
-static GVariant *to_array(lua_State *L, int index, const char *sig, GUnixFDList *fd_list)
+/*
+ * Write tuple or dict entry members. Members are read from table at index or,
+ * if index is 0, from stack starting at first.
+ */
+static void write_members(lua_State *L, int index, int first, const struct signature_type *type, struct marshal *m)
 {
-    GVariantBuilder array_builder;
+    gsize start = m->data->len;
+    guint first_offset = m->offsets->len;
+    const struct signature_type *child;
+    guint i;
+
+    for (i = 0; i < type->n_children; i++) {
+        child = &type->children[i];
+
+        if (index) {
+            lua_rawgeti(L, index, i + 1);
+            write_value(L, lua_gettop(L), child, m);
+            lua_pop(L, 1);
+        } else {
+            write_value(L, first + i, child, m);
+        }
+
+        if (!child->fixed_size && i + 1 < type->n_children)
+            push_offset(m, start);
+    }
+
+    if (type->fixed_size)
+        write_zeros(m, start + type->fixed_size - m->data->len);
+    else
+        write_offsets(m, start, first_offset, TRUE);
+}
+
+static void write_tuple(lua_State *L, int index, const struct signature_type *type, struct marshal *m)
+{
+    if ((guint) lua_rawlen(L, index) != type->n_children)
+        luaL_error(L, "Invalid number of elements for tuple type: %s", type->sig);
+
+    write_members(L, index, 0, type, m);
+}
+
+static void write_dict_entry(lua_State *L, int key, int val, const struct signature_type *type, struct marshal *m)
+{
+    gsize start;
+    guint first_offset = m->offsets->len;
+
+    write_padding(m, type->alignment);
+    start = m->data->len;
+
+    write_value(L, key, &type->children[0], m);
+    if (!type->children[0].fixed_size)
+        push_offset(m, start);
+    write_value(L, val, &type->children[1], m);
+
+    if (type->fixed_size)
+        write_zeros(m, start + type->fixed_size - m->data->len);
+    else
+        write_offsets(m, start, first_offset, TRUE);
+}
+
+static void write_array(lua_State *L, int index, const struct signature_type *type, struct marshal *m)
+{
+    const struct signature_type *elem_type = &type->children[0];
+    gsize start = m->data->len;
+    guint first_offset = m->offsets->len;
     int top = lua_gettop(L);
-    char *key_sig;
-    char *val_sig;
     int i, n_arr;
+    const struct bytes *bytes;
+    const char *str;
+    size_t len;
+
+    /* Bytes from Lua string or buffer are copied at once */
+    if (elem_type->sig[0] == 'y') {
+        if (lua_type(L, index) == LUA_TSTRING) {
+            str = lua_tolstring(L, index, &len);
+            g_byte_array_append(m->data, (const guint8 *) str, len);
+            return;
+        }
 
-    g_variant_builder_init(&array_builder, G_VARIANT_TYPE(sig));
-    if (sig[1] == '{') {
-        GVariantBuilder elem_builder;
-
-        key_sig = g_strndup(&sig[2], 1);
-        val_sig = g_strndup(&sig[3], strlen(sig) - 4);
+        bytes = bytes_test(L, index);
+        if (bytes) {
+            g_byte_array_append(m->data, bytes->data, bytes->size);
+            return;
+        }
+    }
 
+    if (elem_type->sig[0] == '{') {
         lua_pushnil(L);
         while (lua_next(L, index) != 0) {
-            g_variant_builder_init(&elem_builder, G_VARIANT_TYPE(&sig[1]));
-
-            g_variant_builder_add_value(&elem_builder, to_variant(L, top + 1, key_sig, fd_list));
-            g_variant_builder_add_value(&elem_builder, to_variant(L, top + 2, val_sig, fd_list));
+            /* Copy key, so string conversion won't confuse lua_next() */
+            lua_pushvalue(L, top + 1);
+            write_dict_entry(L, top + 3, top + 2, elem_type, m);
+            if (!elem_type->fixed_size)
+                push_offset(m, start);
 
-            g_variant_builder_add_value(&array_builder, g_variant_builder_end(&elem_builder));
+            lua_pop(L, 2);
+        }
+    } else if (elem_type->fixed_size && !elem_type->sig[1]) {
+        gsize size = elem_type->fixed_size;
 
+        /* Fixed width basic types are stored one after another */
+        n_arr = lua_rawlen(L, index);
+        g_byte_array_set_size(m->data, start + n_arr * size);
+        for (i = 0; i < n_arr; i++) {
+            lua_rawgeti(L, index, i + 1);
+            write_fixed(L, top + 1, elem_type, start + i * size, m);
             lua_pop(L, 1);
         }
-
-        g_free(key_sig);
-        g_free(val_sig);
     } else {
-        /* TODO: handle zero length arrays */
         n_arr = lua_rawlen(L, index);
         for (i = 1; i <= n_arr; i++) {
             lua_rawgeti(L, index, i);
-            g_variant_builder_add_value(&array_builder, to_variant(L, top + 1, &sig[1], fd_list));
+            write_value(L, top + 1, elem_type, m);
+            if (!elem_type->fixed_size)
+                push_offset(m, start);
             lua_pop(L, 1);
         }
     }
 
-    return g_variant_builder_end(&array_builder);
+    write_offsets(m, start, first_offset, FALSE);
 }
 
-static GVariant *to_variant(lua_State *L, int index, const char *sig, GUnixFDList *fd_list)
+static void write_variant(lua_State *L, int index, struct marshal *m)
+{
+    const struct signature_type *type = guess_type(L, index);
+    int top = lua_gettop(L);
+
+    /* Variant holding dbus type contains its value */
+    if (easydbus_is_dbus_type(L, index)) {
+        lua_rawgeti(L, index, 1);
+        index = lua_gettop(L);
+    }
+
+    write_value(L, index, type, m);
+
+    /* Child value is followed by nul byte and its type */
+    g_byte_array_append(m->data, zeros, 1);
+    g_byte_array_append(m->data, (const guint8 *) type->sig, strlen(type->sig));
+
+    lua_settop(L, top);
+}
+
+/*
+ * Received value is copied back in its serialized form.
+ */
+static void write_lazy(lua_State *L, int index, const struct signature_type *type, struct marshal *m)
+{
+    GVariant *value = lazy_test(L, index)->value;
+
+    if (strcmp(g_variant_get_type_string(value), type->sig))
+        luaL_error(L, "Value type (%s) is different than signature (%s)", g_variant_get_type_string(value), type->sig);
+    if (strchr(type->sig, 'h'))
+        luaL_error(L, "Received value with unix fds can not be sent: %s", type->sig);
+
+    /* Buffer is trusted, so only normal form can be copied */
+    value = g_variant_get_normal_form(value);
+    g_byte_array_append(m->data, g_variant_get_data(value), g_variant_get_size(value));
+    g_variant_unref(value);
+}
+
+static void write_value(lua_State *L, int index, const struct signature_type *type, struct marshal *m)
 {
-    int n_arr;
-    GVariant *value = NULL;
-    const char *str;
-    gint handle;
-    GError *error = NULL;
     gboolean is_type = FALSE;
+    gsize pos;
 
-    g_debug("%s: index=%d sig=%s lua_type=%s", __FUNCTION__, index, sig, lua_typename(L, lua_type(L, index)));
+    g_debug("%s: index=%d sig=%s lua_type=%s", __FUNCTION__, index, type->sig, lua_typename(L, lua_type(L, index)));
 
-    if (sig && sig[0] != 'v') {
-        if (easydbus_is_dbus_type(L, index)) {
-            const char *val_type;
+    write_padding(m, type->alignment);
 
-            /* Check value type and signature */
-            lua_rawgeti(L, index, 2);
-            val_type = lua_tostring(L, -1);
-            if (g_strcmp0(val_type, sig) != 0)
-                luaL_error(L, "Value type (%s) is different than signature (%s)", val_type, sig);
-            lua_pop(L, 1);
-            is_type = TRUE;
+    if (type->fixed_size && !type->sig[1]) {
+        pos = m->data->len;
+        g_byte_array_set_size(m->data, pos + type->fixed_size);
+        write_fixed(L, index, type, pos, m);
+        return;
+    }
 
-            /* Push value */
-            lua_rawgeti(L, index, 1);
-            index = lua_gettop(L);
-        }
+    /* Variants wrap the received value, so its type is guessed below */
+    if (type->sig[0] != 'v' && lua_type(L, index) == LUA_TUSERDATA && lazy_test(L, index)) {
+        write_lazy(L, index, type, m);
+        return;
+    }
 
-        switch (sig[0]) {
-        case 'b':
-            value = g_variant_new_boolean(lua_toboolean(L, index));
-            break;
-        case 'y':
-            value = g_variant_new_byte(lua_tointeger(L, index));
-            break;
-        case 'n':
-            value = g_variant_new_int16(lua_tointeger(L, index));
-            break;
-        case 'q':
-            value = g_variant_new_uint16(lua_tointeger(L, index));
-            break;
-        case 'i':
-            value = g_variant_new_int32(lua_tointeger(L, index));
-            break;
-        case 'u':
-            value = g_variant_new_uint32(lua_tointeger(L, index));
-            break;
-        case 'x':
-            value = g_variant_new_int64(lua_tointeger(L, index));
-            break;
-        case 't':
-            value = g_variant_new_uint64(lua_tointeger(L, index));
-            break;
-        case 'd':
-            value = g_variant_new_double(lua_tonumber(L, index));
-            break;
-        case 'h':
-            if (!fd_list)
-                luaL_error(L, "FD is not supported");
-            handle = g_unix_fd_list_append(fd_list, lua_tointeger(L, index), &error);
-            if (handle < 0) {
-                lua_pushfstring(L, "Failed to add handle: %s", error->message);
-                g_error_free(error);
-                lua_error(L);
-            }
-            value = g_variant_new_handle(handle);
-            break;
-        case 's':
-            str = lua_tostring(L, index);
-            if (!str)
-                luaL_error(L, "string expected");
-            value = g_variant_new_string(str);
-            break;
-        case 'o':
-            str = lua_tostring(L, index);
-            if (!g_variant_is_object_path(str))
-                luaL_error(L, "Invalid object path: %s", str);
-            value = g_variant_new_object_path(str);
-            break;
-        case 'a':
-            value = to_array(L, index, sig, fd_list);
-            break;
-        case '(':
-            value = to_tuple(L, index, sig, fd_list);
-            break;
-        case 'v':
-            value = to_variant(L, index, sig, fd_list);
-            break;
-        default:
-            luaL_error(L, "Unsupported output signature: %s", sig);
-        }
-    } else {
-        switch (lua_type(L, index)) {
-        case LUA_TBOOLEAN:
-            value = g_variant_new_boolean(lua_toboolean(L, index) ? TRUE : FALSE);
-            break;
-        case LUA_TNUMBER:
-            value = g_variant_new_int32(lua_tointeger(L, index));
-            break;
-        case LUA_TSTRING:
-            value = g_variant_new_string(lua_tostring(L, index));
-            break;
-        case LUA_TTABLE:
-            if (easydbus_is_dbus_type(L, index)) {
-                lua_rawgeti(L, index, 2);
-                lua_rawgeti(L, index, 1);
-                value = to_variant(L, lua_gettop(L), lua_tostring(L, -2), fd_list);
-                lua_pop(L, 2);
-            } else if ((n_arr = lua_rawlen(L, index)) > 0) {
-                const char *array_sig;
-
-                lua_rawgeti(L, index, 1);
-                switch (lua_type(L, -1)) {
-                case LUA_TBOOLEAN:
-                    array_sig = "ab";
-                    break;
-                case LUA_TSTRING:
-                    array_sig = "as";
-                    break;
-                case LUA_TNUMBER:
-                    if (lua_isinteger(L, -1))
-                        array_sig = "ai";
-                    else
-                        array_sig = "ad";
-                    break;
-                default:
-                    array_sig = "av";
-                }
-                lua_pop(L, 1);
-                value = to_array(L, index, array_sig, fd_list);
-            } else {
-                value = to_array(L, index, "a{sv}", fd_list);
-            }
-            break;
-        default:
-            luaL_error(L, "Unsupported output type: %s", lua_typename(L, lua_type(L, index)));
-        }
+    if (type->sig[0] != 'v' && easydbus_is_dbus_type(L, index)) {
+        index = unwrap_dbus_type(L, index, type);
+        is_type = TRUE;
+    }
 
-        if (sig && sig[0] == 'v')
-            value = g_variant_new_variant(value);
+    switch (type->sig[0]) {
+    case 's':
+    case 'o':
+    case 'g':
+        write_string(L, index, type, m);
+        break;
+    case 'a':
+        write_array(L, index, type, m);
+        break;
+    case '(':
+        write_tuple(L, index, type, m);
+        break;
+    case 'v':
+        write_variant(L, index, m);
+        break;
+    default:
+        luaL_error(L, "Unsupported output signature: %s", type->sig);
     }
 
     /* Remove pushed value from type table */
     if (is_type)
         lua_pop(L, 1);
-
-    return value;
 }
 
-GVariant *range_to_tuple(lua_State *L, int index_begin, int index_end, const char *sig, GUnixFDList *fd_list)
+GVariant *range_to_tuple(lua_State *L, int index_begin, int index_end, const struct signature *sig, GUnixFDList *fd_list)
 {
-    GVariantBuilder builder;
-    int i;
-    int ret;
-    const char *startptr, *endptr;
-    char *subsig;
+    struct marshal m;
+    GBytes *bytes;
+    GVariant *value;
+    int n_args = index_end - index_begin;
 
     g_debug("%s: index_begin=%d index_end=%d sig=%s",
-            __FUNCTION__, index_begin, index_end, sig);
-
-    g_variant_builder_init(&builder, G_VARIANT_TYPE_TUPLE);
-    if (sig) {
-        startptr = sig;
-        for (i = index_begin; i < index_end; i++) {
-            ret = g_variant_type_string_scan(startptr, NULL, &endptr);
-            if (!ret)
-                g_error("Failed to parse signature");
-            subsig = g_strndup(startptr, endptr - startptr);
-            g_variant_builder_add_value(&builder, to_variant(L, i, subsig, fd_list));
-            g_free(subsig);
-            startptr = endptr;
-        }
-    } else {
-        for (i = index_begin; i < index_end; i++)
-            g_variant_builder_add_value(&builder, to_variant(L, i, NULL, fd_list));
+            __FUNCTION__, index_begin, index_end, sig ? sig->sig : NULL);
+
+    if (!sig) {
+        sig = guess_signature(L, index_begin, index_end);
+    } else if (n_args > (int) sig->tuple.n_children) {
+        luaL_error(L, "Too many arguments for signature: %s", sig->sig);
+    } else if (n_args < (int) sig->tuple.n_children) {
+        /* Send what was given, so peer reports type mismatch */
+        GString *prefix = g_string_new(NULL);
+        int i;
+
+        for (i = 0; i < n_args; i++)
+            g_string_append(prefix, sig->tuple.children[i].sig);
+        sig = signature_lookup(prefix->str);
+        g_string_free(prefix, TRUE);
     }
 
-    return g_variant_builder_end(&builder);
+    /* Large buffers are also left by Lua error raised in the middle */
+    m.data = g_private_get(&marshal_data);
+    if (!m.data || m.data->len > MARSHAL_BUFFER_MAX) {
+        m.data = g_byte_array_new();
+        g_private_replace(&marshal_data, m.data);
+    }
+    m.offsets = g_private_get(&marshal_offsets);
+    if (!m.offsets || m.offsets->len * sizeof(gsize) > MARSHAL_BUFFER_MAX) {
+        m.offsets = g_array_new(FALSE, FALSE, sizeof(gsize));
+        g_private_replace(&marshal_offsets, m.offsets);
+    }
+    m.max_offsets = 0;
+    m.fd_list = fd_list;
+
+    /* Buffers may be left dirty by Lua error raised in the middle */
+    g_byte_array_set_size(m.data, 0);
+    g_array_set_size(m.offsets, 0);
+
+    write_members(L, 0, index_begin, &sig->tuple, &m);
+
+    bytes = g_bytes_new(m.data->data, m.data->len);
+    value = g_variant_new_from_bytes(G_VARIANT_TYPE(sig->tuple.sig), bytes, TRUE);
+    g_bytes_unref(bytes);
+
+    if (m.data->len > MARSHAL_BUFFER_MAX)
+        g_private_replace(&marshal_data, NULL);
+    if (m.max_offsets * sizeof(gsize) > MARSHAL_BUFFER_MAX)
+        g_private_replace(&marshal_offsets, NULL);
+
+    return value;
 }
@@ -11,11 +11,17 @@
 #include "lualib.h"
 
 #include "easydbus.h"
+#include "signature.h"
 
 #include <gio/gio.h>
 #include <gio/gunixfdlist.h>
 
-int push_variant(lua_State *L, GVariant *value, GUnixFDList *fd_list);
-int push_tuple(lua_State *L, GVariant *value, GUnixFDList *fd_list);
+/* Flags controlling how received GVariant values are pushed to Lua */
+#define DECODE_BYTES_STRING     (1 << 0) /* 'ay' as Lua string */
+#define DECODE_LAZY             (1 << 1) /* containers as lazy proxies */
+#define DECODE_BYTES_BUFFER     (1 << 2) /* 'ay' as bytes buffer */
 
-GVariant *range_to_tuple(lua_State *L, int index_begin, int index_end, const char *sig, GUnixFDList *fd_list);
+int push_variant(lua_State *L, GVariant *value, GUnixFDList *fd_list, guint flags);
+int push_tuple(lua_State *L, GVariant *value, GUnixFDList *fd_list, guint flags);
+
+GVariant *range_to_tuple(lua_State *L, int index_begin, int index_end, const struct signature *sig, GUnixFDList *fd_list);
@@ -190,6 +190,13 @@ function test.proxy_concat()
    assert(assert(proxy:concat('HELLO ', 'WORLD')) == 'HELLO WORLD')
 end
 
+function test.proxy_introspect()
+   local proxy = assert(bus:new_proxy(SERVICE, PATH, true))
+   assert(proxy:add(2, 3) == 5)
+   assert(proxy:PassByte(7) == 7)
+   assert(table.concat(proxy:merge({1, 2}, {3}), ',') == '1,2,3')
+end
+
 function test.unpack_variant()
    local proxy = bus:new_proxy(SERVICE, PATH)
    proxy:add_method('VariantUnpack', INTERFACE, 'sv')